@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <vector>
+#include <unordered_map>
+#include "cd_cache.h"
+#include "profiling.h"
+#include "cfg.h"
+
+#define CDCACHE_FILE_BLOCK (32 * 1024)
+#define CDCACHE_PREFETCH   4
+#define CDCACHE_QUEUE      16
+#define CDCACHE_STREAMS    2
+
+enum
+{
+	SRC_FILE,
+	SRC_CHD
+};
+
+enum
+{
+	BLK_EMPTY,
+	BLK_LOADING,
+	BLK_READY
+};
+
+struct stream_t
+{
+	uint32_t last_block;
+	int      seq_run;
+	uint32_t last_use;
+};
+
+struct cache_source_t
+{
+	const void *key;
+	uint32_t    id;
+	int         type;
+	int         fd;
+	chd_file   *chd;
+	uint32_t    block_size;
+	uint32_t    block_count;
+	bool        dead;
+
+	// data and CD audio reads are often interleaved, each is followed separately
+	stream_t    streams[CDCACHE_STREAMS];
+
+	// libchdr is not thread safe, so all reads of a source are serialized
+	pthread_mutex_t io_lock;
+};
+
+struct cache_block_t
+{
+	cache_source_t *src;
+	uint32_t        block;
+	int             state;
+	int             len;
+	chd_error       err;
+	uint32_t        alloc_size;
+	uint8_t        *data;
+
+	// LRU list of empty and ready blocks, empty ones first
+	cache_block_t  *prev, *next;
+};
+
+struct prefetch_t
+{
+	cache_source_t *src;
+	uint32_t        block;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cache_cond_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t cache_thread;
+static bool cache_thread_started = false;
+
+static std::vector<cache_source_t*> sources;
+static uint32_t source_id = 0;
+static cache_block_t *blocks = nullptr;
+static int block_num = 0;
+
+// loading and ready blocks by source and block number
+static std::unordered_map<uint64_t, cache_block_t*> block_map;
+static cache_block_t *lru_first = nullptr, *lru_last = nullptr;
+static prefetch_t queue[CDCACHE_QUEUE];
+static uint32_t queue_head = 0, queue_tail = 0;
+static uint32_t use_tick = 0;
+
+static struct
+{
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t waits;
+	uint32_t prefetched;
+	uint64_t miss_us;
+	uint32_t miss_us_max;
+} stats = {};
+
+static uint32_t elapsed_us(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)((now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000);
+}
+
+// all functions below expect cache_lock to be held
+
+static uint64_t block_key(cache_source_t *src, uint32_t block)
+{
+	return ((uint64_t)src->id << 32) | block;
+}
+
+static void lru_unlink(cache_block_t *b)
+{
+	if (b->prev) b->prev->next = b->next;
+	else lru_first = b->next;
+	if (b->next) b->next->prev = b->prev;
+	else lru_last = b->prev;
+	b->prev = b->next = nullptr;
+}
+
+static void lru_add(cache_block_t *b, bool recent)
+{
+	if (recent)
+	{
+		b->prev = lru_last;
+		b->next = nullptr;
+		if (lru_last) lru_last->next = b;
+		else lru_first = b;
+		lru_last = b;
+	}
+	else
+	{
+		b->prev = nullptr;
+		b->next = lru_first;
+		if (lru_first) lru_first->prev = b;
+		else lru_last = b;
+		lru_first = b;
+	}
+}
+
+static cache_block_t *find_block(cache_source_t *src, uint32_t block)
+{
+	auto it = block_map.find(block_key(src, block));
+	return (it != block_map.end()) ? it->second : nullptr;
+}
+
+// block must be in BLK_READY state
+static void drop_block(cache_block_t *b)
+{
+	block_map.erase(block_key(b->src, b->block));
+	b->state = BLK_EMPTY;
+	b->src = nullptr;
+	lru_unlink(b);
+	lru_add(b, false);
+}
+
+// returns the block in BLK_LOADING state, loading blocks are not in the LRU list
+static cache_block_t *get_victim(cache_source_t *src, uint32_t block)
+{
+	cache_block_t *b = lru_first;
+	if (!b) return nullptr;
+
+	if (b->state == BLK_READY) block_map.erase(block_key(b->src, b->block));
+	lru_unlink(b);
+
+	b->src = src;
+	b->block = block;
+	b->state = BLK_LOADING;
+	block_map[block_key(src, block)] = b;
+	return b;
+}
+
+// block must be in BLK_LOADING state, the lock is released during the read
+static void fill_block(cache_block_t *b)
+{
+	cache_source_t *src = b->src;
+	uint32_t size = src->block_size;
+
+	if (b->alloc_size < size)
+	{
+		free(b->data);
+		b->data = (uint8_t *)malloc(size);
+		b->alloc_size = b->data ? size : 0;
+	}
+
+	uint8_t *data = b->data;
+	chd_error err = CHDERR_NONE;
+	int len = 0;
+
+	pthread_mutex_unlock(&cache_lock);
+	TRACE_SCOPE("cd", "cd read");
+	pthread_mutex_lock(&src->io_lock);
+
+	if (!data)
+	{
+		err = CHDERR_OUT_OF_MEMORY;
+	}
+	else if (src->type == SRC_CHD)
+	{
+		err = chd_read(src->chd, b->block, data);
+		if (err == CHDERR_NONE) len = size;
+	}
+	else
+	{
+		ssize_t ret = pread(src->fd, data, size, (off64_t)b->block * size);
+		if (ret < 0) err = CHDERR_READ_ERROR;
+		else len = ret;
+	}
+
+	pthread_mutex_unlock(&src->io_lock);
+	pthread_mutex_lock(&cache_lock);
+
+	b->err = err;
+	b->len = len;
+	b->state = BLK_READY;
+	lru_add(b, true);
+	pthread_cond_broadcast(&cache_cond_ready);
+}
+
+static void *cache_worker(void *)
+{
+	pthread_mutex_lock(&cache_lock);
+	while (true)
+	{
+		while (queue_head == queue_tail) pthread_cond_wait(&cache_cond_work, &cache_lock);
+
+		prefetch_t req = queue[queue_tail % CDCACHE_QUEUE];
+		queue_tail++;
+
+		if (req.src->dead || req.block >= req.src->block_count || find_block(req.src, req.block)) continue;
+
+		cache_block_t *b = get_victim(req.src, req.block);
+		if (!b) continue;
+
+		fill_block(b);
+		stats.prefetched++;
+	}
+	return nullptr;
+}
+
+static void queue_prefetch(cache_source_t *src, uint32_t block)
+{
+	if (block >= src->block_count || find_block(src, block)) return;
+
+	for (uint32_t i = queue_tail; i != queue_head; i++)
+	{
+		if (queue[i % CDCACHE_QUEUE].src == src && queue[i % CDCACHE_QUEUE].block == block) return;
+	}
+
+	// drop the oldest request if the queue is full
+	if (queue_head - queue_tail == CDCACHE_QUEUE) queue_tail++;
+
+	queue[queue_head % CDCACHE_QUEUE] = { src, block };
+	queue_head++;
+	pthread_cond_signal(&cache_cond_work);
+}
+
+static cache_source_t *get_source(const void *key, int type)
+{
+	for (cache_source_t *src : sources)
+	{
+		if (src->key == key) return src;
+	}
+
+	if (!blocks)
+	{
+		// size is given in MB, CD hunks and file blocks are up to 32KB
+		int size = cfg.cd_cache_size ? cfg.cd_cache_size : 2;
+		block_num = size * (1024 * 1024 / CDCACHE_FILE_BLOCK);
+		blocks = (cache_block_t *)calloc(block_num, sizeof(cache_block_t));
+		if (!blocks) block_num = 0;
+
+		block_map.reserve(block_num);
+		for (int i = 0; i < block_num; i++) lru_add(&blocks[i], true);
+	}
+
+	if (!cache_thread_started)
+	{
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+
+		// Set affinity to core #0 since main runs on core #1
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(0, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+		cache_thread_started = !pthread_create(&cache_thread, &attr, cache_worker, nullptr);
+		pthread_attr_destroy(&attr);
+	}
+
+	cache_source_t *src = new cache_source_t{};
+	src->key = key;
+	src->id = source_id++;
+	src->type = type;
+	for (int i = 0; i < CDCACHE_STREAMS; i++) src->streams[i].last_block = UINT32_MAX;
+	pthread_mutex_init(&src->io_lock, nullptr);
+
+	if (type == SRC_CHD)
+	{
+		const chd_header *header = chd_get_header((chd_file *)key);
+		src->chd = (chd_file *)key;
+		src->block_size = header->hunkbytes;
+		src->block_count = header->totalhunks;
+	}
+	else
+	{
+		fileTYPE *f = (fileTYPE *)key;
+		src->fd = fileno(f->filp);
+		src->block_size = CDCACHE_FILE_BLOCK;
+		src->block_count = (FileGetSize(f) + CDCACHE_FILE_BLOCK - 1) / CDCACHE_FILE_BLOCK;
+	}
+
+	sources.push_back(src);
+	return src;
+}
+
+static stream_t *get_stream(cache_source_t *src, uint32_t block)
+{
+	stream_t *oldest = &src->streams[0];
+	for (int i = 0; i < CDCACHE_STREAMS; i++)
+	{
+		stream_t *st = &src->streams[i];
+		if (block == st->last_block || block == st->last_block + 1) return st;
+		if (st->last_use < oldest->last_use) oldest = st;
+	}
+	return oldest;
+}
+
+// returns the block in BLK_READY state
+static cache_block_t *acquire_block(cache_source_t *src, uint32_t block)
+{
+	cache_block_t *b = find_block(src, block);
+	if (b && b->state == BLK_READY)
+	{
+		stats.hits++;
+	}
+	else
+	{
+		PROFILE_SCOPE_CAT("cd", "cd cache miss");
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if (b) stats.waits++;
+
+		// already being read by the worker
+		while ((b = find_block(src, block)) && b->state == BLK_LOADING) pthread_cond_wait(&cache_cond_ready, &cache_lock);
+
+		if (!b)
+		{
+			while (!(b = get_victim(src, block))) pthread_cond_wait(&cache_cond_ready, &cache_lock);
+			fill_block(b);
+		}
+
+		uint32_t us = elapsed_us(&start);
+		stats.misses++;
+		stats.miss_us += us;
+		if (stats.miss_us_max < us) stats.miss_us_max = us;
+	}
+
+	use_tick++;
+	lru_unlink(b);
+	lru_add(b, true);
+
+	// read further ahead while access is sequential
+	stream_t *st = get_stream(src, block);
+	if (block == st->last_block + 1) st->seq_run++;
+	else if (block != st->last_block) st->seq_run = 0;
+	st->last_block = block;
+	st->last_use = use_tick;
+
+	int depth = st->seq_run ? CDCACHE_PREFETCH : 1;
+	for (int i = 1; i <= depth; i++) queue_prefetch(src, block + i);
+
+	return b;
+}
+
+int cdcache_read_file(fileTYPE *f, __off64_t offset, void *buf, int len)
+{
+	// zipped images can't be read from another thread
+	if (!f->filp)
+	{
+		if (!FileSeek(f, offset, SEEK_SET)) return 0;
+		return FileReadAdv(f, buf, len);
+	}
+
+	pthread_mutex_lock(&cache_lock);
+
+	cache_source_t *src = get_source(f, SRC_FILE);
+	int done = 0;
+
+	while (done < len)
+	{
+		cache_block_t *b = acquire_block(src, offset / src->block_size);
+		int ofs = offset % src->block_size;
+		int cnt = b->len - ofs;
+		if (cnt > len - done) cnt = len - done;
+		if (cnt <= 0)
+		{
+			if (b->err != CHDERR_NONE) drop_block(b);
+			break;
+		}
+
+		memcpy((uint8_t *)buf + done, b->data + ofs, cnt);
+		done += cnt;
+		offset += cnt;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+	return done;
+}
+
+chd_error cdcache_read_chd(chd_file *chd_f, uint32_t hunknum, uint32_t offset, void *buf, int len)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	cache_source_t *src = get_source(chd_f, SRC_CHD);
+	cache_block_t *b = acquire_block(src, hunknum);
+	chd_error err = b->err;
+
+	if (err != CHDERR_NONE)
+	{
+		// try again on next access
+		drop_block(b);
+	}
+	else
+	{
+		if ((int)offset > b->len) offset = b->len;
+		if (len > b->len - (int)offset) len = b->len - offset;
+		memcpy(buf, b->data + offset, len);
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+	return err;
+}
+
+void cdcache_release(const void *key)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	auto it = sources.begin();
+	while (it != sources.end() && (*it)->key != key) it++;
+	if (it == sources.end())
+	{
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	cache_source_t *src = *it;
+	src->dead = true;
+	sources.erase(it);
+
+	// wait for the worker to finish with this source
+	bool busy;
+	do
+	{
+		busy = false;
+		for (int i = 0; i < block_num; i++)
+		{
+			if (blocks[i].src == src && blocks[i].state == BLK_LOADING) busy = true;
+		}
+		if (busy) pthread_cond_wait(&cache_cond_ready, &cache_lock);
+	} while (busy);
+
+	for (int i = 0; i < block_num; i++)
+	{
+		if (blocks[i].src == src) drop_block(&blocks[i]);
+	}
+
+	// drop pending prefetches
+	uint32_t head = queue_tail;
+	for (uint32_t i = queue_tail; i != queue_head; i++)
+	{
+		if (queue[i % CDCACHE_QUEUE].src != src) queue[head++ % CDCACHE_QUEUE] = queue[i % CDCACHE_QUEUE];
+	}
+	queue_head = head;
+
+	pthread_mutex_unlock(&cache_lock);
+
+	pthread_mutex_destroy(&src->io_lock);
+	delete src;
+
+	cdcache_print_stats();
+}
+
+void cdcache_print_stats()
+{
+	pthread_mutex_lock(&cache_lock);
+	uint32_t total = stats.hits + stats.misses;
+	if (total)
+	{
+		printf("CD cache: %u reads, %u%% hits, %u misses (%u waited on prefetch), miss avg %uus max %uus, %u prefetched.\n",
+			total, stats.hits * 100 / total, stats.misses, stats.waits,
+			stats.misses ? (uint32_t)(stats.miss_us / stats.misses) : 0, stats.miss_us_max, stats.prefetched);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
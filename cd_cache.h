@@ -0,0 +1,28 @@
+#ifndef CD_CACHE_H
+#define CD_CACHE_H
+
+#include <inttypes.h>
+#include <libchdr/chd.h>
+#include "file_io.h"
+
+// Read-ahead sector cache shared by the CD based cores.
+// Images are read in blocks (CHD hunks or 32KB of a raw image) by a background
+// thread which follows sequential access, so the core gets its sectors from RAM.
+// Blocks are kept in LRU order, the total size is set by cd_cache_size in MiSTer.ini.
+// A block which is not cached or being prefetched is still read by the caller, which
+// waits for it anyway. Reads must come from the main thread, cdcache_release() may be
+// called from any thread.
+
+// Read from a raw image file. Doesn't move the file position.
+// Returns number of bytes read.
+int cdcache_read_file(fileTYPE *f, __off64_t offset, void *buf, int len);
+
+// Read from a decompressed CHD hunk.
+chd_error cdcache_read_chd(chd_file *chd_f, uint32_t hunknum, uint32_t offset, void *buf, int len);
+
+// Drop everything cached for a file or CHD. Must be called before closing it.
+void cdcache_release(const void *src);
+
+void cdcache_print_stats();
+
+#endif
@@ -60,6 +60,11 @@ typedef struct {
 	uint8_t browse_expand;
 	uint8_t logo;
 	uint8_t log_file_entry;
+	uint16_t ide_cache_size;
+	uint8_t ide_overlay;
+	uint16_t cd_cache_size;
+	uint8_t input_thread;
+	uint8_t trace;
 	uint8_t shmask_mode_default;
 	int bt_auto_disconnect;
 	int bt_reset_before_pair;
@@ -109,6 +114,8 @@ typedef struct {
 	char autofire_rates[3072];
 	uint8_t autofire_on_directions;
 	char screenshot_image_format[16];
+	int8_t screenshot_png_compression;
+	uint8_t screenshot_direct;
 	uint16_t xbe2_shift;
 	uint8_t spd_quirk;
 	uint16_t hdmi_off;
@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "lib/miniz/miniz.h"
+#include "dir_index.h"
+#include "file_io.h"
+#include "scheduler.h"
+
+#define DIRINDEX_MEM      8    // listings kept in memory
+#define DIRINDEX_MIN_SAVE 256  // smaller folders are fast enough to read
+#define DIRINDEX_MAGIC    0x3149444D // "MDI1"
+
+//#define DIRINDEX_DEBUG
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct cached_dir_t
+{
+	std::string     path;
+	int             wd;
+	struct timespec mtime;
+	uint32_t        alt_stamp;
+	uint32_t        last_use;
+	bool            stale;
+	bool            touched;
+	dirindex_t      idx;
+};
+
+static std::vector<cached_dir_t*> dirs;
+static uint32_t use_tick = 0;
+static int inotify_fd = -1;
+
+static struct
+{
+	uint32_t mem_hits;
+	uint32_t disk_hits;
+	uint32_t scans;
+	uint32_t updates;
+	uint64_t scan_us;
+} stats = {};
+
+static const size_t YieldIterations = 128;
+
+static uint32_t elapsed_us(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)((now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000);
+}
+
+static bool same_time(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// resolve symlinks and get size/date of files
+static void stat_entry(const char *dir, dirindex_entry_t *e)
+{
+	if (e->type != DT_LNK && e->type != DT_REG) return;
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s", dir, e->name.c_str());
+
+	struct stat st;
+	if (!stat(path, &st))
+	{
+		if (S_ISREG(st.st_mode)) e->type = DT_REG;
+		else if (S_ISDIR(st.st_mode)) e->type = DT_DIR;
+		e->size = st.st_size;
+		e->mtime = st.st_mtime;
+	}
+}
+
+static bool scan_dir(cached_dir_t *d)
+{
+	DIR *dir = opendir(d->path.c_str());
+	if (!dir) return false;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	d->idx.entries.clear();
+
+	struct dirent64 *de;
+	for (size_t i = 0; (de = readdir64(dir)); i++)
+	{
+#ifdef USE_SCHEDULER
+		if (0 < i && i % YieldIterations == 0)
+		{
+			scheduler_yield();
+		}
+#endif
+		// . is never shown, everything else is filtered by the browser
+		if (!strcmp(de->d_name, ".")) continue;
+
+		dirindex_entry_t e = {};
+		e.name = de->d_name;
+		e.type = de->d_type;
+		stat_entry(d->path.c_str(), &e);
+		d->idx.entries.push_back(e);
+	}
+
+	closedir(dir);
+
+	stats.scans++;
+	stats.scan_us += elapsed_us(&start);
+	d->idx.dirty = true;
+	return true;
+}
+
+static const char *index_file(const char *path)
+{
+	static char name[32];
+	sprintf(name, "dirindex/%08X.idx", (uint32_t)mz_crc32(MZ_CRC32_INIT, (const uint8_t*)path, strlen(path)));
+	return name;
+}
+
+static void put(std::string &buf, const void *data, size_t size)
+{
+	buf.append((const char*)data, size);
+}
+
+static void put_str(std::string &buf, const std::string &s)
+{
+	uint8_t len = s.length() > 255 ? 255 : s.length();
+	put(buf, &len, 1);
+	put(buf, s.data(), len);
+}
+
+static bool get(const uint8_t **p, const uint8_t *end, void *data, size_t size)
+{
+	if ((size_t)(end - *p) < size) return false;
+	memcpy(data, *p, size);
+	*p += size;
+	return true;
+}
+
+static bool get_str(const uint8_t **p, const uint8_t *end, std::string &s)
+{
+	uint8_t len;
+	if (!get(p, end, &len, 1) || end - *p < len) return false;
+	s.assign((const char*)*p, len);
+	*p += len;
+	return true;
+}
+
+static void save_index(cached_dir_t *d)
+{
+	std::string buf;
+	uint32_t magic = DIRINDEX_MAGIC;
+	int64_t sec = d->mtime.tv_sec, nsec = d->mtime.tv_nsec;
+	uint32_t count = d->idx.entries.size();
+
+	put(buf, &magic, sizeof(magic));
+	put(buf, &sec, sizeof(sec));
+	put(buf, &nsec, sizeof(nsec));
+	put(buf, &d->alt_stamp, sizeof(d->alt_stamp));
+	put(buf, &count, sizeof(count));
+	uint16_t plen = d->path.length();
+	put(buf, &plen, sizeof(plen));
+	put(buf, d->path.data(), plen);
+
+	for (auto &e : d->idx.entries)
+	{
+		int64_t mtime = e.mtime;
+		put(buf, &e.type, 1);
+		put(buf, &e.has_alt, 1);
+		put(buf, &e.size, sizeof(e.size));
+		put(buf, &mtime, sizeof(mtime));
+		put_str(buf, e.name);
+		if (e.has_alt)
+		{
+			put_str(buf, e.altname);
+			put_str(buf, e.datecode);
+		}
+	}
+
+	// FileSave() writes with O_SYNC, that would stall the browser on every save.
+	// A torn file is rejected by load_index().
+	char name[64];
+	sprintf(name, CONFIG_DIR"/%s", index_file(d->path.c_str()));
+	FileCreatePath(CONFIG_DIR"/dirindex");
+
+	int fd = open(getFullPath(name), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) return;
+	if (write(fd, buf.data(), buf.length()) != (ssize_t)buf.length()) printf("Dir index: failed to write %s\n", name);
+	close(fd);
+}
+
+static bool load_index(cached_dir_t *d)
+{
+	char name[64];
+	sprintf(name, CONFIG_DIR"/%s", index_file(d->path.c_str()));
+
+	int size = FileLoad(name, 0, 0);
+	if (size <= 0) return false;
+
+	std::vector<uint8_t> buf(size);
+	if (FileLoad(name, buf.data(), size) != size) return false;
+
+	const uint8_t *p = buf.data();
+	const uint8_t *end = p + size;
+
+	uint32_t magic, count;
+	int64_t sec, nsec;
+	uint16_t plen;
+	if (!get(&p, end, &magic, sizeof(magic)) || magic != DIRINDEX_MAGIC) return false;
+	if (!get(&p, end, &sec, sizeof(sec)) || !get(&p, end, &nsec, sizeof(nsec))) return false;
+	if (sec != d->mtime.tv_sec || nsec != d->mtime.tv_nsec) return false;
+	if (!get(&p, end, &d->alt_stamp, sizeof(d->alt_stamp))) return false;
+	if (!get(&p, end, &count, sizeof(count)) || !get(&p, end, &plen, sizeof(plen))) return false;
+	if (end - p < plen || d->path.compare(0, std::string::npos, (const char*)p, plen)) return false;
+	p += plen;
+
+	// type, has_alt, size, mtime and the length of the name
+	if (count > (size_t)(end - p) / (2 + sizeof(dirindex_entry_t::size) + sizeof(int64_t) + 1))
+	{
+		printf("Dir index: %s is corrupt, dropped\n", name);
+		FileDeleteConfig(index_file(d->path.c_str()));
+		return false;
+	}
+
+	std::vector<dirindex_entry_t> entries(count);
+	for (auto &e : entries)
+	{
+		int64_t mtime;
+		if (!get(&p, end, &e.type, 1) || !get(&p, end, &e.has_alt, 1)) return false;
+		if (!get(&p, end, &e.size, sizeof(e.size)) || !get(&p, end, &mtime, sizeof(mtime))) return false;
+		if (!get_str(&p, end, e.name)) return false;
+		if (e.has_alt && (!get_str(&p, end, e.altname) || !get_str(&p, end, e.datecode))) return false;
+		e.mtime = mtime;
+	}
+
+	d->idx.entries.swap(entries);
+	d->idx.dirty = false;
+	stats.disk_hits++;
+	return true;
+}
+
+static void drop_dir(cached_dir_t *d)
+{
+	if (d->wd >= 0) inotify_rm_watch(inotify_fd, d->wd);
+	for (auto it = dirs.begin(); it != dirs.end(); it++)
+	{
+		if (*it == d)
+		{
+			dirs.erase(it);
+			break;
+		}
+	}
+	delete d;
+}
+
+static cached_dir_t *find_wd(int wd)
+{
+	for (cached_dir_t *d : dirs)
+	{
+		if (d->wd == wd) return d;
+	}
+	return nullptr;
+}
+
+static void update_entry(cached_dir_t *d, const char *name, bool removed)
+{
+	auto &entries = d->idx.entries;
+	auto it = entries.begin();
+	while (it != entries.end() && it->name != name) it++;
+
+	if (removed)
+	{
+		if (it != entries.end()) entries.erase(it);
+	}
+	else
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%s", d->path.c_str(), name);
+
+		struct stat st;
+		if (lstat(path, &st)) return;
+
+		dirindex_entry_t e = {};
+		e.name = name;
+		e.type = S_ISLNK(st.st_mode) ? DT_LNK : S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		stat_entry(d->path.c_str(), &e);
+
+		// keep the display name if only the contents changed
+		if (it != entries.end())
+		{
+			if (it->name == e.name && it->type == e.type && it->has_alt)
+			{
+				e.has_alt = true;
+				e.altname.swap(it->altname);
+				e.datecode.swap(it->datecode);
+			}
+			*it = e;
+		}
+		else
+		{
+			entries.push_back(e);
+		}
+	}
+
+	d->idx.dirty = true;
+	d->touched = true;
+	stats.updates++;
+}
+
+static void process_events()
+{
+	if (inotify_fd < 0) return;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0)
+	{
+		for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len)
+		{
+			const struct inotify_event *ev = (const struct inotify_event*)ptr;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				for (cached_dir_t *d : dirs) d->stale = true;
+				continue;
+			}
+
+			cached_dir_t *d = find_wd(ev->wd);
+			if (!d) continue;
+
+			if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+			{
+				d->wd = -1;
+				d->stale = true;
+			}
+			else if (ev->len)
+			{
+				update_entry(d, ev->name, ev->mask & (IN_DELETE | IN_MOVED_FROM));
+			}
+		}
+	}
+
+	for (cached_dir_t *d : dirs)
+	{
+		if (!d->touched) continue;
+		d->touched = false;
+
+		struct stat st;
+		if (!stat(d->path.c_str(), &st)) d->mtime = st.st_mtim;
+		else d->stale = true;
+	}
+}
+
+dirindex_t *dirindex_open(const char *path, uint32_t alt_stamp)
+{
+	if (inotify_fd < 0) inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	process_events();
+
+	cached_dir_t *d = nullptr;
+	for (cached_dir_t *c : dirs)
+	{
+		if (c->path == path)
+		{
+			d = c;
+			break;
+		}
+	}
+
+	struct stat st;
+	if (stat(path, &st) || !S_ISDIR(st.st_mode))
+	{
+		if (d) drop_dir(d);
+		return nullptr;
+	}
+
+	if (d && !d->stale && same_time(&d->mtime, &st.st_mtim))
+	{
+		stats.mem_hits++;
+	}
+	else
+	{
+		if (!d)
+		{
+			if (dirs.size() >= DIRINDEX_MEM)
+			{
+				cached_dir_t *lru = dirs[0];
+				for (cached_dir_t *c : dirs) if (c->last_use < lru->last_use) lru = c;
+				drop_dir(lru);
+			}
+
+			d = new cached_dir_t{};
+			d->path = path;
+			d->wd = -1;
+			dirs.push_back(d);
+		}
+
+		// watch before reading so nothing gets lost in between
+		if (d->wd < 0 && inotify_fd >= 0) d->wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+
+		d->mtime = st.st_mtim;
+		d->stale = false;
+		d->idx.dirty = false;
+		if (!load_index(d) && !scan_dir(d))
+		{
+			drop_dir(d);
+			return nullptr;
+		}
+
+		// events for the old contents are already covered
+		process_events();
+	}
+
+	if (d->alt_stamp != alt_stamp)
+	{
+		for (auto &e : d->idx.entries) e.has_alt = false;
+		d->alt_stamp = alt_stamp;
+		d->idx.dirty = true;
+	}
+
+	d->last_use = ++use_tick;
+	return &d->idx;
+}
+
+void dirindex_set_alt(dirindex_t *idx, dirindex_entry_t *entry, const char *altname, const char *datecode)
+{
+	entry->altname = altname;
+	entry->datecode = datecode;
+	entry->has_alt = true;
+	idx->dirty = true;
+}
+
+void dirindex_close(dirindex_t *idx)
+{
+	if (!idx->dirty) return;
+	idx->dirty = false;
+
+	for (cached_dir_t *d : dirs)
+	{
+		if (&d->idx != idx) continue;
+
+		// FAT stores times with 2s resolution, a change right after the scan might go unnoticed
+		if (idx->entries.size() >= DIRINDEX_MIN_SAVE && time(0) - d->mtime.tv_sec > 2) save_index(d);
+		break;
+	}
+}
+
+void dirindex_print_stats()
+{
+#ifdef DIRINDEX_DEBUG
+	printf("Dir index: %u memory hits, %u disk hits, %u scans (avg %uus), %u updates.\n",
+		stats.mem_hits, stats.disk_hits, stats.scans,
+		stats.scans ? (uint32_t)(stats.scan_us / stats.scans) : 0, stats.updates);
+#endif
+}
@@ -0,0 +1,48 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include <inttypes.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+// Cached directory listings for the file browser.
+// A listing keeps the resolved type (symlinks followed), size and mtime of every
+// entry plus display names filled in by the browser. Listings of recently opened
+// folders stay in memory and are kept current with inotify, large ones are also
+// stored in CONFIG_DIR/dirindex and reused as long as the folder mtime matches.
+// Main thread only.
+
+struct dirindex_entry_t
+{
+	std::string name;
+	uint8_t     type;
+	bool        has_alt;
+	uint64_t    size;
+	time_t      mtime;
+
+	// display name and date code, valid if has_alt is set
+	std::string altname;
+	std::string datecode;
+};
+
+struct dirindex_t
+{
+	std::vector<dirindex_entry_t> entries;
+	bool dirty;
+};
+
+// Get the listing of a directory (full path). alt_stamp identifies the source of
+// the display names, cached ones are dropped when it changes.
+// Returns NULL if the directory can't be read.
+dirindex_t *dirindex_open(const char *path, uint32_t alt_stamp);
+
+// Store the display name of an entry.
+void dirindex_set_alt(dirindex_t *idx, dirindex_entry_t *entry, const char *altname, const char *datecode);
+
+// Done with the listing, writes it back to disk if it was changed.
+void dirindex_close(dirindex_t *idx);
+
+void dirindex_print_stats();
+
+#endif
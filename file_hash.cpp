@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+#include "file_hash.h"
+
+// Cortex-A9 has neither CRC32 nor polynomial multiply instructions, so use
+// slicing-by-8 which is several times faster than the byte wise miniz version.
+static uint32_t crc_table[8][256];
+static bool crc_table_ready = false;
+
+static void crc_init()
+{
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+		crc_table[0][i] = c;
+	}
+
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		for (int t = 1; t < 8; t++) crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+	}
+
+	crc_table_ready = true;
+}
+
+uint32_t file_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	if (!crc_table_ready) crc_init();
+
+	const uint8_t *p = (const uint8_t *)buf;
+	crc = ~crc;
+
+	while (len && ((uintptr_t)p & 3))
+	{
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+		len--;
+	}
+
+	while (len >= 8)
+	{
+		uint32_t a = *(const uint32_t *)p ^ crc;
+		uint32_t b = *(const uint32_t *)(p + 4);
+		crc = crc_table[7][a & 0xFF] ^ crc_table[6][(a >> 8) & 0xFF] ^ crc_table[5][(a >> 16) & 0xFF] ^ crc_table[4][a >> 24] ^
+			crc_table[3][b & 0xFF] ^ crc_table[2][(b >> 8) & 0xFF] ^ crc_table[1][(b >> 16) & 0xFF] ^ crc_table[0][b >> 24];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--) crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+	return ~crc;
+}
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_transform(uint32_t state[5], const uint8_t *data)
+{
+	uint32_t w[80];
+	for (int i = 0; i < 16; i++) w[i] = (data[i * 4] << 24) | (data[i * 4 + 1] << 16) | (data[i * 4 + 2] << 8) | data[i * 4 + 3];
+	for (int i = 16; i < 80; i++) w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+	for (int i = 0; i < 80; i++)
+	{
+		uint32_t f, k;
+		if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+		else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+		else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+		else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+
+		uint32_t t = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+static void sha1_init(sha1_ctx_t *ctx)
+{
+	static const uint32_t init[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->count = 0;
+}
+
+static void sha1_update(sha1_ctx_t *ctx, const uint8_t *data, size_t len)
+{
+	uint32_t used = ctx->count & 63;
+	ctx->count += len;
+
+	if (used)
+	{
+		uint32_t n = 64 - used;
+		if (n > len) n = len;
+		memcpy(ctx->buf + used, data, n);
+		data += n;
+		len -= n;
+		if (used + n < 64) return;
+		sha1_transform(ctx->state, ctx->buf);
+	}
+
+	for (; len >= 64; data += 64, len -= 64) sha1_transform(ctx->state, data);
+	memcpy(ctx->buf, data, len);
+}
+
+static void sha1_final(sha1_ctx_t *ctx, uint8_t digest[20])
+{
+	uint64_t bits = ctx->count * 8;
+	uint8_t pad[72] = { 0x80 };
+	uint32_t used = ctx->count & 63;
+	uint32_t padlen = (used < 56) ? 56 - used : 120 - used;
+
+	for (int i = 0; i < 8; i++) pad[padlen + i] = (uint8_t)(bits >> (56 - i * 8));
+	sha1_update(ctx, pad, padlen + 8);
+
+	for (int i = 0; i < 20; i++) digest[i] = (uint8_t)(ctx->state[i / 4] >> (24 - (i & 3) * 8));
+}
+
+void file_hash_init(file_hash_t *h, int flags, uint32_t skip)
+{
+	memset(h, 0, sizeof(*h));
+	h->flags = flags;
+	h->skip = skip;
+	if (flags & FILE_HASH_MD5) MD5Init(&h->md5_ctx);
+	if (flags & FILE_HASH_SHA1) sha1_init(&h->sha1_ctx);
+}
+
+void file_hash_update(file_hash_t *h, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	if (h->skip)
+	{
+		uint32_t n = (h->skip > len) ? len : h->skip;
+		h->skip -= n;
+		p += n;
+		len -= n;
+	}
+
+	if (!len) return;
+	if (h->flags & FILE_HASH_CRC32) h->crc32 = file_crc32(h->crc32, p, len);
+	if (h->flags & FILE_HASH_MD5) MD5Update(&h->md5_ctx, p, len);
+	if (h->flags & FILE_HASH_SHA1) sha1_update(&h->sha1_ctx, p, len);
+}
+
+void file_hash_final(file_hash_t *h)
+{
+	if (h->flags & FILE_HASH_MD5) MD5Final(h->md5, &h->md5_ctx);
+	if (h->flags & FILE_HASH_SHA1) sha1_final(&h->sha1_ctx, h->sha1);
+}
+
+const char *file_hash_hex(const uint8_t *digest, int len)
+{
+	static char str[64];
+	for (int i = 0; i < len && i < 32; i++) sprintf(str + i * 2, "%02x", digest[i]);
+	return str;
+}
@@ -0,0 +1,44 @@
+#ifndef FILE_HASH_H
+#define FILE_HASH_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "lib/md5/md5.h"
+
+// Incremental CRC32/MD5/SHA1 of a file, fed with the same buffers that are sent
+// to the FPGA so the file doesn't need to be read again to identify it.
+
+#define FILE_HASH_CRC32 1
+#define FILE_HASH_MD5   2
+#define FILE_HASH_SHA1  4
+
+struct sha1_ctx_t
+{
+	uint32_t state[5];
+	uint64_t count;
+	uint8_t  buf[64];
+};
+
+struct file_hash_t
+{
+	int      flags;
+	uint32_t skip;   // header bytes not included in the hashes
+	uint32_t crc32;
+	uint8_t  md5[16];
+	uint8_t  sha1[20];
+
+	MD5Context md5_ctx;
+	sha1_ctx_t sha1_ctx;
+};
+
+void file_hash_init(file_hash_t *h, int flags, uint32_t skip = 0);
+void file_hash_update(file_hash_t *h, const void *buf, size_t len);
+void file_hash_final(file_hash_t *h);
+
+// hex string of a digest, returns a static buffer
+const char *file_hash_hex(const uint8_t *digest, int len);
+
+// Same result as zlib/miniz crc32(), table driven 8 bytes at a time.
+uint32_t file_crc32(uint32_t crc, const void *buf, size_t len);
+
+#endif
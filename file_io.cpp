@@ -6,6 +6,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <strings.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -19,6 +20,8 @@
 #include <vector>
 #include <string>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include "lib/miniz/miniz.h"
 #include "osd.h"
 #include "fpga_io.h"
@@ -33,6 +36,9 @@
 #include "scheduler.h"
 #include "video.h"
 #include "support.h"
+#include "cd_cache.h"
+#include "dir_index.h"
+#include "profiling.h"
 
 #define MIN(a,b) (((a)<(b)) ? (a) : (b))
 
@@ -51,13 +57,39 @@ DirNameSet DirNames;
 // cache the opened mz_zip_archive so we only open it once
 // this has the extra benefit that if a user is navigating through multiple directories
 // in a zip archive, the zip will only be opened once and things will be more responsive
+// A few archives are kept in LRU order (e.g. MRA with roms in several zips), each with
+// a hash index of names and CRCs so lookups don't walk the central directory.
 // ** We have to open the file outselves with open() so we can set O_CLOEXEC to prevent
 // leaking the file descriptor when the user changes cores
+// Opened files may be read by offload workers: zip_cache_lock protects the cache and
+// the reference counts, the lock of an entry serializes reads of its FILE.
+
+#define ZIP_CACHE_SIZE 4
+
+//#define ZIP_CACHE_DEBUG
+
+struct zipCacheEntry
+{
+	char                                 path[1024];
+	time_t                               mtime;
+	__off64_t                            size;
+	uint32_t                             last_use;
+	int                                  refs;
+	bool                                 evicted;
+	pthread_mutex_t                      lock;
+	FILE                                *cfile;
+	mz_zip_archive                       archive;
+	std::unordered_map<std::string, int> names;
+	std::unordered_map<uint32_t, int>    crcs;
+	std::unordered_set<std::string>      dirs;
+};
 
-static mz_zip_archive last_zip_archive = {};
-static int last_zip_fd = -1;
-static FILE *last_zip_cfile = NULL;
-static char last_zip_fname[256] = {};
+static zipCacheEntry *zip_cache[ZIP_CACHE_SIZE] = {};
+static pthread_mutex_t zip_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t zip_cache_tick = 0;
+static uint32_t zip_cache_hits = 0;
+static uint32_t zip_cache_misses = 0;
+static mz_zip_error zip_cache_error = MZ_ZIP_NO_ERROR;
 static char scanned_path[1024] = {};
 static int scanned_opts = 0;
 
@@ -147,53 +179,413 @@ int fileTYPE::opened()
 	return filp || zip;
 }
 
+struct zipSeekIndex;
+
 struct fileZipArchive
 {
-	mz_zip_archive                    archive;
+	zipCacheEntry*                    entry;
+	mz_zip_archive*                   archive;
 	int                               index;
 	mz_zip_reader_extract_iter_state* iter;
 	__off64_t                         offset;
+	zipSeekIndex*                     seek_index;
+};
+
+// Random access into deflated zip members.
+// While a member is being inflated, the complete inflater state (decompressor and
+// its 32KB window) is saved every span bytes. A later seek resumes from the nearest
+// checkpoint instead of inflating the member again from the start.
+// Indexes of closed files are kept in a small cache, so remounting the same image
+// doesn't need to build the index again.
+// A checkpoint takes about 43KB, so an index is limited to ~2.7MB and the cache
+// keeps at most ZIP_INDEX_CACHE_MEM of them.
+#define ZIP_INDEX_SPAN       (1024*1024)
+#define ZIP_INDEX_MAX_POINTS 64
+#define ZIP_INDEX_CACHE_SIZE 4
+#define ZIP_INDEX_CACHE_MEM  (6*1024*1024)
+
+struct zipCheckpoint
+{
+	mz_uint64          out_ofs;
+	mz_uint64          file_ofs;
+	mz_uint64          comp_remaining;
+	size_t             out_blk_remain;
+	int                status;
+	mz_uint            crc32;
+	tinfl_decompressor inflator;
+	mz_uint8           window[TINFL_LZ_DICT_SIZE];
+};
+
+struct zipSeekIndex
+{
+	char                        path[1024];
+	int                         file_index;
+	time_t                      mtime;
+	__off64_t                   archive_size;
+	__off64_t                   span;
+	std::vector<zipCheckpoint*> points;
 };
 
+static zipSeekIndex *zip_index_cache[ZIP_INDEX_CACHE_SIZE] = {};
+
+static void zip_index_free(zipSeekIndex *idx)
+{
+	if (!idx) return;
+	for (zipCheckpoint *cp : idx->points) delete cp;
+	delete idx;
+}
+
+static void zip_index_attach(fileZipArchive *zip, const char *zip_path)
+{
+	zip->seek_index = nullptr;
+
+	// stored members are seeked directly
+	if (zip->iter->file_stat.m_method != MZ_DEFLATED) return;
+
+	struct stat64 st;
+	if (stat64(zip_path, &st) < 0) return;
+
+	pthread_mutex_lock(&zip_cache_lock);
+	for (int i = 0; i < ZIP_INDEX_CACHE_SIZE; i++)
+	{
+		zipSeekIndex *idx = zip_index_cache[i];
+		if (idx && idx->file_index == zip->index && idx->mtime == st.st_mtime &&
+			idx->archive_size == st.st_size && !strcmp(idx->path, zip_path))
+		{
+			zip_index_cache[i] = nullptr;
+			zip->seek_index = idx;
+			pthread_mutex_unlock(&zip_cache_lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&zip_cache_lock);
+
+	zipSeekIndex *idx = new zipSeekIndex{};
+	snprintf(idx->path, sizeof(idx->path), "%s", zip_path);
+	idx->file_index = zip->index;
+	idx->mtime = st.st_mtime;
+	idx->archive_size = st.st_size;
+
+	// keep the number of checkpoints bounded for big images
+	__off64_t span = (zip->iter->file_stat.m_uncomp_size / ZIP_INDEX_MAX_POINTS + TINFL_LZ_DICT_SIZE - 1) & ~(__off64_t)(TINFL_LZ_DICT_SIZE - 1);
+	idx->span = (span > ZIP_INDEX_SPAN) ? span : ZIP_INDEX_SPAN;
+	zip->seek_index = idx;
+}
+
+static void zip_index_release(fileZipArchive *zip)
+{
+	zipSeekIndex *idx = zip->seek_index;
+	zip->seek_index = nullptr;
+	if (!idx) return;
+
+	if (idx->points.empty())
+	{
+		zip_index_free(idx);
+		return;
+	}
+
+	pthread_mutex_lock(&zip_cache_lock);
+	zip_index_free(zip_index_cache[ZIP_INDEX_CACHE_SIZE - 1]);
+	memmove(zip_index_cache + 1, zip_index_cache, sizeof(zip_index_cache) - sizeof(zip_index_cache[0]));
+	zip_index_cache[0] = idx;
+
+	// drop the oldest indexes above the memory limit
+	size_t mem = 0;
+	for (int i = 0; i < ZIP_INDEX_CACHE_SIZE; i++)
+	{
+		if (!zip_index_cache[i]) continue;
+
+		size_t size = zip_index_cache[i]->points.size() * sizeof(zipCheckpoint);
+		if (i && mem + size > ZIP_INDEX_CACHE_MEM)
+		{
+			zip_index_free(zip_index_cache[i]);
+			zip_index_cache[i] = nullptr;
+		}
+		else mem += size;
+	}
+	pthread_mutex_unlock(&zip_cache_lock);
+}
+
+static void zip_index_save(fileZipArchive *zip)
+{
+	mz_zip_reader_extract_iter_state *iter = zip->iter;
+	zipCheckpoint *cp = new zipCheckpoint;
+
+	// unconsumed input is dropped and will be read again after restore
+	cp->out_ofs = iter->out_buf_ofs;
+	cp->file_ofs = iter->cur_file_ofs - iter->read_buf_avail;
+	cp->comp_remaining = iter->comp_remaining + iter->read_buf_avail;
+	cp->out_blk_remain = iter->out_blk_remain;
+	cp->status = iter->status;
+#ifndef MINIZ_DISABLE_ZIP_READER_CRC32_CHECKS
+	cp->crc32 = iter->file_crc32;
+#endif
+	memcpy(&cp->inflator, &iter->inflator, sizeof(cp->inflator));
+	memcpy(cp->window, iter->pWrite_buf, sizeof(cp->window));
+
+	zip->seek_index->points.push_back(cp);
+}
+
+static void zip_index_restore(fileZipArchive *zip, const zipCheckpoint *cp)
+{
+	mz_zip_reader_extract_iter_state *iter = zip->iter;
+
+	iter->out_buf_ofs = cp->out_ofs;
+	iter->cur_file_ofs = cp->file_ofs;
+	iter->comp_remaining = cp->comp_remaining;
+	iter->read_buf_avail = 0;
+	iter->read_buf_ofs = 0;
+	iter->out_blk_remain = cp->out_blk_remain;
+	iter->status = cp->status;
+#ifndef MINIZ_DISABLE_ZIP_READER_CRC32_CHECKS
+	iter->file_crc32 = cp->crc32;
+#endif
+	memcpy(&iter->inflator, &cp->inflator, sizeof(cp->inflator));
+	memcpy(iter->pWrite_buf, cp->window, sizeof(cp->window));
+
+	zip->offset = cp->out_ofs;
+}
+
+// inflate with checkpoints taken at span boundaries
+static size_t zip_read(fileZipArchive *zip, void *buf, size_t len)
+{
+	zipSeekIndex *idx = zip->seek_index;
+	size_t done = 0;
+
+	while (done < len)
+	{
+		size_t chunk = len - done;
+		__off64_t next = 0;
+
+		if (idx && idx->points.size() < ZIP_INDEX_MAX_POINTS)
+		{
+			next = (idx->points.empty() ? 0 : idx->points.back()->out_ofs) + idx->span;
+			if (zip->offset < next && (__off64_t)(zip->offset + chunk) > next) chunk = next - zip->offset;
+		}
+
+		size_t ret = mz_zip_reader_extract_iter_read(zip->iter, (uint8_t*)buf + done, chunk);
+		zip->offset += ret;
+		done += ret;
+
+		if (next && zip->offset == next && (mz_uint64)zip->offset < zip->iter->file_stat.m_uncomp_size) zip_index_save(zip);
+		if (ret < chunk) break;
+	}
+
+	return done;
+}
+
+static int zip_seek(fileZipArchive *zip, __off64_t offset)
+{
+	mz_zip_reader_extract_iter_state *iter = zip->iter;
+
+	if (!iter->file_stat.m_method)
+	{
+		// stored member, just move the read position
+		if ((mz_uint64)offset > iter->file_stat.m_uncomp_size)
+		{
+			printf("FileSeek: offset %lld is beyond the end of stored zip file.\n", offset);
+			return 0;
+		}
+
+		__off64_t delta = offset - zip->offset;
+		iter->cur_file_ofs += delta;
+		iter->comp_remaining -= delta;
+		iter->out_buf_ofs = offset;
+		zip->offset = offset;
+		return 1;
+	}
+
+	zipSeekIndex *idx = zip->seek_index;
+	if (idx && !idx->points.empty() && (offset < zip->offset || offset - zip->offset > idx->span))
+	{
+		auto it = std::upper_bound(idx->points.begin(), idx->points.end(), offset,
+			[](__off64_t ofs, const zipCheckpoint *cp) { return ofs < (__off64_t)cp->out_ofs; });
+
+		if (it != idx->points.begin())
+		{
+			const zipCheckpoint *cp = *(it - 1);
+			if (offset < zip->offset || (__off64_t)cp->out_ofs > zip->offset) zip_index_restore(zip, cp);
+		}
+	}
+
+	if (offset < zip->offset)
+	{
+		mz_zip_reader_extract_iter_state *new_iter = mz_zip_reader_extract_iter_new(zip->archive, zip->index, 0);
+		if (!new_iter)
+		{
+			printf("FileSeek(mz_zip_reader_extract_iter_new) Failed to rewind iterator, error:%s\n",
+			       mz_zip_get_error_string(mz_zip_get_last_error(zip->archive)));
+			return 0;
+		}
+
+		mz_zip_reader_extract_iter_free(zip->iter);
+		zip->iter = new_iter;
+		zip->offset = 0;
+	}
+
+	char buf[16*1024];
+	while (zip->offset < offset)
+	{
+		const size_t want_len = MIN((__off64_t)sizeof(buf), offset - zip->offset);
+		const size_t read_len = zip_read(zip, buf, want_len);
+		if (read_len < want_len)
+		{
+			printf("FileSeek(mz_zip_reader_extract_iter_read) Failed to advance iterator, error:%s\n",
+			       mz_zip_get_error_string(mz_zip_get_last_error(zip->archive)));
+			return 0;
+		}
+	}
 
-static int OpenZipfileCached(char *path, int flags)
+	return 1;
+}
+
+
+static std::string zip_name_key(const char *name)
 {
-  if (last_zip_fname[0] && !strcasecmp(path, last_zip_fname))
-  {
-    return 1;
-  }
+	std::string key(name);
+	for (char &c : key) c = tolower(c);
+	return key;
+}
+
+static void zip_cache_free(zipCacheEntry *entry)
+{
+	if (!entry) return;
+
+	// open files still read through this archive, free it on the last close
+	if (entry->refs)
+	{
+		entry->evicted = true;
+		return;
+	}
+
+	mz_zip_reader_end(&entry->archive);
+	if (entry->cfile) fclose(entry->cfile);
+	pthread_mutex_destroy(&entry->lock);
+	delete entry;
+}
+
+static zipCacheEntry *zip_cache_open(char *path, int flags)
+{
+	struct stat64 st;
+	if (stat64(path, &st) < 0)
+	{
+		zip_cache_error = MZ_ZIP_FILE_NOT_FOUND;
+		return nullptr;
+	}
 
-  mz_zip_reader_end(&last_zip_archive);
-  mz_zip_zero_struct(&last_zip_archive);
-  if (last_zip_cfile)
-  {
-    fclose(last_zip_cfile);
-    last_zip_cfile = nullptr;
-  }
+	int slot = 0;
+	for (int i = 0; i < ZIP_CACHE_SIZE; i++)
+	{
+		zipCacheEntry *entry = zip_cache[i];
+		if (entry && !strcasecmp(path, entry->path))
+		{
+			if (entry->mtime == st.st_mtime && entry->size == st.st_size)
+			{
+				entry->last_use = ++zip_cache_tick;
+				zip_cache_hits++;
+				return entry;
+			}
+
+			// archive has changed, parse it again
+			zip_cache_free(entry);
+			zip_cache[i] = nullptr;
+		}
+
+		if (!zip_cache[i] || (zip_cache[slot] && zip_cache[i]->last_use < zip_cache[slot]->last_use)) slot = i;
+	}
+
+	zip_cache_free(zip_cache[slot]);
+	zip_cache[slot] = nullptr;
+	zip_cache_misses++;
+
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+	{
+		zip_cache_error = MZ_ZIP_FILE_OPEN_FAILED;
+		return nullptr;
+	}
+
+	zipCacheEntry *entry = new zipCacheEntry{};
+	pthread_mutex_init(&entry->lock, nullptr);
+	entry->cfile = fdopen(fd, "r");
+	if (!entry->cfile)
+	{
+		close(fd);
+		pthread_mutex_destroy(&entry->lock);
+		delete entry;
+		zip_cache_error = MZ_ZIP_FILE_OPEN_FAILED;
+		return nullptr;
+	}
+
+	if (!mz_zip_reader_init_cfile(&entry->archive, entry->cfile, 0, flags))
+	{
+		zip_cache_error = mz_zip_get_last_error(&entry->archive);
+		zip_cache_free(entry);
+		return nullptr;
+	}
+
+	uint32_t num_files = mz_zip_reader_get_num_files(&entry->archive);
+	entry->names.reserve(num_files);
+	entry->crcs.reserve(num_files);
+	for (uint32_t i = 0; i < num_files; i++)
+	{
+		mz_zip_archive_file_stat s;
+		if (!mz_zip_reader_file_stat(&entry->archive, i, &s)) continue;
+
+		std::string key = zip_name_key(s.m_filename);
+		entry->names.emplace(key, i);
+		if (!s.m_is_directory) entry->crcs.emplace(s.m_crc32, i);
+
+		// some zip files don't have directory entries, record every parent folder
+		for (size_t pos = key.find('/'); pos != std::string::npos; pos = key.find('/', pos + 1))
+		{
+			entry->dirs.insert(key.substr(0, pos + 1));
+		}
+	}
+
+	snprintf(entry->path, sizeof(entry->path), "%s", path);
+	entry->mtime = st.st_mtime;
+	entry->size = st.st_size;
+	entry->last_use = ++zip_cache_tick;
+	zip_cache[slot] = entry;
+	return entry;
+}
 
-  last_zip_fname[0] = '\0';
-  last_zip_fd = open(path, O_RDONLY|O_CLOEXEC);
-  if (last_zip_fd < 0)
-  {
-    return 0;
-  }
+// returns the archive with a reference taken, drop it with zip_cache_release()
+static zipCacheEntry *OpenZipfileCached(char *path, int flags)
+{
+	pthread_mutex_lock(&zip_cache_lock);
+	zipCacheEntry *entry = zip_cache_open(path, flags);
+	if (entry) entry->refs++;
+	pthread_mutex_unlock(&zip_cache_lock);
+	return entry;
+}
+
+static int zip_cache_locate(zipCacheEntry *entry, const char *name)
+{
+	auto it = entry->names.find(zip_name_key(name));
+	return (it != entry->names.end()) ? it->second : -1;
+}
 
-  last_zip_cfile = fdopen(last_zip_fd, "r");
-  if (!last_zip_cfile)
-  {
-    close(last_zip_fd);
-    last_zip_fd = -1;
-    return 0;
-  }
+static int zip_cache_search_by_crc(zipCacheEntry *entry, uint32_t crc32)
+{
+	auto it = entry->crcs.find(crc32);
+	return (it != entry->crcs.end()) ? it->second : -1;
+}
 
-  int mz_ret = mz_zip_reader_init_cfile(&last_zip_archive, last_zip_cfile, 0, flags);
-  if (mz_ret)
-  {
-    strncpy(last_zip_fname, path, sizeof(last_zip_fname));
-  }
-  return mz_ret;
+static void zip_cache_release(zipCacheEntry *entry)
+{
+	pthread_mutex_lock(&zip_cache_lock);
+	if (!--entry->refs && entry->evicted) zip_cache_free(entry);
+	pthread_mutex_unlock(&zip_cache_lock);
 }
 
+static void zip_cache_print_stats()
+{
+#ifdef ZIP_CACHE_DEBUG
+	printf("Zip cache: %u hits, %u misses\n", zip_cache_hits, zip_cache_misses);
+#endif
+}
 
 static int FileIsZipped(char* path, char** zip_path, char** file_path)
 {
@@ -251,10 +643,11 @@ static int isPathDirectory(const char *path, int use_zip = 1)
 			return 1;
 		}
 
-		if (!OpenZipfileCached(full_path, 0))
+		zipCacheEntry *zc = OpenZipfileCached(full_path, 0);
+		if (!zc)
 		{
 			printf("isPathDirectory(OpenZipfileCached) Zip:%s, error:%s\n", zip_path,
-				mz_zip_get_error_string(mz_zip_get_last_error(&last_zip_archive)));
+				mz_zip_get_error_string(zip_cache_error));
 			return 0;
 		}
 
@@ -262,27 +655,11 @@ static int isPathDirectory(const char *path, int use_zip = 1)
 		// file central directory.
 		strcat(file_path, "/");
 
-		// Some zip files don't have directory entries
-		// Use the locate_file call to try and find the directory entry first, since
-		// this is a binary search (usually) If that fails then scan for the first
-		// entry that starts with file_path
-
-		const int file_index = mz_zip_reader_locate_file(&last_zip_archive, file_path, NULL, 0);
-		if (file_index >= 0 && mz_zip_reader_is_file_a_directory(&last_zip_archive, file_index))
-		{
-			return 1;
-		}
-
-		for (size_t i = 0; i < mz_zip_reader_get_num_files(&last_zip_archive); i++)
-		{
-			char zip_fname[256];
-			mz_zip_reader_get_filename(&last_zip_archive, i, &zip_fname[0], sizeof(zip_fname));
-			if (strcasestr(zip_fname, file_path))
-			{
-				return 1;
-			}
-		}
-		return 0;
+		// Some zip files don't have directory entries,
+		// so the index also holds every parent folder of every file.
+		int ret = (zc->dirs.find(zip_name_key(file_path)) != zc->dirs.end()) ? 1 : 0;
+		zip_cache_release(zc);
+		return ret;
 	}
 	else
 	{
@@ -311,25 +688,28 @@ static int isPathRegularFile(const char *path, int use_zip = 1)
 		{
 			return 0;
 		}
-		if (!OpenZipfileCached(full_path, 0))
+		zipCacheEntry *zc = OpenZipfileCached(full_path, 0);
+		if (!zc)
 		{
 			//printf("isPathRegularFile(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-			//       mz_zip_get_error_string(mz_zip_get_last_error(&z)));
+			//       mz_zip_get_error_string(zip_cache_error));
 			return 0;
 		}
-		const int file_index = mz_zip_reader_locate_file(&last_zip_archive, file_path, NULL, 0);
+		const int file_index = zip_cache_locate(zc, file_path);
+		int ret = 0;
 		if (file_index < 0)
 		{
 			//printf("isPathRegularFile(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
 			//		 zip_path, file_path,
 			//		 mz_zip_get_error_string(mz_zip_get_last_error(&z)));
-			return 0;
 		}
-
-		if (!mz_zip_reader_is_file_a_directory(&last_zip_archive, file_index) && mz_zip_reader_is_file_supported(&last_zip_archive, file_index))
+		else if (!mz_zip_reader_is_file_a_directory(&zc->archive, file_index) && mz_zip_reader_is_file_supported(&zc->archive, file_index))
 		{
-			return 1;
+			ret = 1;
 		}
+
+		zip_cache_release(zc);
+		return ret;
 	}
 	else
 	{
@@ -345,17 +725,20 @@ int FileClose(fileTYPE *file)
 
 	if (file->zip)
 	{
+		zip_index_release(file->zip);
 		if (file->zip->iter)
 		{
 			mz_zip_reader_extract_iter_free(file->zip->iter);
 		}
-		mz_zip_reader_end(&file->zip->archive);
+		zip_cache_release(file->zip->entry);
 
 		delete file->zip;
 	}
 
 	if (file->filp)
 	{
+		cdcache_release(file);
+
 		//printf("closing %p\n", file->filp);
 		if (fclose(file->filp))
 		{
@@ -379,23 +762,6 @@ int FileClose(fileTYPE *file)
 	return err;
 }
 
-static int zip_search_by_crc(mz_zip_archive *zipArchive, uint32_t crc32)
-{
-	for (unsigned int file_index = 0; file_index < zipArchive->m_total_files; file_index++)
-	{
-		mz_zip_archive_file_stat s;
-		if (mz_zip_reader_file_stat(zipArchive, file_index, &s))
-		{
-			if (s.m_crc32 == crc32)
-			{
-				return file_index;
-			}
-		}
-	}
-
-	return -1;
-}
-
 int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
 {
 	make_fullpath(name);
@@ -413,47 +779,55 @@ int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
 		return 0;
 	}
 
-	file->zip = new fileZipArchive{};
-	if (!mz_zip_reader_init_file(&file->zip->archive, zip_path, 0))
+	zipCacheEntry *zc = OpenZipfileCached(zip_path, 0);
+	if (!zc)
 	{
-		printf("FileOpenZip(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+		printf("FileOpenZip(OpenZipfileCached) Zip:%s, error:%s\n", zip_path,
+					mz_zip_get_error_string(zip_cache_error));
 		return 0;
 	}
 
+	// read through the cached archive, its central directory is already parsed
+	file->zip = new fileZipArchive{};
+	file->zip->entry = zc;
+	file->zip->archive = &zc->archive;
+
 	file->zip->index = -1;
-	if (crc32) file->zip->index = zip_search_by_crc(&file->zip->archive, crc32);
-	if (file->zip->index < 0) file->zip->index = mz_zip_reader_locate_file(&file->zip->archive, file_path, NULL, 0);
+	if (crc32) file->zip->index = zip_cache_search_by_crc(zc, crc32);
+	if (file->zip->index < 0) file->zip->index = zip_cache_locate(zc, file_path);
 	if (file->zip->index < 0)
 	{
 		printf("FileOpenZip(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
 
 	mz_zip_archive_file_stat s;
-	if (!mz_zip_reader_file_stat(&file->zip->archive, file->zip->index, &s))
+	if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s))
 	{
 		printf("FileOpenZip(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
 	file->size = s.m_uncomp_size;
 
-	file->zip->iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+	pthread_mutex_lock(&zc->lock);
+	file->zip->iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
+	pthread_mutex_unlock(&zc->lock);
 	if (!file->zip->iter)
 	{
 		printf("FileOpenZip(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
 
+	zip_index_attach(file->zip, zip_path);
 	file->zip->offset = 0;
 	file->offset = 0;
 	file->mode = O_RDONLY;
@@ -480,44 +854,51 @@ int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zi
 			return 0;
 		}
 
-		file->zip = new fileZipArchive{};
-		if (!mz_zip_reader_init_file(&file->zip->archive, zip_path, 0))
+		zipCacheEntry *zc = OpenZipfileCached(zip_path, 0);
+		if (!zc)
 		{
-			if(!mute) printf("FileOpenEx(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+			if(!mute) printf("FileOpenEx(OpenZipfileCached) Zip:%s, error:%s\n", zip_path,
+					 mz_zip_get_error_string(zip_cache_error));
 			return 0;
 		}
 
-		file->zip->index = mz_zip_reader_locate_file(&file->zip->archive, file_path, NULL, 0);
+		file->zip = new fileZipArchive{};
+		file->zip->entry = zc;
+		file->zip->archive = &zc->archive;
+
+		file->zip->index = zip_cache_locate(zc, file_path);
 		if (file->zip->index < 0)
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
 
 		mz_zip_archive_file_stat s;
-		if (!mz_zip_reader_file_stat(&file->zip->archive, file->zip->index, &s))
+		if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s))
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
 		file->size = s.m_uncomp_size;
 
-		file->zip->iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+		pthread_mutex_lock(&zc->lock);
+		file->zip->iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
+		pthread_mutex_unlock(&zc->lock);
 		if (!file->zip->iter)
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
+		zip_index_attach(file->zip, zip_path);
 		file->zip->offset = 0;
 		file->offset = 0;
 		file->mode = mode;
@@ -644,34 +1025,10 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 			offset = file->size - offset;
 		}
 
-		if (offset < file->zip->offset)
-		{
-			mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
-			if (!iter)
-			{
-				printf("FileSeek(mz_zip_reader_extract_iter_new) Failed to rewind iterator, error:%s\n",
-				       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-				return 0;
-			}
-
-			mz_zip_reader_extract_iter_free(file->zip->iter);
-			file->zip->iter = iter;
-			file->zip->offset = 0;
-		}
-
-		static char buf[4*1024];
-		while (file->zip->offset < offset)
-		{
-			const size_t want_len = MIN((__off64_t)sizeof(buf), offset - file->zip->offset);
-			const size_t read_len = mz_zip_reader_extract_iter_read(file->zip->iter, buf, want_len);
-			file->zip->offset += read_len;
-			if (read_len < want_len)
-			{
-				printf("FileSeek(mz_zip_reader_extract_iter_read) Failed to advance iterator, error:%s\n",
-				       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
-				return 0;
-			}
-		}
+		pthread_mutex_lock(&file->zip->entry->lock);
+		int ok = zip_seek(file->zip, offset);
+		pthread_mutex_unlock(&file->zip->entry->lock);
+		if (!ok) return 0;
 	}
 	else
 	{
@@ -706,14 +1063,15 @@ int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
 	}
 	else if (file->zip)
 	{
-		ret = mz_zip_reader_extract_iter_read(file->zip->iter, pBuffer, length);
+		pthread_mutex_lock(&file->zip->entry->lock);
+		ret = zip_read(file->zip, pBuffer, length);
+		pthread_mutex_unlock(&file->zip->entry->lock);
 		if (!ret)
 		{
 			printf("FileReadEx(mz_zip_reader_extract_iter_read) Failed to read, error:%s\n",
-			       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+			       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			return failres;
 		}
-		file->zip->offset += ret;
 	}
 	else
 	{
@@ -1405,7 +1763,16 @@ static bool IsInSameFolder(const char *folder, const char *path)
 }
 
 static int names_loaded = 0;
-static void get_display_name(direntext_t *dext, const char *ext, int options)
+
+// display names of cores and MRA/MGL files in a cached listing are only valid for the same names.txt
+static uint32_t get_names_stamp()
+{
+	struct stat st;
+	if (stat(getFullPath("names.txt"), &st)) return 0;
+	return (uint32_t)st.st_mtime ^ (uint32_t)st.st_size;
+}
+
+static void get_display_name(direntext_t *dext, const char *ext, int options, dirindex_t *idx = 0, dirindex_entry_t *ie = 0)
 {
 	static char *names = 0;
 	memcpy(dext->altname, dext->de.d_name, sizeof(dext->altname));
@@ -1416,6 +1783,13 @@ static void get_display_name(direntext_t *dext, const char *ext, int options)
 	int rbf = (len > 4 && !strcasecmp(dext->altname + len - 4, ".rbf"));
 	if (rbf || xml)
 	{
+		if (ie && ie->has_alt)
+		{
+			snprintf(dext->altname, sizeof(dext->altname), "%s", ie->altname.c_str());
+			snprintf(dext->datecode, sizeof(dext->datecode), "%s", ie->datecode.c_str());
+			return;
+		}
+
 		dext->altname[len - 4] = 0;
 		if (rbf)
 		{
@@ -1483,6 +1857,8 @@ static void get_display_name(direntext_t *dext, const char *ext, int options)
 
 			dext->altname[len - 1] = 0;
 		}
+
+		if (ie) dirindex_set_alt(idx, ie, dext->altname, dext->datecode);
 		return;
 	}
 
@@ -1497,6 +1873,7 @@ static void get_display_name(direntext_t *dext, const char *ext, int options)
 
 int ScanDirectory(char* path, int mode, const char *extension, int options, const char *prefix, const char *filter)
 {
+	PROFILE_SCOPE_CAT("menu", "ScanDirectory");
 	static char file_name[1024];
 	static char full_path[1024];
 
@@ -1558,20 +1935,22 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		char *zip_path, *file_path_in_zip = (char*)"";
 		FileIsZipped(full_path, &zip_path, &file_path_in_zip);
 
-		DIR *d = nullptr;
+		dirindex_t *d = nullptr;
 		mz_zip_archive *z = nullptr;
+		zipCacheEntry *zc = nullptr;
 		if (is_zipped)
 		{
-			if (!OpenZipfileCached(full_path, 0))
+			zc = OpenZipfileCached(full_path, 0);
+			if (!zc)
 			{
-				printf("Couldn't open zip file %s: %s\n", full_path, mz_zip_get_error_string(mz_zip_get_last_error(&last_zip_archive)));
+				printf("Couldn't open zip file %s: %s\n", full_path, mz_zip_get_error_string(zip_cache_error));
 				return 0;
 			}
-			z = &last_zip_archive;
+			z = &zc->archive;
 		}
 		else
 		{
-			d = opendir(full_path);
+			d = dirindex_open(full_path, get_names_stamp());
 			if (!d)
 			{
 				printf("Couldn't open dir: %s\n", full_path);
@@ -1580,7 +1959,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		}
 
 		struct dirent64 *de = nullptr;
-		for (size_t i = 0; (d && (de = readdir64(d)))
+		for (size_t i = 0; (d && i < d->entries.size())
 				 || (z && i < mz_zip_reader_get_num_files(z)); i++)
 		{
 #ifdef USE_SCHEDULER
@@ -1642,24 +2021,12 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 					}
 				}
 			}
-			// Handle (possible) symbolic link type in the directory entry
-			else if (de->d_type == DT_LNK || de->d_type == DT_REG)
+			else
 			{
-				sprintf(full_path + path_len, "/%s", de->d_name);
-
-				struct stat entrystat;
-
-				if (!stat(full_path, &entrystat))
-				{
-					if (S_ISREG(entrystat.st_mode))
-					{
-						de->d_type = DT_REG;
-					}
-					else if (S_ISDIR(entrystat.st_mode))
-					{
-						de->d_type = DT_DIR;
-					}
-				}
+				// symbolic links are already resolved in the index
+				snprintf(_de.d_name, sizeof(_de.d_name), "%s", d->entries[i].name.c_str());
+				_de.d_type = d->entries[i].type;
+				de = &_de;
 			}
 
             if (filter)
@@ -1818,7 +2185,8 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 				    memcpy(&dext.de, de, sizeof(dext.de));
 				    if (isZip)
 				        dext.flags |= DT_EXT_ZIP;
-				    get_display_name(&dext, extension, options);
+				    if (d) get_display_name(&dext, extension, options, d, &d->entries[i]);
+				    else get_display_name(&dext, extension, options);
 				    DirItem.push_back(dext);
         }
 			}
@@ -1834,11 +2202,15 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			strcpy(dext.de.d_name, "..");
 			get_display_name(&dext, extension, options);
 			DirItem.push_back(dext);
+
+			zip_cache_release(zc);
+			zip_cache_print_stats();
 		}
 
 		if (d)
 		{
-			closedir(d);
+			dirindex_close(d);
+			dirindex_print_stats();
 		}
 
 		printf("Got %d dir entries\n", flist_nDirEntries());
@@ -10,6 +10,8 @@
 #include <sys/stat.h>
 
 #include "fpga_io.h"
+#include "spi.h"
+#include "ide_cache.h"
 #include "file_io.h"
 #include "input.h"
 #include "osd.h"
@@ -540,11 +542,13 @@ int fpga_io_init()
 
 int fpga_core_id()
 {
+	spi_lock();
 	uint32_t gpo = (fpga_gpo_read() & 0x7FFFFFFF);
 	fpga_gpo_write(gpo);
 	uint32_t coretype = fpga_gpi_read();
 	gpo |= 0x80000000;
 	fpga_gpo_write(gpo);
+	spi_unlock();
 
 	if ((coretype >> 8) != 0x5CA623) return -1;
 	return coretype & 0xFF;
@@ -562,22 +566,29 @@ int fpga_get_io_version()
 
 void fpga_set_led(uint32_t on)
 {
+	spi_lock();
 	uint32_t gpo = fpga_gpo_read();
 	fpga_gpo_write(on ? gpo | 0x20000000 : gpo & ~0x20000000);
+	spi_unlock();
 }
 
 int fpga_get_buttons()
 {
+	spi_lock();
 	fpga_gpo_write(fpga_gpo_read() | 0x80000000);
 	int gpi = fpga_gpi_read();
+	spi_unlock();
 	if (gpi < 0) gpi = 0; // FPGA is not in user mode. Ignore the data;
 	return (gpi >> 29) & 3;
 }
 
 int fpga_get_io_type()
 {
+	spi_lock();
 	fpga_gpo_write(fpga_gpo_read() | 0x80000000);
-	return (fpga_gpi_read() >> 28) & 1;
+	int gpi = fpga_gpi_read();
+	spi_unlock();
+	return (gpi >> 28) & 1;
 }
 
 int fpga_get_hdmi_int()
@@ -587,6 +598,7 @@ int fpga_get_hdmi_int()
 
 void reboot(int cold)
 {
+	ide_cache_flush_all();
 	sync();
 	fpga_core_reset(1);
 
@@ -619,6 +631,7 @@ char *getappname()
 
 void app_restart(const char *path, const char *xml, const char *exe)
 {
+	ide_cache_flush_all();
 	sync();
 	fpga_core_reset(1);
 
@@ -648,8 +661,10 @@ void app_restart(const char *path, const char *xml, const char *exe)
 
 void fpga_core_reset(int reset)
 {
+	spi_lock();
 	uint32_t gpo = fpga_gpo_read() & ~0xC0000000;
 	fpga_gpo_write(reset ? gpo | 0x40000000 : gpo | 0x80000000);
+	spi_unlock();
 }
 
 int is_fpga_ready(int quick)
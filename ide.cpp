@@ -20,8 +20,11 @@
 #include "user_io.h"
 #include "file_io.h"
 #include "hardware.h"
+#include "scheduler.h"
 #include "ide.h"
 #include "ide_cdrom.h"
+#include "ide_cache.h"
+#include "ide_overlay.h"
 
 #if 0
 	#define dbg_printf     printf
@@ -88,11 +91,151 @@ uint16_t ide_check()
 	res = spi_w(UIO_DMA_SDIO);
 	if (!res) res = (uint8_t)spi_w(0);
 	DisableIO();
+	if (res) scheduler_io_pending();
 	return res;
 }
 
+#define IDE_SPIN_MIN 8
+#define IDE_SPIN_MAX 512
+
+struct ide_wait_stats_t
+{
+	uint32_t waits;
+	uint32_t yields;
+	uint64_t polls;
+	uint64_t us;
+	uint32_t max_us;
+};
+
+static ide_wait_stats_t ide_wait_stats[2] = {};
+static uint32_t ide_spin_limit = 64;
+static int ide_yielded = 0;
+static int ide_held = 0;
+
+// Wait for the next request of the port during a multi-sector transfer.
+// The host usually answers within a few polls, so poll for a while and
+// then let the UI and input run between the polls. The spin limit follows
+// the observed response time.
+static uint16_t ide_wait_req(ide_config *ide)
+{
+	ide_wait_stats_t *st = &ide_wait_stats[ide == &ide_inst[1]];
+	uint32_t polls = 0;
+	uint16_t req;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (!(req = (ide_check() >> ide->bitoff) & 7))
+	{
+		if (++polls >= ide_spin_limit)
+		{
+			scheduler_io_pending();
+			ide_yielded = 1;
+			scheduler_yield();
+			ide_yielded = 0;
+			st->yields++;
+		}
+	}
+
+	if (polls >= ide_spin_limit)
+	{
+		if (ide_spin_limit > IDE_SPIN_MIN) ide_spin_limit /= 2;
+	}
+	else if (polls * 2 > ide_spin_limit && ide_spin_limit < IDE_SPIN_MAX)
+	{
+		ide_spin_limit *= 2;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint32_t us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+	st->waits++;
+	st->polls += polls + 1;
+	st->us += us;
+	if (us > st->max_us) st->max_us = us;
+	return req;
+}
+
+static void ide_print_wait_stats(ide_config *ide)
+{
+	ide_wait_stats_t *st = &ide_wait_stats[ide == &ide_inst[1]];
+	if (!st->waits) return;
+
+	printf("IDE %04X wait: %u waits, avg %llu polls, %u yields, avg %lluus, max %uus, spin limit %u\n", ide->base, st->waits,
+		(unsigned long long)(st->polls / st->waits), st->yields, (unsigned long long)(st->us / st->waits), st->max_us, ide_spin_limit);
+	memset(st, 0, sizeof(*st));
+}
+
+// The UI runs while a transfer waits in ide_wait_req. Let the transfer
+// finish before its image is replaced, but don't hang the UI if the host
+// stopped in the middle of it. Such a transfer is aborted by the generation check.
+static void ide_wait_idle()
+{
+	unsigned long timeout = GetTimer(500);
+	while (ide_yielded && !CheckTimer(timeout)) scheduler_yield();
+}
+
+static void ide_drive_release(drive_t *drive)
+{
+	drive->gen++;
+	ide_cache_close(drive->cache);
+	drive->cache = 0;
+	ide_overlay_close(drive->overlay);
+	drive->overlay = 0;
+}
+
+static void ide_drive_attach(drive_t *drive)
+{
+	drive->gen++;
+	drive->overlay = ide_overlay_open(drive->f);
+	drive->cache = ide_cache_open(drive->f, drive->overlay);
+}
+
+uint32_t ide_overlay_changes()
+{
+	uint32_t changed = 0;
+	for (auto &ide : ide_inst)
+	{
+		for (auto &drive : ide.drive) changed += ide_overlay_changed(drive.overlay);
+	}
+	return changed;
+}
+
+void ide_overlay_apply(int commit, ide_overlay_progress_t progress)
+{
+	ide_wait_idle();
+
+	// commands wait while the changes are copied, a transfer which still
+	// hasn't finished is aborted by the generation change
+	ide_held = 1;
+	for (auto &ide : ide_inst)
+	{
+		for (auto &drive : ide.drive)
+		{
+			if (!drive.overlay) continue;
+
+			// cached blocks may come from the overlay
+			ide_cache_close(drive.cache);
+			drive.cache = 0;
+			drive.gen++;
+
+			if (commit) ide_overlay_commit(drive.overlay, progress);
+			else ide_overlay_discard(drive.overlay);
+
+			ide_drive_attach(&drive);
+		}
+	}
+	ide_held = 0;
+}
+
 int ide_img_mount(fileTYPE *f, const char *name, int rw)
 {
+	ide_wait_idle();
+	for (auto &ide : ide_inst)
+	{
+		for (auto &drive : ide.drive) if (drive.f == f) ide_drive_release(&drive);
+	}
+
 	FileClose(f);
 	int writable = 0, ret = 0;
 
@@ -422,9 +565,12 @@ void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, i
 
 	drive_t *drive = &ide_inst[port].drive[drv];
 
+	ide_wait_idle();
 	ide_inst[port].base = port ? IDE1_BASE : IDE0_BASE;
 	ide_inst[port].drive[drv].drvnum = drvnum;
 
+	ide_drive_release(drive);
+
 	if (drive->f && (f != drive->f) && drive->f->opened())
 	{
 		FileClose(drive->f);
@@ -483,6 +629,8 @@ void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, i
 			if (offset && drive->cylinders < 65535) drive->cylinders++;
 			drive->offset = offset;
 			drive->type = type;
+
+			if (!drive->chd_f && (drive->f->mode & O_RDWR)) ide_drive_attach(drive);
 		}
 
 		uint16_t identify[256] =
@@ -766,14 +914,34 @@ inline int readhdd(drive_t *drive, uint32_t lba, int cnt)
 	}
 	else
 	{
+		if (drive->cache) return ide_cache_read(drive->cache, lba - drive->offset, ide_buf, cnt);
+		if (drive->overlay) return ide_overlay_pread(drive->overlay, ide_buf, cnt * 512, (uint64_t)(lba - drive->offset) * 512);
 		return FileReadAdv(drive->f, ide_buf, cnt * 512, -1);
 	}
 }
 
+inline int writehdd(drive_t *drive, uint32_t lba, int cnt)
+{
+	if (drive->cache) return ide_cache_write(drive->cache, lba - drive->offset, ide_buf, cnt);
+	if (drive->overlay) return ide_overlay_pwrite(drive->overlay, ide_buf, cnt * 512, (uint64_t)(lba - drive->offset) * 512);
+	return FileWriteAdv(drive->f, ide_buf, cnt * 512, -1);
+}
+
+// The image was replaced while the transfer waited for the host.
+static void ide_abort(ide_config *ide)
+{
+	printf("IDE %04X: image changed during transfer, command aborted\n", ide->base);
+	ide->state = IDE_STATE_IDLE;
+	ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_ERR | ATA_STATUS_IRQ;
+	ide->regs.error = ATA_ERR_ABRT;
+	ide_set_regs(ide);
+}
+
 static void process_read(ide_config *ide, int multi)
 {
 	uint32_t lba = get_lba(ide);
 	uint16_t ide_req = 0;
+	uint32_t gen = ide->drive[ide->regs.drv].gen;
 
 	dbg2_printf("  sector_count: %d\n", ide->regs.sector_count);
 
@@ -815,14 +983,19 @@ static void process_read(ide_config *ide, int multi)
 		if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
 		if (ide->null) memset(ide_buf, 0, cnt * 512);
 
-		ide_req = 0;
-		while (!ide_req) ide_req = (ide_check() >> ide->bitoff) & 7;
+		ide_req = ide_wait_req(ide);
 
 		if (ide_req != 5)
 		{
 			ide->state = IDE_STATE_IDLE;
 			break;
 		}
+
+		if (gen != ide->drive[ide->regs.drv].gen)
+		{
+			ide_abort(ide);
+			break;
+		}
 	}
 
 	dbg2_printf("  finish\n");
@@ -833,6 +1006,7 @@ static void process_write(ide_config *ide, int multi)
 	uint32_t lba = get_lba(ide);
 	uint32_t cnt = 1;
 	uint16_t ide_req;
+	uint32_t gen = ide->drive[ide->regs.drv].gen;
 
 	ide->null = (ide->regs.cmd != 0xFA) ? !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset)) : 1;
 	uint8_t irq = 0;
@@ -846,8 +1020,7 @@ static void process_write(ide_config *ide, int multi)
 		ide->regs.io_size = cnt;
 		ide_set_regs(ide);
 
-		ide_req = 0;
-		while (!ide_req) ide_req = (ide_check() >> ide->bitoff) & 7;
+		ide_req = ide_wait_req(ide);
 
 		if (ide_req != 5)
 		{
@@ -855,6 +1028,12 @@ static void process_write(ide_config *ide, int multi)
 			break;
 		}
 
+		if (ide->regs.cmd != 0xFA && gen != ide->drive[ide->regs.drv].gen)
+		{
+			ide_abort(ide);
+			break;
+		}
+
 		ide_recv_data(ide_buf, cnt * 256);
 
 		if (ide->regs.cmd == 0xFA)
@@ -869,7 +1048,7 @@ static void process_write(ide_config *ide, int multi)
 		}
 		else
 		{
-			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : (FileWriteAdv(ide->drive[ide->regs.drv].f, ide_buf, cnt * 512, -1) <= 0);
+			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : (writehdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
 			lba += cnt;
 			ide->regs.sector_count -= cnt;
 			put_lba(ide, lba);
@@ -987,6 +1166,9 @@ void ide_io(int num, int req)
 {
 	ide_config *ide = &ide_inst[num];
 
+	// overlay is being applied, the request stays pending
+	if (ide_held) return;
+
 	//printf("req: %d, disk: %d\n", req, num);
 
 	if (req == 0) // no request
@@ -1056,6 +1238,12 @@ void ide_io(int num, int req)
 		if (ide->state != IDE_STATE_RESET)
 		{
 			printf("IDE %04X reset start\n", ide->base);
+			ide_print_wait_stats(ide);
+			for (auto &drive : ide->drive)
+			{
+				ide_cache_flush(drive.cache);
+				ide_cache_print_stats(drive.cache);
+			}
 		}
 
 		ide->drive[0].playing = 0;
@@ -69,6 +69,9 @@ struct track_t
 	int      chd_offset;
 };
 
+struct ide_cache_t;
+struct ide_overlay_t;
+
 struct drive_t
 {
 	fileTYPE *f;
@@ -106,11 +109,13 @@ struct drive_t
 	uint8_t  atapi_ascq_code;
 
 	chd_file *chd_f;
-	int      chd_hunknum;
-	uint8_t	 *chd_hunkbuf;
 	uint32_t  chd_total_size;
 	uint32_t  chd_last_partial_lba;
 
+	ide_cache_t *cache;
+	ide_overlay_t *overlay;
+	uint32_t gen; // changes when the image, cache or overlay is replaced
+
 	uint16_t id[256];
 };
 
@@ -155,6 +160,10 @@ int ide_is_placeholder(int num);
 void ide_reset(uint8_t hotswap[4]);
 int ide_open(uint8_t unit, const char* filename);
 
+// changed blocks in all mounted overlays, commit or drop them
+uint32_t ide_overlay_changes();
+void ide_overlay_apply(int commit, void (*progress)(uint32_t done, uint32_t total) = 0);
+
 void ide_io(int num, int req);
 
 #endif
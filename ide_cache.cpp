@@ -0,0 +1,683 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "ide_cache.h"
+#include "ide_overlay.h"
+#include "cfg.h"
+
+#define BLOCK_SECTORS  64
+#define BLOCK_SIZE     (BLOCK_SECTORS * 512)
+#define PREFETCH       4
+#define QUEUE_SIZE     16
+#define FLUSH_IDLE_MS  100  // write back once the guest stops writing for a moment
+#define FLUSH_AGE_MS   1000 // but don't keep anything dirty for longer than this
+#define FLUSH_BATCH    (256 * 1024)
+#define RETRY_MS       1000 // failed writes stay dirty and are retried after this
+
+enum
+{
+	BLK_EMPTY,
+	BLK_LOADING,
+	BLK_READY
+};
+
+struct cache_block_t
+{
+	uint32_t block;
+	int      state;
+	bool     flushing;
+	uint64_t valid;
+	uint64_t dirty;
+	uint32_t last_use;
+	uint8_t *data;
+};
+
+struct ide_cache_t
+{
+	fileTYPE        *f;
+	ide_overlay_t   *overlay;
+	int              fd;
+	uint64_t         size;
+	uint32_t         count;
+	cache_block_t   *blocks;
+	uint8_t         *mem;
+	uint8_t         *scratch;
+	std::unordered_map<uint32_t, cache_block_t*> map;
+
+	uint32_t         dirty_blocks;
+	uint32_t         in_io;
+	bool             flush_req;
+	bool             write_error;
+	uint32_t         failed_flushes;
+	struct timespec  first_dirty;
+	struct timespec  last_write;
+	struct timespec  last_error;
+
+	uint32_t         last_block;
+	int              seq_run;
+
+	struct
+	{
+		uint32_t hits;
+		uint32_t misses;
+		uint32_t prefetched;
+		uint32_t writes;
+		uint32_t flushes;
+		uint64_t flushed;
+		uint32_t errors;
+		uint64_t miss_us;
+	} stats;
+};
+
+struct prefetch_t
+{
+	ide_cache_t *c;
+	uint32_t     block;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cache_cond_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t cache_thread;
+static bool cache_thread_started = false;
+
+static std::vector<ide_cache_t*> caches;
+static prefetch_t queue[QUEUE_SIZE];
+static uint32_t queue_head = 0, queue_tail = 0;
+static uint32_t use_tick = 0;
+
+static uint8_t worker_scratch[BLOCK_SIZE];
+static uint8_t worker_buf[FLUSH_BATCH];
+
+static uint64_t elapsed_us(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)((now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000);
+}
+
+static uint64_t sector_mask(int start, int cnt)
+{
+	return ((cnt == 64) ? ~0ULL : ((1ULL << cnt) - 1)) << start;
+}
+
+static ssize_t image_read(ide_cache_t *c, void *buf, uint32_t len, uint64_t offset)
+{
+	return c->overlay ? ide_overlay_pread(c->overlay, buf, len, offset) : pread(c->fd, buf, len, offset);
+}
+
+static ssize_t image_write(ide_cache_t *c, const void *buf, uint32_t len, uint64_t offset)
+{
+	return c->overlay ? ide_overlay_pwrite(c->overlay, buf, len, offset) : pwrite(c->fd, buf, len, offset);
+}
+
+// all functions below expect cache_lock to be held
+
+static cache_block_t *find_block(ide_cache_t *c, uint32_t block)
+{
+	auto it = c->map.find(block);
+	return (it == c->map.end()) ? nullptr : it->second;
+}
+
+static cache_block_t *get_victim(ide_cache_t *c)
+{
+	cache_block_t *victim = nullptr;
+	for (uint32_t i = 0; i < c->count; i++)
+	{
+		cache_block_t *b = &c->blocks[i];
+		if (b->state == BLK_EMPTY) return b;
+		if (b->state == BLK_READY && !b->dirty && !b->flushing && (!victim || b->last_use < victim->last_use)) victim = b;
+	}
+	return victim;
+}
+
+static void assign_block(ide_cache_t *c, cache_block_t *b, uint32_t block)
+{
+	if (b->state != BLK_EMPTY) c->map.erase(b->block);
+	b->block = block;
+	b->valid = 0;
+	b->dirty = 0;
+	c->map[block] = b;
+}
+
+static void drop_block(ide_cache_t *c, cache_block_t *b)
+{
+	c->map.erase(b->block);
+	b->state = BLK_EMPTY;
+	b->valid = 0;
+	b->dirty = 0;
+}
+
+// block must be in BLK_LOADING state, the lock is released during the read.
+// Sectors written while the block wasn't loaded are kept.
+static bool fill_block(ide_cache_t *c, cache_block_t *b, uint8_t *scratch)
+{
+	c->in_io++;
+	pthread_mutex_unlock(&cache_lock);
+
+	ssize_t ret = image_read(c, scratch, BLOCK_SIZE, (uint64_t)b->block * BLOCK_SIZE);
+
+	pthread_mutex_lock(&cache_lock);
+	c->in_io--;
+
+	bool ok = ret >= 0;
+	if (ok)
+	{
+		if (ret < BLOCK_SIZE) memset(scratch + ret, 0, BLOCK_SIZE - ret);
+		for (int i = 0; i < BLOCK_SECTORS; i++)
+		{
+			if (!(b->valid & (1ULL << i))) memcpy(b->data + i * 512, scratch + i * 512, 512);
+		}
+		b->valid = ~0ULL;
+		b->state = BLK_READY;
+	}
+	else
+	{
+		printf("IDE cache: read error at block %u.\n", b->block);
+		c->stats.errors++;
+		if (b->dirty) b->state = BLK_READY;
+		else drop_block(c, b);
+	}
+
+	pthread_cond_broadcast(&cache_cond_ready);
+	return ok;
+}
+
+static bool flush_needed(ide_cache_t *c)
+{
+	if (!c->dirty_blocks) return false;
+	if (c->failed_flushes && elapsed_us(&c->last_error) < RETRY_MS * 1000) return false;
+	return c->flush_req || c->dirty_blocks * 2 >= c->count ||
+		elapsed_us(&c->last_write) >= FLUSH_IDLE_MS * 1000 || elapsed_us(&c->first_dirty) >= FLUSH_AGE_MS * 1000;
+}
+
+// Write back up to FLUSH_BATCH of dirty sectors, merging adjacent sectors into single writes.
+// Returns false if there was nothing to write.
+static bool flush_some(ide_cache_t *c)
+{
+	std::vector<cache_block_t*> dirty;
+	for (uint32_t i = 0; i < c->count; i++)
+	{
+		cache_block_t *b = &c->blocks[i];
+		if (b->state == BLK_READY && b->dirty && !b->flushing) dirty.push_back(b);
+	}
+	if (dirty.empty()) return false;
+
+	std::sort(dirty.begin(), dirty.end(), [](cache_block_t *a, cache_block_t *b) { return a->block < b->block; });
+
+	struct run_t
+	{
+		uint64_t lba;
+		uint32_t cnt;
+		uint32_t pos;
+	};
+
+	std::vector<run_t> runs;
+	std::vector<cache_block_t*> taken;
+	uint32_t used = 0;
+
+	for (cache_block_t *b : dirty)
+	{
+		uint32_t size = __builtin_popcountll(b->dirty) * 512;
+		if (used && used + size > FLUSH_BATCH) break;
+
+		for (int i = 0; i < BLOCK_SECTORS; i++)
+		{
+			if (!(b->dirty & (1ULL << i))) continue;
+
+			uint64_t lba = (uint64_t)b->block * BLOCK_SECTORS + i;
+			if (!runs.empty() && runs.back().lba + runs.back().cnt == lba) runs.back().cnt++;
+			else runs.push_back({ lba, 1, used });
+
+			memcpy(worker_buf + used, b->data + i * 512, 512);
+			used += 512;
+		}
+
+		b->dirty = 0;
+		b->flushing = true;
+		c->dirty_blocks--;
+		taken.push_back(b);
+	}
+
+	c->in_io++;
+	pthread_mutex_unlock(&cache_lock);
+
+	std::vector<run_t> failed;
+	for (auto &r : runs)
+	{
+		if (image_write(c, worker_buf + r.pos, r.cnt * 512, r.lba * 512) != (ssize_t)(r.cnt * 512))
+		{
+			printf("IDE cache: write error at sector %llu, %u sectors kept dirty.\n", (unsigned long long)r.lba, r.cnt);
+			failed.push_back(r);
+		}
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	c->in_io--;
+
+	// flushing blocks can't be reused, so the failed sectors are still in them
+	for (auto &r : failed)
+	{
+		for (uint64_t lba = r.lba; lba < r.lba + r.cnt; lba++)
+		{
+			cache_block_t *b = find_block(c, lba / BLOCK_SECTORS);
+			if (!b->dirty)
+			{
+				if (!c->dirty_blocks) clock_gettime(CLOCK_MONOTONIC, &c->first_dirty);
+				c->dirty_blocks++;
+			}
+			b->dirty |= 1ULL << (lba % BLOCK_SECTORS);
+		}
+	}
+
+	if (!failed.empty())
+	{
+		c->write_error = true;
+		c->failed_flushes++;
+		clock_gettime(CLOCK_MONOTONIC, &c->last_error);
+	}
+	else
+	{
+		c->failed_flushes = 0;
+	}
+
+	for (cache_block_t *b : taken) b->flushing = false;
+	if (!c->dirty_blocks) c->flush_req = false;
+
+	c->stats.flushes += runs.size();
+	c->stats.flushed += used / 512;
+	c->stats.errors += failed.size();
+
+	pthread_cond_broadcast(&cache_cond_ready);
+	return true;
+}
+
+static bool do_prefetch()
+{
+	if (queue_head == queue_tail) return false;
+
+	prefetch_t req = queue[queue_tail % QUEUE_SIZE];
+	queue_tail++;
+
+	ide_cache_t *c = req.c;
+	if ((uint64_t)req.block * BLOCK_SIZE >= c->size || find_block(c, req.block)) return true;
+
+	cache_block_t *b = get_victim(c);
+	if (!b) return true;
+
+	assign_block(c, b, req.block);
+	b->state = BLK_LOADING;
+	b->last_use = use_tick;
+	if (fill_block(c, b, worker_scratch)) c->stats.prefetched++;
+	return true;
+}
+
+static void *cache_worker(void *)
+{
+	pthread_mutex_lock(&cache_lock);
+	while (true)
+	{
+		if (do_prefetch()) continue;
+
+		bool flushed = false;
+		bool pending = false;
+		for (ide_cache_t *c : caches)
+		{
+			if (flush_needed(c) && flush_some(c))
+			{
+				flushed = true;
+				break;
+			}
+			if (c->dirty_blocks) pending = true;
+		}
+		if (flushed) continue;
+
+		if (pending)
+		{
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 50 * 1000000;
+			if (ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&cache_cond_work, &cache_lock, &ts);
+		}
+		else
+		{
+			pthread_cond_wait(&cache_cond_work, &cache_lock);
+		}
+	}
+	return nullptr;
+}
+
+static void queue_prefetch(ide_cache_t *c, uint32_t block)
+{
+	if ((uint64_t)block * BLOCK_SIZE >= c->size || find_block(c, block)) return;
+
+	for (uint32_t i = queue_tail; i != queue_head; i++)
+	{
+		if (queue[i % QUEUE_SIZE].c == c && queue[i % QUEUE_SIZE].block == block) return;
+	}
+
+	// drop the oldest request if the queue is full
+	if (queue_head - queue_tail == QUEUE_SIZE) queue_tail++;
+
+	queue[queue_head % QUEUE_SIZE] = { c, block };
+	queue_head++;
+	pthread_cond_signal(&cache_cond_work);
+}
+
+// wait until a block can be reused, all of them may be dirty
+static cache_block_t *wait_victim(ide_cache_t *c, uint32_t block)
+{
+	cache_block_t *b;
+	while (!(b = get_victim(c)))
+	{
+		// nothing gets freed while the image can't be written
+		if (c->write_error) return nullptr;
+
+		c->flush_req = true;
+		pthread_cond_signal(&cache_cond_work);
+		pthread_cond_wait(&cache_cond_ready, &cache_lock);
+
+		// might have been loaded by the worker meanwhile
+		if (find_block(c, block)) return nullptr;
+	}
+
+	assign_block(c, b, block);
+	return b;
+}
+
+// returns the block with the sectors in mask valid or NULL on error
+static cache_block_t *acquire_block(ide_cache_t *c, uint32_t block, uint64_t mask)
+{
+	struct timespec start;
+	bool miss = false;
+
+	while (true)
+	{
+		cache_block_t *b = find_block(c, block);
+		if (b && b->state == BLK_LOADING)
+		{
+			if (!miss) clock_gettime(CLOCK_MONOTONIC, &start);
+			miss = true;
+			pthread_cond_wait(&cache_cond_ready, &cache_lock);
+			continue;
+		}
+
+		if (b && (b->valid & mask) == mask)
+		{
+			if (miss) c->stats.miss_us += elapsed_us(&start);
+			else c->stats.hits++;
+			b->last_use = ++use_tick;
+			return b;
+		}
+
+		if (!miss) clock_gettime(CLOCK_MONOTONIC, &start);
+		miss = true;
+		c->stats.misses++;
+
+		if (!b && !(b = wait_victim(c, block)))
+		{
+			if (c->write_error) return nullptr;
+			continue;
+		}
+
+		b->state = BLK_LOADING;
+		if (!fill_block(c, b, c->scratch)) return nullptr;
+	}
+}
+
+ide_cache_t *ide_cache_open(fileTYPE *f, ide_overlay_t *overlay)
+{
+	if (!cfg.ide_cache_size || !f->filp) return nullptr;
+
+	ide_cache_t *c = new ide_cache_t{};
+	c->count = cfg.ide_cache_size * (1024 * 1024 / BLOCK_SIZE);
+	c->mem = (uint8_t *)malloc((size_t)c->count * BLOCK_SIZE);
+	c->scratch = (uint8_t *)malloc(BLOCK_SIZE);
+	c->blocks = new cache_block_t[c->count]{};
+
+	if (!c->mem || !c->scratch)
+	{
+		printf("IDE cache: cannot allocate %uMB.\n", cfg.ide_cache_size);
+		free(c->mem);
+		free(c->scratch);
+		delete[] c->blocks;
+		delete c;
+		return nullptr;
+	}
+
+	for (uint32_t i = 0; i < c->count; i++) c->blocks[i].data = c->mem + (size_t)i * BLOCK_SIZE;
+
+	// the cache works on the descriptor directly
+	fflush(f->filp);
+	c->f = f;
+	c->overlay = overlay;
+	c->fd = fileno(f->filp);
+	c->size = f->size;
+	c->last_block = UINT32_MAX;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!cache_thread_started)
+	{
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+
+		// Set affinity to core #0 since main runs on core #1
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(0, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+		cache_thread_started = !pthread_create(&cache_thread, &attr, cache_worker, nullptr);
+		pthread_attr_destroy(&attr);
+	}
+	caches.push_back(c);
+	pthread_mutex_unlock(&cache_lock);
+
+	printf("IDE cache: %uMB for %s\n", cfg.ide_cache_size, f->name);
+	return c;
+}
+
+// gives up if a write fails, the data stays dirty
+static void flush_wait(ide_cache_t *c)
+{
+	c->failed_flushes = 0;
+	c->flush_req = true;
+	pthread_cond_signal(&cache_cond_work);
+	while ((c->dirty_blocks && !c->failed_flushes) || c->in_io) pthread_cond_wait(&cache_cond_ready, &cache_lock);
+}
+
+void ide_cache_flush(ide_cache_t *c)
+{
+	if (!c) return;
+
+	pthread_mutex_lock(&cache_lock);
+	flush_wait(c);
+	pthread_mutex_unlock(&cache_lock);
+
+	fdatasync(c->fd);
+}
+
+void ide_cache_flush_all()
+{
+	pthread_mutex_lock(&cache_lock);
+	std::vector<ide_cache_t*> list = caches;
+	pthread_mutex_unlock(&cache_lock);
+
+	for (ide_cache_t *c : list) ide_cache_flush(c);
+}
+
+void ide_cache_close(ide_cache_t *c)
+{
+	if (!c) return;
+
+	pthread_mutex_lock(&cache_lock);
+	flush_wait(c);
+	if (c->dirty_blocks) printf("IDE cache: %u blocks could not be written to %s.\n", c->dirty_blocks, c->f->name);
+
+	caches.erase(std::find(caches.begin(), caches.end(), c));
+
+	// drop pending prefetches
+	uint32_t head = queue_tail;
+	for (uint32_t i = queue_tail; i != queue_head; i++)
+	{
+		if (queue[i % QUEUE_SIZE].c != c) queue[head++ % QUEUE_SIZE] = queue[i % QUEUE_SIZE];
+	}
+	queue_head = head;
+	pthread_mutex_unlock(&cache_lock);
+
+	fdatasync(c->fd);
+
+	// file position and stdio buffer are stale now
+	FileSeek(c->f, 0, SEEK_SET);
+
+	ide_cache_print_stats(c);
+
+	free(c->mem);
+	free(c->scratch);
+	delete[] c->blocks;
+	delete c;
+}
+
+int ide_cache_read(ide_cache_t *c, uint32_t lba, void *buf, int cnt)
+{
+	if ((uint64_t)lba * 512 >= c->size) return 0;
+
+	uint8_t *dst = (uint8_t *)buf;
+	int done = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	if (c->write_error)
+	{
+		c->write_error = false;
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+
+	while (cnt)
+	{
+		uint32_t block = lba / BLOCK_SECTORS;
+		int start = lba % BLOCK_SECTORS;
+		int n = std::min(cnt, BLOCK_SECTORS - start);
+
+		cache_block_t *b = acquire_block(c, block, sector_mask(start, n));
+		if (!b)
+		{
+			c->write_error = false;
+			done = 0;
+			break;
+		}
+
+		memcpy(dst, b->data + start * 512, n * 512);
+
+		// read further ahead while access is sequential
+		if (block == c->last_block + 1) c->seq_run++;
+		else if (block != c->last_block) c->seq_run = 0;
+		c->last_block = block;
+
+		if (c->seq_run)
+		{
+			for (int i = 1; i <= PREFETCH; i++) queue_prefetch(c, block + i);
+		}
+
+		dst += n * 512;
+		done += n * 512;
+		lba += n;
+		cnt -= n;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+	return done;
+}
+
+int ide_cache_write(ide_cache_t *c, uint32_t lba, const void *buf, int cnt)
+{
+	const uint8_t *src = (const uint8_t *)buf;
+	int done = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	if (c->write_error)
+	{
+		c->write_error = false;
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+
+	while (cnt)
+	{
+		uint32_t block = lba / BLOCK_SECTORS;
+		int start = lba % BLOCK_SECTORS;
+		int n = std::min(cnt, BLOCK_SECTORS - start);
+
+		cache_block_t *b = find_block(c, block);
+		if (b && b->state == BLK_LOADING)
+		{
+			pthread_cond_wait(&cache_cond_ready, &cache_lock);
+			continue;
+		}
+
+		// no need to read the rest of the block, it gets merged if it's read later
+		if (!b)
+		{
+			if (!(b = wait_victim(c, block)))
+			{
+				if (!c->write_error) continue;
+				c->write_error = false;
+				done = 0;
+				break;
+			}
+			b->state = BLK_READY;
+		}
+
+		memcpy(b->data + start * 512, src, n * 512);
+
+		if (!c->dirty_blocks) clock_gettime(CLOCK_MONOTONIC, &c->first_dirty);
+		if (!b->dirty) c->dirty_blocks++;
+
+		uint64_t mask = sector_mask(start, n);
+		b->dirty |= mask;
+		b->valid |= mask;
+		b->last_use = ++use_tick;
+
+		src += n * 512;
+		done += n * 512;
+		lba += n;
+		cnt -= n;
+	}
+
+	if ((uint64_t)lba * 512 > c->size)
+	{
+		c->size = (uint64_t)lba * 512;
+		c->f->size = c->size;
+	}
+
+	c->stats.writes++;
+	clock_gettime(CLOCK_MONOTONIC, &c->last_write);
+	pthread_cond_signal(&cache_cond_work);
+
+	pthread_mutex_unlock(&cache_lock);
+	return done;
+}
+
+void ide_cache_print_stats(ide_cache_t *c)
+{
+	if (!c) return;
+
+	pthread_mutex_lock(&cache_lock);
+	uint32_t total = c->stats.hits + c->stats.misses;
+	printf("IDE cache: %u reads, %u%% hits, %u misses (avg %uus), %u prefetched, %u writes, %llu sectors written back in %u writes, %u errors.\n",
+		total, total ? c->stats.hits * 100 / total : 0, c->stats.misses,
+		c->stats.misses ? (uint32_t)(c->stats.miss_us / c->stats.misses) : 0, c->stats.prefetched,
+		c->stats.writes, (unsigned long long)c->stats.flushed, c->stats.flushes, c->stats.errors);
+	pthread_mutex_unlock(&cache_lock);
+}
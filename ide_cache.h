@@ -0,0 +1,32 @@
+#ifndef IDE_CACHE_H
+#define IDE_CACHE_H
+
+#include <inttypes.h>
+#include "file_io.h"
+
+// Write-back block cache for IDE hard disk images.
+// Writes go to RAM and are written to the image by a background thread shortly
+// after, sequential reads are prefetched. Size per drive is set by ide_cache_size
+// in MiSTer.ini (MB, 0 = disabled). All functions must be called from the main thread.
+
+struct ide_cache_t;
+struct ide_overlay_t;
+
+// Returns NULL if caching is disabled. With an overlay all I/O goes through it.
+ide_cache_t *ide_cache_open(fileTYPE *f, ide_overlay_t *overlay = NULL);
+
+// Writes all dirty blocks and frees the cache. Must be called before closing the file.
+void ide_cache_close(ide_cache_t *c);
+
+// lba is relative to the start of the image. Return the number of bytes read/written, 0 on error.
+// Sectors that failed to be written back stay dirty and the next call returns 0 once.
+int ide_cache_read(ide_cache_t *c, uint32_t lba, void *buf, int cnt);
+int ide_cache_write(ide_cache_t *c, uint32_t lba, const void *buf, int cnt);
+
+// Write all dirty blocks and wait for completion.
+void ide_cache_flush(ide_cache_t *c);
+void ide_cache_flush_all();
+
+void ide_cache_print_stats(ide_cache_t *c);
+
+#endif
@@ -298,13 +298,6 @@ static const char* load_chd_file(drive_t *drv, const char *chdfile)
 		return 0;
 	}
 
-	if (drv->chd_hunkbuf)
-	{
-		free(drv->chd_hunkbuf);
-	}
-
-	drv->chd_hunkbuf = (uint8_t *)malloc(tmpTOC.chd_hunksize);
-	drv->chd_hunknum = -1;
 	drv->chd_f = tmpTOC.chd_f;
 
 	//don't use add_track, just do it ourselves...
@@ -1075,7 +1068,7 @@ void cdrom_read(ide_config *ide)
 		for (uint32_t i = 0; i < cnt; i++)
 		{
 
-			if (mister_chd_read_sector(drive->chd_f, drive->chd_last_partial_lba + track->chd_offset, d_offset, hdr, 2048, ide_buf, drive->chd_hunkbuf, &drive->chd_hunknum) != CHDERR_NONE)
+			if (mister_chd_read_sector(drive->chd_f, drive->chd_last_partial_lba + track->chd_offset, d_offset, hdr, 2048, ide_buf) != CHDERR_NONE)
 			{
 				//I don't think anything else uses this, but set it just in case.
 				ide->null = 1;
@@ -1118,8 +1111,7 @@ int cdrom_read_raw_sector(drive_t *drive, uint32_t lba, uint8_t *buf)
 		if (sz == BYTES_PER_RAW_REDBOOK_FRAME)
 		{
 			if (mister_chd_read_sector(drive->chd_f, chd_lba, 0, 0,
-			                           BYTES_PER_RAW_REDBOOK_FRAME, buf,
-			                           drive->chd_hunkbuf, &drive->chd_hunknum)
+			                           BYTES_PER_RAW_REDBOOK_FRAME, buf)
 			    != CHDERR_NONE) return -1;
 			return 0;
 		}
@@ -1128,8 +1120,7 @@ int cdrom_read_raw_sector(drive_t *drive, uint32_t lba, uint8_t *buf)
 		{
 			memset(buf, 0, BYTES_PER_RAW_REDBOOK_FRAME);
 			if (mister_chd_read_sector(drive->chd_f, chd_lba, 16, 0,
-			                           2336, buf,
-			                           drive->chd_hunkbuf, &drive->chd_hunknum)
+			                           2336, buf)
 			    != CHDERR_NONE) return -1;
 			return 0;
 		}
@@ -1149,8 +1140,7 @@ int cdrom_read_raw_sector(drive_t *drive, uint32_t lba, uint8_t *buf)
 			buf[14] = (uint8_t)(((ff / 10) << 4) | (ff % 10));
 			buf[15] = 0x01;
 			if (mister_chd_read_sector(drive->chd_f, chd_lba, 16, 0,
-			                           BYTES_PER_COOKED_REDBOOK_FRAME, buf,
-			                           drive->chd_hunkbuf, &drive->chd_hunknum)
+			                           BYTES_PER_COOKED_REDBOOK_FRAME, buf)
 			    != CHDERR_NONE) return -1;
 			return 0;
 		}
@@ -1762,16 +1752,9 @@ void cdrom_close_chd(drive_t *drv)
 
 	if (drv->chd_f)
 	{
-		chd_close(drv->chd_f);
+		mister_chd_close(drv->chd_f);
 		drv->chd_f = NULL;
 	}
-
-	if (drv->chd_hunkbuf)
-	{
-		free(drv->chd_hunkbuf);
-		drv->chd_hunkbuf = NULL;
-	}
-	drv->chd_hunknum = -1;
 }
 
 const char* cdrom_parse(uint32_t num, const char *filename)
@@ -1913,7 +1896,7 @@ void ide_cdda_send_sector()
 	{
 		if (drv->chd_f)
 		{
-			mister_chd_read_sector(drv->chd_f, drv->play_start_lba + track->chd_offset, 0, 0, BYTES_PER_RAW_REDBOOK_FRAME, cdda_buf, drv->chd_hunkbuf, &drv->chd_hunknum);
+			mister_chd_read_sector(drv->chd_f, drv->play_start_lba + track->chd_offset, 0, 0, BYTES_PER_RAW_REDBOOK_FRAME, cdda_buf);
 			needs_swap = true;
 		}
 		else
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ide_overlay.h"
+#include "cfg.h"
+
+#define OVERLAY_MAGIC  "MiSTDIFF"
+#define BLOCK_SIZE     (32 * 1024)
+#define TABLE_START    512
+
+// Layout: header sector, table with one entry per image block (1-based slot
+// number in the data area, 0 = unchanged), then the changed blocks in the
+// order they were first written. Slots are allocated on demand so the file
+// only grows with the amount of changed data, also on exFAT which has no
+// sparse files.
+struct overlay_header_t
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t blocks;
+	uint32_t table_sectors;
+	uint64_t base_size;
+	int64_t  base_mtime;
+};
+
+struct ide_overlay_t
+{
+	pthread_mutex_t lock;
+	int       fd;
+	int       base_fd;
+	char      path[1024];
+	uint64_t  base_size;
+	uint32_t  blocks;
+	uint32_t  table_sectors;
+	uint32_t *table;
+	uint32_t  used;
+	uint64_t  data_start;
+	uint8_t   scratch[BLOCK_SIZE];
+};
+
+static bool read_table(ide_overlay_t *ov, const struct stat *st)
+{
+	overlay_header_t hdr = {};
+	if (pread(ov->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic)) ||
+		hdr.version != 1 || hdr.block_size != BLOCK_SIZE || hdr.blocks != ov->blocks)
+	{
+		printf("IDE overlay: %s is not valid.\n", ov->path);
+		return false;
+	}
+
+	if (hdr.base_size != (uint64_t)st->st_size || hdr.base_mtime != (int64_t)st->st_mtime)
+	{
+		printf("IDE overlay: image has been modified after %s was created.\n", ov->path);
+		return false;
+	}
+
+	uint32_t size = ov->table_sectors * 512;
+	if (pread(ov->fd, ov->table, size, TABLE_START) != (ssize_t)size)
+	{
+		printf("IDE overlay: cannot read the table of %s.\n", ov->path);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < ov->blocks; i++) if (ov->table[i] > ov->used) ov->used = ov->table[i];
+	return true;
+}
+
+static bool create_table(ide_overlay_t *ov, const struct stat *st)
+{
+	overlay_header_t hdr = {};
+	memcpy(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic));
+	hdr.version = 1;
+	hdr.block_size = BLOCK_SIZE;
+	hdr.blocks = ov->blocks;
+	hdr.table_sectors = ov->table_sectors;
+	hdr.base_size = st->st_size;
+	hdr.base_mtime = st->st_mtime;
+
+	uint8_t sector[512] = {};
+	memcpy(sector, &hdr, sizeof(hdr));
+
+	if (ftruncate(ov->fd, ov->data_start) || pwrite(ov->fd, sector, sizeof(sector), 0) != sizeof(sector))
+	{
+		printf("IDE overlay: cannot create %s.\n", ov->path);
+		return false;
+	}
+
+	return true;
+}
+
+ide_overlay_t *ide_overlay_open(fileTYPE *f)
+{
+	if (!f->filp || !f->path[0]) return nullptr;
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s.diff", getFullPath(f->path));
+
+	struct stat st;
+	bool exists = !stat(path, &st);
+	if (!exists && !cfg.ide_overlay) return nullptr;
+
+	int base_fd = fileno(f->filp);
+	if (fstat(base_fd, &st)) return nullptr;
+
+	ide_overlay_t *ov = new ide_overlay_t;
+	pthread_mutex_init(&ov->lock, nullptr);
+	strcpy(ov->path, path);
+	ov->base_fd = base_fd;
+	ov->base_size = st.st_size;
+	ov->blocks = (st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	ov->table_sectors = (ov->blocks * sizeof(uint32_t) + 511) / 512;
+	ov->table = (uint32_t *)calloc(ov->table_sectors, 512);
+	ov->used = 0;
+	ov->data_start = TABLE_START + ov->table_sectors * 512;
+
+	// written blocks must reach the card before the table entry pointing to them
+	ov->fd = open(path, O_RDWR | O_CREAT | O_SYNC | O_CLOEXEC, 0777);
+	bool ok = ov->fd >= 0 && ov->table;
+	if (ok && exists && !read_table(ov, &st))
+	{
+		// keep the old changes around, they may still be of use
+		char old[1040];
+		snprintf(old, sizeof(old), "%s.old", path);
+		rename(path, old);
+		printf("IDE overlay: moved to %s\n", old);
+
+		close(ov->fd);
+		ov->fd = cfg.ide_overlay ? open(path, O_RDWR | O_CREAT | O_SYNC | O_CLOEXEC, 0777) : -1;
+		ok = ov->fd >= 0;
+		exists = false;
+	}
+
+	if (ok && !exists) ok = create_table(ov, &st);
+
+	if (!ok)
+	{
+		if (ov->fd >= 0) close(ov->fd);
+		free(ov->table);
+		delete ov;
+		return nullptr;
+	}
+
+	fflush(f->filp);
+	printf("IDE overlay: %s, %u blocks changed.\n", path, ov->used);
+	return ov;
+}
+
+void ide_overlay_close(ide_overlay_t *ov)
+{
+	if (!ov) return;
+
+	close(ov->fd);
+	free(ov->table);
+	pthread_mutex_destroy(&ov->lock);
+	delete ov;
+}
+
+int ide_overlay_pread(ide_overlay_t *ov, void *buf, uint32_t len, uint64_t offset)
+{
+	uint8_t *dst = (uint8_t *)buf;
+	int done = 0;
+
+	pthread_mutex_lock(&ov->lock);
+	while (len && offset < ov->base_size)
+	{
+		uint32_t blk = offset / BLOCK_SIZE;
+		uint32_t pos = offset % BLOCK_SIZE;
+		uint32_t n = BLOCK_SIZE - pos;
+		if (n > len) n = len;
+		if (n > ov->base_size - offset) n = ov->base_size - offset;
+
+		ssize_t ret = ov->table[blk] ?
+			pread(ov->fd, dst, n, ov->data_start + (uint64_t)(ov->table[blk] - 1) * BLOCK_SIZE + pos) :
+			pread(ov->base_fd, dst, n, offset);
+
+		if (ret != (ssize_t)n)
+		{
+			if (!done) done = -1;
+			break;
+		}
+
+		dst += n;
+		done += n;
+		offset += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&ov->lock);
+
+	return done;
+}
+
+int ide_overlay_pwrite(ide_overlay_t *ov, const void *buf, uint32_t len, uint64_t offset)
+{
+	const uint8_t *src = (const uint8_t *)buf;
+	int done = 0;
+
+	// the overlay is fixed to the size of the image
+	pthread_mutex_lock(&ov->lock);
+	while (len && offset < ov->base_size)
+	{
+		uint32_t blk = offset / BLOCK_SIZE;
+		uint32_t pos = offset % BLOCK_SIZE;
+		uint32_t n = BLOCK_SIZE - pos;
+		if (n > len) n = len;
+		if (n > ov->base_size - offset) n = ov->base_size - offset;
+
+		if (ov->table[blk])
+		{
+			if (pwrite(ov->fd, src, n, ov->data_start + (uint64_t)(ov->table[blk] - 1) * BLOCK_SIZE + pos) != (ssize_t)n) break;
+		}
+		else
+		{
+			// copy the whole block from the image on first write
+			if (n < BLOCK_SIZE)
+			{
+				ssize_t ret = pread(ov->base_fd, ov->scratch, BLOCK_SIZE, (uint64_t)blk * BLOCK_SIZE);
+				if (ret < 0) break;
+				memset(ov->scratch + ret, 0, BLOCK_SIZE - ret);
+			}
+			memcpy(ov->scratch + pos, src, n);
+
+			uint32_t slot = ov->used + 1;
+			if (pwrite(ov->fd, ov->scratch, BLOCK_SIZE, ov->data_start + (uint64_t)(slot - 1) * BLOCK_SIZE) != BLOCK_SIZE) break;
+
+			ov->table[blk] = slot;
+			uint32_t sector = blk / 128;
+			if (pwrite(ov->fd, ov->table + sector * 128, 512, TABLE_START + sector * 512) != 512)
+			{
+				ov->table[blk] = 0;
+				break;
+			}
+			ov->used = slot;
+		}
+
+		src += n;
+		done += n;
+		offset += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&ov->lock);
+
+	if (len && !done)
+	{
+		printf("IDE overlay: write error at %llu.\n", (unsigned long long)offset);
+		done = -1;
+	}
+	return done;
+}
+
+uint32_t ide_overlay_changed(ide_overlay_t *ov)
+{
+	return ov ? ov->used : 0;
+}
+
+// point the overlay at the image as it is now, so it can be attached again
+static bool update_header(ide_overlay_t *ov)
+{
+	struct stat st;
+	overlay_header_t hdr = {};
+	if (fstat(ov->base_fd, &st) || pread(ov->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) return false;
+
+	hdr.base_size = st.st_size;
+	hdr.base_mtime = st.st_mtime;
+	return pwrite(ov->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+}
+
+int ide_overlay_commit(ide_overlay_t *ov, ide_overlay_progress_t progress)
+{
+	uint32_t errors = 0, done = 0;
+
+	// nothing is touched if the image can't be written at all
+	int flags = fcntl(ov->base_fd, F_GETFL);
+	if (flags < 0 || (flags & O_ACCMODE) == O_RDONLY)
+	{
+		printf("IDE overlay: image is read-only, keeping %s.\n", ov->path);
+		ide_overlay_close(ov);
+		return 0;
+	}
+
+	pthread_mutex_lock(&ov->lock);
+	for (uint32_t blk = 0; blk < ov->blocks; blk++)
+	{
+		if (!ov->table[blk]) continue;
+
+		uint64_t offset = (uint64_t)blk * BLOCK_SIZE;
+		uint32_t n = (ov->base_size - offset < BLOCK_SIZE) ? (uint32_t)(ov->base_size - offset) : BLOCK_SIZE;
+
+		if (pread(ov->fd, ov->scratch, n, ov->data_start + (uint64_t)(ov->table[blk] - 1) * BLOCK_SIZE) != (ssize_t)n ||
+			pwrite(ov->base_fd, ov->scratch, n, offset) != (ssize_t)n)
+		{
+			errors++;
+		}
+
+		if (progress && !(++done % 16))
+		{
+			pthread_mutex_unlock(&ov->lock);
+			progress(done, ov->used);
+			pthread_mutex_lock(&ov->lock);
+		}
+	}
+	pthread_mutex_unlock(&ov->lock);
+
+	fdatasync(ov->base_fd);
+
+	if (errors)
+	{
+		// the overlay still holds every change, the image is partly updated
+		printf("IDE overlay: %u blocks could not be written to the image, keeping %s.\n", errors, ov->path);
+		if (!update_header(ov)) printf("IDE overlay: cannot update %s.\n", ov->path);
+		ide_overlay_close(ov);
+		return 0;
+	}
+
+	printf("IDE overlay: %u blocks written to the image.\n", ov->used);
+	ide_overlay_discard(ov);
+	return 1;
+}
+
+void ide_overlay_discard(ide_overlay_t *ov)
+{
+	unlink(ov->path);
+	ide_overlay_close(ov);
+}
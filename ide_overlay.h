@@ -0,0 +1,33 @@
+#ifndef IDE_OVERLAY_H
+#define IDE_OVERLAY_H
+
+#include <inttypes.h>
+#include "file_io.h"
+
+// Copy-on-write overlay (differencing disk) for IDE hard disk images.
+// Changed blocks are stored in <image>.diff next to the image, the image itself
+// is only written on commit. The overlay is created for writable images if
+// ide_overlay=1 in MiSTer.ini. An existing overlay is always used.
+
+struct ide_overlay_t;
+
+// Returns NULL if the image has no overlay and none should be created.
+ide_overlay_t *ide_overlay_open(fileTYPE *f);
+void ide_overlay_close(ide_overlay_t *ov);
+
+// Same semantics as pread/pwrite on the image, offset and length are multiples of 512.
+// Safe to call from any thread.
+int ide_overlay_pread(ide_overlay_t *ov, void *buf, uint32_t len, uint64_t offset);
+int ide_overlay_pwrite(ide_overlay_t *ov, const void *buf, uint32_t len, uint64_t offset);
+
+// Number of changed blocks.
+uint32_t ide_overlay_changed(ide_overlay_t *ov);
+
+// Write the changes to the image or drop them. Both free ov. The overlay file is deleted
+// unless the commit fails, then it stays valid for the partly written image.
+// progress is called every few blocks, ov must not be used by anybody else meanwhile.
+typedef void (*ide_overlay_progress_t)(uint32_t done, uint32_t total);
+int ide_overlay_commit(ide_overlay_t *ov, ide_overlay_progress_t progress = 0);
+void ide_overlay_discard(ide_overlay_t *ov);
+
+#endif
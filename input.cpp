@@ -17,6 +17,9 @@
 #include <time.h>
 #include <stdarg.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
 
 #include "input.h"
 #include "autofire.h"
@@ -36,6 +39,7 @@
 #include "frame_timer.h"
 #include "scaler.h"
 #include "file_io.h"
+#include "spi.h"
 
 #define NUMDEV 30
 #define UINPUT_NAME "MiSTer virtual input"
@@ -2026,6 +2030,7 @@ static int mouse_y = 0;
 static int mouse_w = 0;
 static int mouse_emu = 0;
 static int kbd_mouse_emu = 0;
+static bool fast_stale = false; // buttons handled by the input thread have to be looked up again
 static int mouse_sniper = 0;
 static int mouse_emu_x = 0;
 static int mouse_emu_y = 0;
@@ -2246,6 +2251,7 @@ static bool handle_autofire_toggle(int num, uint32_t mask, uint32_t code, char p
 		{
 			char *strat = str;
 			inc_autofire_code(num, lastcode[num], lastmask[num]);
+			fast_stale = true;
 
 			// display autofire status for each button in the mask
 			FOR_EACH_SET_BIT(lastmask[num], btn) {
@@ -2394,6 +2400,7 @@ static void joy_digital(int jnum, uint32_t mask, uint32_t code, char press, int
 				mouse_btn_req();
 
 				mouse_emu ^= 2;
+				fast_stale = true;
 				if (hasAPI1_5()) Info((mouse_emu & 2) ? "Mouse mode ON" : "Mouse mode OFF");
 				else InfoMessage((mouse_emu & 2) ? "\n\n       Mouse mode lock\n             ON" :
 					"\n\n       Mouse mode lock\n             OFF");
@@ -3761,6 +3768,7 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 					if (ev->code == input[dev].mmap[SYS_MS_BTN_EMU] && (ev->value <= 1) && ((!(mouse_emu & 1)) ^ (!ev->value)))
 					{
 						mouse_emu = ev->value ? mouse_emu | 1 : mouse_emu & ~1;
+						fast_stale = true;
 						if (input[sub_dev].quirk == QUIRK_DS4) input[dev].ds_mouse_emu = mouse_emu & 1;
 						if (mouse_emu & 2)
 						{
@@ -5111,6 +5119,344 @@ static void setup_wheels()
 	}
 }
 
+// End-to-end input latency: kernel timestamp of the event being processed
+// until its state is sent to the core. Devices are switched to the monotonic
+// clock on open, the realtime clock is kept if that isn't supported.
+#define LATENCY_FILE    "/tmp/INPUT_LATENCY"
+#define LATENCY_BUCKETS 10 // 0.25ms, doubling, last one is everything above 64ms
+
+static struct
+{
+	uint32_t hist[LATENCY_BUCKETS];
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t total_us;
+
+	uint32_t reads;
+	uint32_t events;
+	uint32_t coalesced;
+
+	uint32_t reported;
+	unsigned long timer;
+} latency = {};
+
+// event being processed by this thread
+static __thread struct timeval lat_ev_time;
+static __thread clockid_t lat_ev_clock;
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static clockid_t ev_clock[NUMDEV];
+
+// Optional input thread (input_thread=1). While the OSD is hidden it reads the
+// event devices, sends the buttons of mapped gamepads to the core right away
+// and passes every event on to the main loop through ev_ring. The main loop
+// does everything else as before: keyboards, mice, sticks, OSD and autofire
+// buttons, hotplug, MiSTer_cmd and the LED monitor.
+static bool input_thread_on = false;
+static std::atomic<bool> thread_allowed(false); // main loop lends the devices
+static std::atomic<bool> thread_owns(false);    // thread reads them
+static bool devs_lent = false;
+
+// one producer (thread) and one consumer (main loop) per device
+#define EV_RING 256
+static struct
+{
+	struct input_event ev[EV_RING];
+	std::atomic<uint32_t> head, tail;
+} ev_ring[NUMDEV];
+
+// type of an event whose buttons were sent by the thread already
+#define EV_FAST EV_CNT
+
+// Gamepad buttons the thread handles on its own. The main loop fills it in and
+// doesn't change it while ok is set, held belongs to whoever has the devices.
+#define FAST_CODES 64
+static struct
+{
+	std::atomic<bool> ok;
+	int player;
+	int cnt;
+	uint16_t code[FAST_CODES];
+	uint32_t mask[FAST_CODES];
+	uint64_t held;
+} fast_dev[NUMDEV];
+
+// both threads send the joystick state, each with its own part of the buttons
+static pthread_mutex_t joy_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t joy_main[NUMPLAYERS], joy_fast[NUMPLAYERS], joy_sent[NUMPLAYERS];
+
+static void joy_push(int player)
+{
+	uint32_t mask = joy_main[player] | joy_fast[player];
+	if (mask == joy_sent[player]) return;
+
+	int newdir = (mask & 0xF) | (joy_sent[player] & 0xF);
+	joy_sent[player] = mask;
+	user_io_digital_joystick(player, mask, newdir);
+}
+
+static bool fast_code_ok(int dev, int player, uint16_t code)
+{
+	if (code < 256 || is_autofire_enabled(player, code)) return false;
+	if (code == input[dev].mmap[SYS_BTN_OSD_KTGL + 1] || code == input[dev].mmap[SYS_BTN_OSD_KTGL + 2]) return false;
+	if (code == input[dev].mmap[SYS_MS_BTN_EMU]) return false;
+
+	if (mouse_emu)
+	{
+		for (int i = SYS_MS_RIGHT; i <= SYS_MS_BTN_M; i++) if (code == input[dev].mmap[i]) return false;
+	}
+
+	for (int i = 0; i < ADVANCED_MAP_MAX && input[dev].advanced_map[i].input_codes[0]; i++)
+	{
+		for (int n = 0; n < 4; n++) if (code == input[dev].advanced_map[i].input_codes[n]) return false;
+	}
+
+	return true;
+}
+
+static void fast_map_update(int i)
+{
+	if (fast_dev[i].ok.load(std::memory_order_relaxed)) return;
+
+	int dev = i;
+	if (!JOYCON_COMBINED(i) && input[dev].bind >= 0) dev = input[dev].bind;
+
+	// plain gamepads with a known map and player only
+	if (input[i].quirk != QUIRK_NONE || input[dev].quirk != QUIRK_NONE || input[dev].force_joy || input[dev].lightgun_req) return;
+	if (!input[dev].has_mmap || input[dev].has_map != 1 || !input[dev].has_advanced_map) return;
+	if (input[dev].num < 1 || input[dev].num > NUMPLAYERS) return;
+
+	int player = input[dev].num - 1;
+	int cnt = 0;
+	for (uint n = 0; n < BTN_NUM; n++)
+	{
+		uint16_t codes[2] = { (uint16_t)input[dev].map[n], (uint16_t)(input[dev].map[n] >> 16) };
+		for (int c = 0; c < 2; c++)
+		{
+			if (!fast_code_ok(dev, player, codes[c])) continue;
+
+			int k = 0;
+			while (k < cnt && fast_dev[i].code[k] != codes[c]) k++;
+			if (k == cnt)
+			{
+				if (cnt == FAST_CODES) continue;
+				fast_dev[i].code[k] = codes[c];
+				fast_dev[i].mask[k] = 0;
+				cnt++;
+			}
+			fast_dev[i].mask[k] |= 1 << n;
+		}
+	}
+
+	fast_dev[i].player = player;
+	fast_dev[i].cnt = cnt;
+	fast_dev[i].held = 0;
+	fast_dev[i].ok.store(true, std::memory_order_release);
+}
+
+// input thread
+static bool fast_event(int i, struct input_event *ev)
+{
+	if (ev->type != EV_KEY || ev->value > 1 || !fast_dev[i].ok.load(std::memory_order_acquire)) return false;
+
+	for (int k = 0; k < fast_dev[i].cnt; k++)
+	{
+		if (fast_dev[i].code[k] != ev->code) continue;
+
+		if (ev->value) fast_dev[i].held |= 1ull << k;
+		else fast_dev[i].held &= ~(1ull << k);
+
+		int player = fast_dev[i].player;
+		uint32_t mask = 0;
+		for (int d = 0; d < NUMDEV; d++)
+		{
+			if (!fast_dev[d].ok.load(std::memory_order_acquire) || fast_dev[d].player != player) continue;
+			for (int n = 0; n < fast_dev[d].cnt; n++) if (fast_dev[d].held & (1ull << n)) mask |= fast_dev[d].mask[n];
+		}
+
+		pthread_mutex_lock(&joy_lock);
+		joy_fast[player] = mask;
+		joy_push(player);
+		pthread_mutex_unlock(&joy_lock);
+		return true;
+	}
+
+	return false;
+}
+
+// The thread sent this one already, only the bookkeeping is left.
+static void fast_done(int i, struct input_event *ev)
+{
+	lat_ev_time.tv_sec = 0;
+
+	int dev = i;
+	if (!JOYCON_COMBINED(i) && input[dev].bind >= 0) dev = input[dev].bind;
+	if (input[dev].timeout > 0) input[dev].timeout = cfg.bt_auto_disconnect * 10;
+
+	for (int k = 0; k < fast_dev[i].cnt; k++)
+	{
+		if (fast_dev[i].code[k] != ev->code) continue;
+
+		int player = fast_dev[i].player;
+		uint32_t mask = fast_dev[i].mask[k];
+		handle_autofire_toggle(player, mask, ev->code, ev->value, __builtin_ctz(mask), 0);
+
+		// could have been pressed while the main loop had the devices
+		if (!ev->value) set_key_state(player, ev->code, false, mask);
+		break;
+	}
+}
+
+// Buttons still held on the thread's side go to key_states, the lookups are
+// built again once the devices are lent next time.
+static void fast_takeover()
+{
+	pthread_mutex_lock(&joy_lock);
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (!fast_dev[i].ok.load(std::memory_order_relaxed)) continue;
+
+		for (int k = 0; k < fast_dev[i].cnt; k++)
+		{
+			if (fast_dev[i].held & (1ull << k)) set_key_state(fast_dev[i].player, fast_dev[i].code[k], true, fast_dev[i].mask[k]);
+		}
+		fast_dev[i].ok.store(false, std::memory_order_relaxed);
+	}
+	memset(joy_fast, 0, sizeof(joy_fast));
+	pthread_mutex_unlock(&joy_lock);
+
+	fast_stale = false;
+}
+
+static bool ev_ring_pending(int i)
+{
+	return ev_ring[i].head.load(std::memory_order_acquire) != ev_ring[i].tail.load(std::memory_order_relaxed);
+}
+
+static int ev_ring_get(int i, struct input_event *ev, int max)
+{
+	uint32_t tail = ev_ring[i].tail.load(std::memory_order_relaxed);
+	uint32_t cnt = ev_ring[i].head.load(std::memory_order_acquire) - tail;
+	if (cnt > (uint32_t)max) cnt = max;
+
+	for (uint32_t n = 0; n < cnt; n++) ev[n] = ev_ring[i].ev[(tail + n) % EV_RING];
+	ev_ring[i].tail.store(tail + cnt, std::memory_order_release);
+	return cnt;
+}
+
+// Takes the event devices back from the thread. Returns false while it still
+// reads them or, unless discard is set, while its events wait in ev_ring.
+static bool input_thread_reclaim(bool discard)
+{
+	if (!devs_lent) return true;
+
+	thread_allowed.store(false, std::memory_order_release);
+	if (thread_owns.load(std::memory_order_acquire)) return false;
+
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (!discard && ev_ring_pending(i)) return false;
+		ev_ring[i].tail.store(ev_ring[i].head.load(std::memory_order_acquire), std::memory_order_relaxed);
+	}
+
+	fast_takeover();
+	devs_lent = false;
+	return true;
+}
+
+// Returns true while events of the devices come through ev_ring.
+static bool input_thread_lend(bool allow)
+{
+	if (!input_thread_on) return false;
+
+	if (allow)
+	{
+		devs_lent = true;
+		thread_allowed.store(true, std::memory_order_release);
+		return true;
+	}
+
+	return !input_thread_reclaim(false);
+}
+
+void input_latency_mark()
+{
+	if (!lat_ev_time.tv_sec) return;
+
+	struct timespec now;
+	clock_gettime(lat_ev_clock, &now);
+	int64_t us = (int64_t)(now.tv_sec - lat_ev_time.tv_sec) * 1000000 + (now.tv_nsec / 1000 - lat_ev_time.tv_usec);
+	lat_ev_time.tv_sec = 0;
+	if (us < 0) return;
+
+	int bucket = 0;
+	for (int64_t limit = 250; bucket < LATENCY_BUCKETS - 1 && us >= limit; limit *= 2) bucket++;
+
+	pthread_mutex_lock(&latency_lock);
+	latency.hist[bucket]++;
+	latency.count++;
+	latency.total_us += us;
+	if (us > latency.max_us) latency.max_us = us;
+	pthread_mutex_unlock(&latency_lock);
+}
+
+static void latency_count_read(int events, int coalesced)
+{
+	pthread_mutex_lock(&latency_lock);
+	latency.reads++;
+	latency.events += events;
+	latency.coalesced += coalesced;
+	pthread_mutex_unlock(&latency_lock);
+}
+
+static void latency_report()
+{
+	if (latency.timer && !CheckTimer(latency.timer)) return;
+	latency.timer = GetTimer(5000);
+
+	// the input thread updates the counters too
+	pthread_mutex_lock(&latency_lock);
+	decltype(latency) lat = latency;
+	latency.reported = latency.count;
+	pthread_mutex_unlock(&latency_lock);
+	if (lat.reported == lat.count) return;
+
+	FILE *f = fopen(LATENCY_FILE, "w");
+	if (!f) return;
+
+	fprintf(f, "samples %u, avg %lluus, max %uus\n", lat.count, (unsigned long long)(lat.total_us / lat.count), lat.max_us);
+	fprintf(f, "reads %u, events %u, axis events coalesced %u\n", lat.reads, lat.events, lat.coalesced);
+	for (int i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		if (i < LATENCY_BUCKETS - 1) fprintf(f, "<%6.2fms: %u\n", (250 << i) / 1000.f, lat.hist[i]);
+		else fprintf(f, ">=%5.2fms: %u\n", (250 << (i - 1)) / 1000.f, lat.hist[i]);
+	}
+	fclose(f);
+}
+
+// Only the last value of an axis in a frame matters. Older frames are kept,
+// axes may be mapped to buttons and a short tap must not get lost. Hats and
+// multitouch are left alone since they are turned into buttons or depend on order.
+static int coalesce_axes(struct input_event *ev, int cnt)
+{
+	int coalesced = 0;
+	uint32_t seen = 0;
+	for (int i = cnt - 1; i >= 0; i--)
+	{
+		if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT) seen = 0;
+		if (ev[i].type != EV_ABS || ev[i].code >= ABS_HAT0X) continue;
+
+		uint32_t bit = 1 << ev[i].code;
+		if (seen & bit)
+		{
+			ev[i].type = EV_SYN;
+			coalesced++;
+		}
+		seen |= bit;
+	}
+	return coalesced;
+}
+
 int input_test(int getchar)
 {
 	PROFILE_FUNCTION();
@@ -5118,8 +5464,12 @@ int input_test(int getchar)
 	static int state = 0;
 	struct input_absinfo absinfo;
 	struct input_event ev;
+	// events read but not handled yet, getchar mode may return in the middle of a batch
+	static struct input_event ev_buf[NUMDEV][64];
+	static int ev_pos[NUMDEV], ev_num[NUMDEV];
 	static uint32_t timeout = 0;
 	static int stick_debug = 0;
+	static int devs_changed = 0;
 
 	if (touch_rel && CheckTimer(touch_rel))
 	{
@@ -5151,12 +5501,16 @@ int input_test(int getchar)
 
 	if (state == 1)
 	{
+		// the input thread has to let go of the devices first
+		if (!input_thread_reclaim(true)) return 0;
+
 		timeout = 0;
 		printf("Open up to %d input devices.\n", NUMDEV);
 		for (int i = 0; i < NUMDEV; i++)
 		{
 			pool[i].fd = -1;
 			pool[i].events = 0;
+			ev_pos[i] = ev_num[i] = 0;
 		}
 
 		// clear button reference counts and key states
@@ -5190,6 +5544,9 @@ int input_test(int getchar)
 						char uniq[32] = {};
 						if (!input[n].mouse)
 						{
+							int clk = CLOCK_MONOTONIC;
+							ev_clock[n] = ioctl(pool[n].fd, EVIOCSCLOCKID, &clk) ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+
 							struct input_id id;
 							memset(&id, 0, sizeof(id));
 							ioctl(pool[n].fd, EVIOCGID, &id);
@@ -5614,8 +5971,27 @@ int input_test(int getchar)
 			}
 
 
-			int return_value = poll(pool, NUMDEV + 3, timeout);
-			if (!return_value) break;
+			latency_report();
+
+			// event devices are read by the input thread while the core has the input
+			int lent = input_thread_lend(!getchar && !devs_changed && !fast_stale && grabbed && !mapping &&
+				!user_io_osd_is_visible() && !video_fb_state() && !is_menu());
+
+			int pending = 0;
+			for (int i = 0; i < NUMDEV; i++) if (ev_pos[i] < ev_num[i] || (lent && ev_ring_pending(i))) pending = 1;
+
+			struct pollfd *pfd = pool;
+			static struct pollfd lent_pool[NUMDEV + 3];
+			if (lent)
+			{
+				memcpy(lent_pool, pool, sizeof(lent_pool));
+				for (int i = 0; i < NUMDEV; i++) if (!input[i].mouse) lent_pool[i].fd = -1;
+				pfd = lent_pool;
+			}
+
+			int return_value = poll(pfd, NUMDEV + 3, pending ? 0 : timeout);
+			if (lent) for (int i = 0; i < NUMDEV + 3; i++) pool[i].revents = lent_pool[i].revents;
+			if (!return_value && !pending) break;
 
 			if (return_value < 0)
 			{
@@ -5623,8 +5999,10 @@ int input_test(int getchar)
 				break;
 			}
 
-			if ((pool[NUMDEV].revents & POLLIN) && check_devs())
+			if ((pool[NUMDEV].revents & POLLIN) && check_devs()) devs_changed = 1;
+			if (devs_changed && input_thread_reclaim(true))
 			{
+				devs_changed = 0;
 				printf("Close all devices.\n");
 				for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
 				{
@@ -5639,13 +6017,35 @@ int input_test(int getchar)
 			{
 				int i = pos;
 
-				if ((pool[i].fd >= 0) && (pool[i].revents & POLLIN))
+				if ((pool[i].fd >= 0) && ((pool[i].revents & POLLIN) || ev_pos[i] < ev_num[i] || (lent && ev_ring_pending(i))))
 				{
 					if (!input[i].mouse)
 					{
-						memset(&ev, 0, sizeof(ev));
-						if (read(pool[i].fd, &ev, sizeof(ev)) == sizeof(ev))
+						if (ev_pos[i] >= ev_num[i])
+						{
+							int ev_cnt;
+							if (lent)
+							{
+								fast_map_update(i);
+								ev_cnt = ev_ring_get(i, ev_buf[i], sizeof(ev_buf[i]) / sizeof(ev));
+							}
+							else
+							{
+								ev_cnt = read(pool[i].fd, ev_buf[i], sizeof(ev_buf[i]));
+								ev_cnt = (ev_cnt > 0) ? ev_cnt / sizeof(ev) : 0;
+								if (ev_cnt) latency_count_read(ev_cnt, getchar ? 0 : coalesce_axes(ev_buf[i], ev_cnt));
+							}
+
+							ev_pos[i] = 0;
+							ev_num[i] = ev_cnt;
+						}
+
+						while (ev_pos[i] < ev_num[i])
 						{
+							ev = ev_buf[i][ev_pos[i]++];
+							lat_ev_time = ev.time;
+							lat_ev_clock = ev_clock[i];
+
 							if (getchar)
 							{
 								if (ev.type == EV_KEY && ev.value >= 1)
@@ -5653,6 +6053,10 @@ int input_test(int getchar)
 									return ev.code;
 								}
 							}
+							else if (ev.type == EV_FAST)
+							{
+								fast_done(i, &ev);
+							}
 							else if (ev.type)
 							{
 								int dev = i;
@@ -6137,6 +6541,7 @@ int input_test(int getchar)
 								}
 							}
 						}
+						lat_ev_time.tv_sec = 0;
 					}
 					else
 					{
@@ -6258,6 +6663,7 @@ int input_test(int getchar)
 						}
 						request_screenshot(p, scaled);
 					}
+					else if (!strncmp(cmd, "trace ", 6)) trace_cmd(cmd + 6);
 					else if (!strncmp(cmd, "volume ", 7))
 					{
 						if (!strcmp(cmd + 7, "mute")) set_volume(0x81);
@@ -6327,7 +6733,6 @@ int input_poll(int getchar)
 
 	static bool autofire_cfg_parsed = false;
  	if (!autofire_cfg_parsed) autofire_cfg_parsed = parse_autofire_cfg();
-	static uint32_t joy_mask_prev[NUMPLAYERS] = {};
 
 	add_frame_callback(key_update_frames_held_cb);
 
@@ -6372,16 +6777,13 @@ int input_poll(int getchar)
 		autofire_mask[i] = build_autofire_mask(i);
 	}
 
+	pthread_mutex_lock(&joy_lock);
 	if (grabbed)
 	{
 		for (int i = 0; i < NUMPLAYERS; i++) {
 			joy_mask[i] = joy_mask[i] | autofire_mask[i];
-			int newdir = (joy_mask[i] & 0xF) | (joy_mask_prev[i] & 0xF);
-			if (joy_mask[i] != joy_mask_prev[i])
-			{
-				joy_mask_prev[i] = joy_mask[i];
-				user_io_digital_joystick(i, joy_mask[i], newdir);
-			}
+			joy_main[i] = joy_mask[i];
+			joy_push(i);
 		}
 	}
 
@@ -6393,6 +6795,7 @@ int input_poll(int getchar)
 		}
 		memset(key_states, 0, sizeof(key_states));
 	}
+	pthread_mutex_unlock(&joy_lock);
 
 	if (mouse_req)
 	{
@@ -6440,6 +6843,94 @@ int is_key_pressed(int key)
 	return 0;
 }
 
+static void *input_thread(void *)
+{
+	static struct input_event ev[64];
+	struct pollfd fds[NUMDEV];
+	bool owned = false;
+
+	while (1)
+	{
+		bool allowed = thread_allowed.load(std::memory_order_acquire);
+		if (allowed != owned)
+		{
+			owned = allowed;
+			for (int i = 0; i < NUMDEV; i++)
+			{
+				// mice stay with the main loop
+				fds[i].fd = (pool[i].fd >= 0 && !input[i].mouse) ? pool[i].fd : -1;
+				fds[i].events = POLLIN;
+			}
+			thread_owns.store(owned, std::memory_order_release);
+		}
+
+		if (!owned)
+		{
+			usleep(2000);
+			continue;
+		}
+
+		if (poll(fds, NUMDEV, 2) <= 0) continue;
+
+		for (int i = 0; i < NUMDEV; i++)
+		{
+			// unplugged, the main loop will notice
+			if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) fds[i].fd = -1;
+			if (!(fds[i].revents & POLLIN)) continue;
+
+			int cnt = read(fds[i].fd, ev, sizeof(ev));
+			cnt = (cnt > 0) ? cnt / sizeof(ev[0]) : 0;
+			if (!cnt) continue;
+			latency_count_read(cnt, coalesce_axes(ev, cnt));
+
+			for (int n = 0; n < cnt; n++)
+			{
+				if (!ev[n].type) continue;
+
+				lat_ev_time = ev[n].time;
+				lat_ev_clock = ev_clock[i];
+				if (fast_event(i, &ev[n])) ev[n].type = EV_FAST;
+				lat_ev_time.tv_sec = 0;
+
+				// if the main loop is stuck the events are dropped, like the kernel would
+				uint32_t head = ev_ring[i].head.load(std::memory_order_relaxed);
+				if (head - ev_ring[i].tail.load(std::memory_order_acquire) >= EV_RING) continue;
+				ev_ring[i].ev[head % EV_RING] = ev[n];
+				ev_ring[i].head.store(head + 1, std::memory_order_release);
+			}
+		}
+	}
+	return NULL;
+}
+
+void input_thread_start()
+{
+	if (input_thread_on || !cfg.input_thread) return;
+
+	// the rest of the program still talks to the FPGA from the main thread
+	spi_set_shared();
+	input_thread_on = true;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, input_thread, NULL))
+	{
+		printf("Cannot start the input thread.\n");
+		input_thread_on = false;
+		return;
+	}
+
+	// Run on core #0 next to the background workers, main runs on core #1
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_setaffinity_np(thread, sizeof(set), &set);
+
+	struct sched_param param = {};
+	param.sched_priority = 50;
+	if (pthread_setschedparam(thread, SCHED_FIFO, &param)) printf("Input thread: cannot set real-time priority.\n");
+	else printf("Input thread started.\n");
+}
+
 void input_notify_mode()
 {
 	//reset mouse parameters on any mode switch
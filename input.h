@@ -100,6 +100,13 @@ void sysled_enable(int en);
 
 void input_notify_mode();
 int input_poll(int getchar);
+
+// called when input state is sent to the core, for the latency histogram
+void input_latency_mark();
+
+// separate input thread if enabled in MiSTer.ini, sends gamepad buttons while the OSD is hidden.
+// input_poll() still has to be called, it gets the events from the thread.
+void input_thread_start();
 int is_key_pressed(int key);
 
 void start_map_setting(int cnt, int set = 0, advancedButtonMap *code_store = NULL);
@@ -35,6 +35,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "osd.h"
 #include "offload.h"
 
+#ifdef MISTER_SIM
+#include "sim/sim.h"
+#endif
+
 const char *version = "$VER:" VDATE;
 
 int main(int argc, char *argv[])
@@ -69,6 +73,17 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
+#ifdef MISTER_SIM
+	if (argc > 1 && !strcmp(argv[1], "--bench"))
+	{
+		FindStorage();
+		user_io_init("", NULL);
+		int ret = sim_bench(argc - 1, argv + 1);
+		offload_stop();
+		return ret;
+	}
+#endif
+
 	FindStorage();
 	user_io_init((argc > 1) ? argv[1] : "",(argc > 2) ? argv[2] : NULL);
 
@@ -86,6 +101,7 @@ int main(int argc, char *argv[])
 		user_io_poll();
 		frame_timer();
 		input_poll(0);
+		offload_poll();
 		HandleUI();
 		OsdUpdate();
 	}
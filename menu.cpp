@@ -65,6 +65,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "support.h"
 #include "bootcore.h"
 #include "ide.h"
+#include "scheduler.h"
 #include "profiling.h"
 #include "str_util.h"
 #include "autofire.h"
@@ -99,6 +100,8 @@ enum MENU
 	MENU_ABOUT2,
 	MENU_RESET1,
 	MENU_RESET2,
+	MENU_DISCARD1,
+	MENU_DISCARD2,
 	MENU_UNLOCK1,
 	MENU_UNLOCK2,
 	MENU_UNLOCK3,
@@ -1097,6 +1100,21 @@ void build_advanced_map_summary(advancedButtonMap *abm, char *dest_str, size_t d
 	snprintf(dest_str, dest_size, "%s->%s", input_str, output_str);
 }
 
+// keeps the OSD and the other tasks alive while a big overlay is written
+static void overlay_commit_progress(uint32_t done, uint32_t total)
+{
+	char str[40];
+	sprintf(str, "     Writing changes %3u%%", total ? done * 100 / total : 100);
+
+	OsdSetTitle("System", 0);
+	for (int i = 0; i < OsdGetSize(); i++) OsdWrite(i, (i == 2) ? str : "", 0, 0);
+	OsdUpdate();
+
+#ifdef USE_SCHEDULER
+	scheduler_yield();
+#endif
+}
+
 static void *close_pipe_async(void *arg)
 {
 	pclose((FILE *)arg);
@@ -2926,6 +2944,14 @@ void HandleUI(void)
 					MenuWrite(n++, s, menusub == 10, !audio_filter_en() || !S_ISDIR(getFileType(AFILTER_DIR)));
 				}
 
+				if (ide_overlay_changes())
+				{
+					menumask |= 0x1800;
+					MenuWrite(n++);
+					MenuWrite(n++, " Write disk changes to image", menusub == 11);
+					MenuWrite(n++, " Discard disk changes", menusub == 12);
+				}
+
 				if (!is_minimig() && !is_st())
 				{
 					menumask |= 0x6000;
@@ -3052,6 +3078,16 @@ void HandleUI(void)
 				}
 				break;
 
+			case 11:
+				ide_overlay_apply(1, overlay_commit_progress);
+				menustate = MENU_COMMON1;
+				break;
+
+			case 12:
+				menustate = MENU_DISCARD1;
+				menusub = 1;
+				break;
+
 			case 13:
 				if (!is_archie())
 				{
@@ -5836,6 +5872,50 @@ void HandleUI(void)
 		}
 		break;
 
+		/******************************************************************/
+		/* discard disk changes menu                                      */
+		/******************************************************************/
+	case MENU_DISCARD1:
+		helptext_idx = 0;
+		OsdSetTitle("Discard", 0);
+		menumask = 0x03;	// Yes / No
+		parentstate = menustate;
+
+		OsdWrite(0, "", 0, 0);
+		OsdWrite(1, "    Discard disk changes?", 0, 0);
+		OsdWrite(2, "   The core will be reset.", 0, 0);
+		OsdWrite(3, "", 0, 0);
+		OsdWrite(4, "             yes", menusub == 0, 0);
+		OsdWrite(5, "             no", menusub == 1, 0);
+		for (int i = 6; i < OsdGetSize(); i++) OsdWrite(i, "", 0, 0);
+
+		menustate = MENU_DISCARD2;
+		break;
+
+	case MENU_DISCARD2:
+		if (select && menusub == 0)
+		{
+			// the guest must not keep using what it has read from the dropped changes
+			ide_overlay_apply(0);
+			if (is_minimig())
+			{
+				minimig_reset();
+			}
+			else
+			{
+				user_io_status_set("[0]", 1);
+				user_io_status_set("[0]", 0);
+			}
+			menustate = MENU_NONE1;
+		}
+
+		if (menu || (select && (menusub == 1))) // exit menu
+		{
+			menustate = MENU_COMMON1;
+			menusub = 12;
+		}
+		break;
+
 		/******************************************************************/
 		/* minimig main menu                                              */
 		/******************************************************************/
@@ -4,73 +4,232 @@
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <atomic>
 
-static constexpr uint32_t QUEUE_SIZE = 8;
+static constexpr uint32_t QUEUE_SIZE = 64; // must be pow2
+static constexpr int WORKER_COUNT = 2;
 
-static pthread_t s_thread_handle;
-static pthread_cond_t s_cond_work, s_cond_available;
-static pthread_mutex_t s_queue_lock;
+enum
+{
+	WORK_FREE = 0,
+	WORK_QUEUED,
+	WORK_RUNNING,
+	WORK_DONE
+};
 
 struct Work
 {
 	std::function<void()> handler;
+	offload_done_t done;
+	offload_job_t id;
+	int prio;
+	int state;
+	bool cancelled;
+	struct timespec ts_submit;
 };
 
-static Work s_queue[QUEUE_SIZE];
-static uint32_t s_queue_head, s_queue_tail;
+static pthread_t s_thread_handle[WORKER_COUNT];
+static pthread_cond_t s_cond_work, s_cond_available;
+static pthread_mutex_t s_queue_lock;
+
+// job slots, job id encodes the slot index in its low bits
+static Work s_work[QUEUE_SIZE];
+static uint32_t s_work_used, s_work_done, s_work_running;
+static uint32_t s_id_gen;
+
+// per priority FIFO of job ids. Submission is rare and takes s_queue_lock anyway
+// for the slot table, so the FIFOs are plain arrays under the same lock.
+static offload_job_t s_queue[OFFLOAD_PRIO_COUNT][QUEUE_SIZE];
+static uint32_t s_queue_head[OFFLOAD_PRIO_COUNT], s_queue_tail[OFFLOAD_PRIO_COUNT];
 static bool s_quit;
 
+static offload_stats_t s_stats;
+
+// Completions are handed from the workers to the main thread through a bounded
+// lock-free MPSC ring. A job keeps its slot until its completion has been
+// delivered so the ring can never overflow.
+struct Completion
+{
+	std::atomic<uint32_t> seq;
+	uint32_t slot;
+};
+
+static Completion s_done_ring[QUEUE_SIZE];
+static std::atomic<uint32_t> s_done_head;
+static uint32_t s_done_tail;
+
+static void done_push(uint32_t slot)
+{
+	uint32_t pos = s_done_head.load(std::memory_order_relaxed);
+	Completion *c;
+
+	while (true)
+	{
+		c = &s_done_ring[pos % QUEUE_SIZE];
+		int32_t diff = (int32_t)(c->seq.load(std::memory_order_acquire) - pos);
+		if (!diff)
+		{
+			if (s_done_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+		}
+		else
+		{
+			pos = s_done_head.load(std::memory_order_relaxed);
+		}
+	}
+
+	c->slot = slot;
+	c->seq.store(pos + 1, std::memory_order_release);
+}
+
+static bool done_pop(uint32_t *slot)
+{
+	Completion *c = &s_done_ring[s_done_tail % QUEUE_SIZE];
+	if ((int32_t)(c->seq.load(std::memory_order_acquire) - (s_done_tail + 1)) < 0) return false;
+
+	*slot = c->slot;
+	c->seq.store(s_done_tail + QUEUE_SIZE, std::memory_order_release);
+	s_done_tail++;
+	return true;
+}
+
+static uint32_t elapsed_us(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	int64_t us = (int64_t)(now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+	return (us < 0) ? 0 : (uint32_t)us;
+}
+
+// must be called with queue locked
+static void release_slot(Work *work)
+{
+	work->handler = nullptr;
+	work->done = nullptr;
+	work->state = WORK_FREE;
+	s_work_used--;
+	pthread_cond_broadcast(&s_cond_available);
+}
+
+// must be called with queue locked
+static Work *pop_work()
+{
+	for (int prio = 0; prio < OFFLOAD_PRIO_COUNT; prio++)
+	{
+		if (s_queue_head[prio] != s_queue_tail[prio])
+		{
+			offload_job_t id = s_queue[prio][s_queue_tail[prio] % QUEUE_SIZE];
+			s_queue_tail[prio]++;
+			return &s_work[id % QUEUE_SIZE];
+		}
+	}
+
+	return nullptr;
+}
+
 static void *worker_thread(void *)
 {
 	while (true)
 	{
 		Work *current_work = nullptr;
+
 		// Wait for work
 		pthread_mutex_lock(&s_queue_lock);
-		if (s_queue_head == s_queue_tail)
+		while (!(current_work = pop_work()))
 		{
 			// queue empty and quit flag set, exit
 			if (s_quit)
 			{
 				pthread_mutex_unlock(&s_queue_lock);
-				break;
+				return (void *)0;
 			}
 
 			// wait for work signal
 			pthread_cond_wait(&s_cond_work, &s_queue_lock);
-			
-			// quit flag was set and queue still empty, quit
-			if (s_quit && (s_queue_head == s_queue_tail))
-			{
-				pthread_mutex_unlock(&s_queue_lock);
-				break;
-			}
 		}
 
-		// get work
-		current_work = &s_queue[s_queue_tail % QUEUE_SIZE];
+		uint32_t wait_us = elapsed_us(&current_work->ts_submit);
+		s_stats.wait_us_total[current_work->prio] += wait_us;
+		if (s_stats.wait_us_max[current_work->prio] < wait_us) s_stats.wait_us_max[current_work->prio] = wait_us;
+		s_stats.run_count[current_work->prio]++;
+
+		current_work->state = WORK_RUNNING;
+		s_work_running++;
 		pthread_mutex_unlock(&s_queue_lock);
 
 		// execute
-		current_work->handler();
-		current_work->handler = nullptr;
+		struct timespec ts_start;
+		clock_gettime(CLOCK_MONOTONIC, &ts_start);
+		TRACE_FLOW_END("offload", "offload", current_work->id);
+		{
+			TRACE_SCOPE("offload", "offload job");
+			current_work->handler();
+		}
+		uint32_t run_us = elapsed_us(&ts_start);
 
-		// lock and move tail forward
 		pthread_mutex_lock(&s_queue_lock);
-		s_queue_tail++;
-		pthread_cond_signal(&s_cond_available);
+		s_work_running--;
+		s_stats.completed++;
+		s_stats.run_us_total += run_us;
+		if (s_stats.run_us_max < run_us) s_stats.run_us_max = run_us;
+
+		bool notify = (bool)current_work->done;
+		if (notify)
+		{
+			current_work->handler = nullptr;
+			current_work->state = WORK_DONE;
+			s_work_done++;
+			pthread_cond_broadcast(&s_cond_available);
+		}
+		else
+		{
+			release_slot(current_work);
+		}
 		pthread_mutex_unlock(&s_queue_lock);
+
+		if (notify)
+		{
+			done_push(current_work - s_work);
+
+			// wake offload_add_work() waiting for a completion to deliver
+			pthread_mutex_lock(&s_queue_lock);
+			pthread_cond_broadcast(&s_cond_available);
+			pthread_mutex_unlock(&s_queue_lock);
+		}
 	}
 	return (void *)0;
 }
 
+static void deliver_done(bool cancel)
+{
+	uint32_t slot;
+	while (done_pop(&slot))
+	{
+		Work *work = &s_work[slot];
+		work->done(work->cancelled || cancel);
+
+		pthread_mutex_lock(&s_queue_lock);
+		s_work_done--;
+		release_slot(work);
+		pthread_mutex_unlock(&s_queue_lock);
+	}
+}
+
 void offload_start()
 {
 	pthread_cond_init(&s_cond_available, nullptr);
 	pthread_cond_init(&s_cond_work, nullptr);
 	pthread_mutex_init(&s_queue_lock, nullptr);
 
-	s_queue_head = s_queue_tail = 0;
+	for (uint32_t i = 0; i < QUEUE_SIZE; i++) s_done_ring[i].seq = i;
+	s_done_head = 0;
+	s_done_tail = 0;
+
+	memset(s_queue_head, 0, sizeof(s_queue_head));
+	memset(s_queue_tail, 0, sizeof(s_queue_tail));
+	memset(&s_stats, 0, sizeof(s_stats));
+	s_work_used = s_work_done = s_work_running = 0;
 	s_quit = false;
 
 	pthread_attr_t attr;
@@ -83,7 +242,7 @@ void offload_start()
 	CPU_SET(0, &set);
 	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
 
-	pthread_create(&s_thread_handle, &attr, worker_thread, nullptr);
+	for (int i = 0; i < WORKER_COUNT; i++) pthread_create(&s_thread_handle[i], &attr, worker_thread, nullptr);
 }
 
 void offload_stop()
@@ -91,32 +250,188 @@ void offload_stop()
 	pthread_mutex_lock(&s_queue_lock);
 
 	s_quit = true;
-	pthread_cond_signal(&s_cond_work);
+	pthread_cond_broadcast(&s_cond_work);
 
 	pthread_mutex_unlock(&s_queue_lock);
 
 	printf("Waiting for offloaded work to finish...");
-	pthread_join(s_thread_handle, nullptr);
+	for (int i = 0; i < WORKER_COUNT; i++) pthread_join(s_thread_handle[i], nullptr);
 	printf("Done\n");
+
+	// nobody will poll anymore, let the callbacks release what their jobs hold
+	deliver_done(true);
+
+	offload_print_stats();
 }
 
-void offload_add_work(std::function<void()> handler)
+void offload_poll()
 {
-	PROFILE_FUNCTION();
+	deliver_done(false);
+}
+
+static offload_job_t add_work(std::function<void()> &handler, offload_done_t &done, int prio, bool count_reject)
+{
+	if (prio < 0 || prio >= OFFLOAD_PRIO_COUNT) prio = OFFLOAD_PRIO_NORMAL;
 
 	pthread_mutex_lock(&s_queue_lock);
 
-	if ((s_queue_head - s_queue_tail) == QUEUE_SIZE)
+	if (s_quit || s_work_used == QUEUE_SIZE)
 	{
-		pthread_cond_wait(&s_cond_available, &s_queue_lock);
+		if (count_reject) s_stats.rejected++;
+		pthread_mutex_unlock(&s_queue_lock);
+		return 0;
 	}
 
-	Work *work = &s_queue[s_queue_head % QUEUE_SIZE];
+	uint32_t slot = 0;
+	while (s_work[slot].state != WORK_FREE) slot++;
+
+	s_id_gen = (s_id_gen + 1) % (UINT32_MAX / QUEUE_SIZE);
+	if (!s_id_gen) s_id_gen++;
+
+	Work *work = &s_work[slot];
+	work->id = s_id_gen * QUEUE_SIZE + slot;
 	work->handler = handler;
+	work->done = done;
+	work->prio = prio;
+	work->state = WORK_QUEUED;
+	work->cancelled = false;
+	clock_gettime(CLOCK_MONOTONIC, &work->ts_submit);
 
-	s_queue_head++;
+	s_queue[prio][s_queue_head[prio] % QUEUE_SIZE] = work->id;
+	s_queue_head[prio]++;
+	s_work_used++;
+	s_stats.submitted++;
+	TRACE_FLOW_BEGIN("offload", "offload", work->id);
+	TRACE_COUNTER("offload", "offload queued", s_work_used);
 
 	pthread_cond_signal(&s_cond_work);
 
 	pthread_mutex_unlock(&s_queue_lock);
-}
\ No newline at end of file
+
+	return work->id;
+}
+
+offload_job_t offload_try_add_work(std::function<void()> handler, offload_done_t done, int prio)
+{
+	PROFILE_FUNCTION();
+
+	return add_work(handler, done, prio, true);
+}
+
+void offload_add_work(std::function<void()> handler)
+{
+	PROFILE_FUNCTION();
+
+	offload_done_t done = nullptr;
+	while (!add_work(handler, done, OFFLOAD_PRIO_NORMAL, false))
+	{
+		// free up slots held by finished jobs before waiting
+		offload_poll();
+
+		pthread_mutex_lock(&s_queue_lock);
+		if (s_quit)
+		{
+			pthread_mutex_unlock(&s_queue_lock);
+			return;
+		}
+
+		// sleep until a slot is released or a completion can be delivered. A job
+		// counted in s_work_done may not be in the ring yet, so check the ring.
+		if (s_work_used == QUEUE_SIZE && s_done_head.load(std::memory_order_acquire) == s_done_tail)
+		{
+			pthread_cond_wait(&s_cond_available, &s_queue_lock);
+		}
+		pthread_mutex_unlock(&s_queue_lock);
+	}
+}
+
+bool offload_worker_idle()
+{
+	pthread_mutex_lock(&s_queue_lock);
+
+	uint32_t busy = s_work_running;
+	for (int prio = 0; prio < OFFLOAD_PRIO_COUNT; prio++) busy += s_queue_head[prio] - s_queue_tail[prio];
+	bool idle = !s_quit && busy < WORKER_COUNT;
+
+	pthread_mutex_unlock(&s_queue_lock);
+	return idle;
+}
+
+bool offload_cancel(offload_job_t id)
+{
+	if (!id) return false;
+
+	pthread_mutex_lock(&s_queue_lock);
+
+	Work *work = &s_work[id % QUEUE_SIZE];
+	if (work->id != id || work->state != WORK_QUEUED)
+	{
+		pthread_mutex_unlock(&s_queue_lock);
+		return false;
+	}
+
+	// remove from its priority FIFO
+	uint32_t *head = &s_queue_head[work->prio];
+	uint32_t *tail = &s_queue_tail[work->prio];
+	offload_job_t *queue = s_queue[work->prio];
+	for (uint32_t i = *tail; i != *head; i++)
+	{
+		if (queue[i % QUEUE_SIZE] == id)
+		{
+			for (uint32_t j = i; j + 1 != *head; j++) queue[j % QUEUE_SIZE] = queue[(j + 1) % QUEUE_SIZE];
+			(*head)--;
+			break;
+		}
+	}
+
+	s_stats.cancelled++;
+	work->cancelled = true;
+
+	bool notify = (bool)work->done;
+	if (notify)
+	{
+		work->handler = nullptr;
+		work->state = WORK_DONE;
+		s_work_done++;
+	}
+	else
+	{
+		release_slot(work);
+	}
+
+	pthread_mutex_unlock(&s_queue_lock);
+
+	if (notify) done_push(id % QUEUE_SIZE);
+	return true;
+}
+
+void offload_get_stats(offload_stats_t *stats)
+{
+	pthread_mutex_lock(&s_queue_lock);
+	*stats = s_stats;
+	stats->pending = s_work_used;
+	pthread_mutex_unlock(&s_queue_lock);
+}
+
+void offload_print_stats()
+{
+	static const char *prio_names[OFFLOAD_PRIO_COUNT] = { "high", "normal", "low" };
+
+	offload_stats_t stats;
+	offload_get_stats(&stats);
+
+	printf("Offload: %u submitted, %u completed, %u cancelled, %u rejected, %u pending\n",
+		stats.submitted, stats.completed, stats.cancelled, stats.rejected, stats.pending);
+
+	for (int prio = 0; prio < OFFLOAD_PRIO_COUNT; prio++)
+	{
+		if (!stats.run_count[prio]) continue;
+		printf("  %-6s: %u jobs, wait avg %uus max %uus\n", prio_names[prio], stats.run_count[prio],
+			(uint32_t)(stats.wait_us_total[prio] / stats.run_count[prio]), stats.wait_us_max[prio]);
+	}
+
+	if (stats.completed)
+	{
+		printf("  run avg %uus max %uus\n", (uint32_t)(stats.run_us_total / stats.completed), stats.run_us_max);
+	}
+}
@@ -2,11 +2,59 @@
 #define OFFLOAD_H
 
 #include <stddef.h>
+#include <inttypes.h>
 #include <functional>
 
+enum
+{
+	OFFLOAD_PRIO_HIGH = 0,
+	OFFLOAD_PRIO_NORMAL,
+	OFFLOAD_PRIO_LOW,
+
+	OFFLOAD_PRIO_COUNT
+};
+
+// 0 is never a valid job id
+typedef uint32_t offload_job_t;
+
+// called on the main thread from offload_poll(), cancelled is true if work never ran.
+// offload_stop() delivers the remaining callbacks with cancelled set, they should only free their data.
+typedef std::function<void(bool cancelled)> offload_done_t;
+
+struct offload_stats_t
+{
+	uint32_t submitted;
+	uint32_t completed;
+	uint32_t cancelled;
+	uint32_t rejected;
+	uint32_t pending;
+
+	uint64_t wait_us_total[OFFLOAD_PRIO_COUNT];
+	uint32_t wait_us_max[OFFLOAD_PRIO_COUNT];
+	uint32_t run_count[OFFLOAD_PRIO_COUNT];
+	uint64_t run_us_total;
+	uint32_t run_us_max;
+};
+
 void offload_start();
 void offload_stop();
 
+// deliver completion callbacks, must be called from the main thread
+void offload_poll();
+
+// blocks if queue is full
 void offload_add_work(std::function<void()> work);
 
-#endif
\ No newline at end of file
+// never blocks, returns 0 if queue is full
+offload_job_t offload_try_add_work(std::function<void()> work, offload_done_t done = nullptr, int prio = OFFLOAD_PRIO_NORMAL);
+
+// returns false if job is already running or finished
+bool offload_cancel(offload_job_t job);
+
+// true if a job submitted now would start without waiting for another one
+bool offload_worker_idle();
+
+void offload_get_stats(offload_stats_t *stats);
+void offload_print_stats();
+
+#endif
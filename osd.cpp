@@ -77,6 +77,11 @@ static uint8_t osdbuf[256 * 32];
 static int  osdbufpos = 0;
 static int  osdset = 0;
 
+// what the FPGA currently holds, lines are only sent when they differ
+static uint8_t osdshadow[256 * 32];
+static uint32_t osdshadow_valid = 0;
+static int osdshadow_target = OSD_ALL;
+
 char framebuffer[16][256];
 static void framebuffer_clear()
 {
@@ -660,24 +665,59 @@ char* OsdCoreNameGet()
 	return lastcorename;
 }
 
+// lines per transfer, CD cores are polled between transfers
+#define OSD_BURST_LINES 4
+
 void OsdUpdate()
 {
 	PROFILE_FUNCTION();
 	int n = is_menu() ? 19 : osd_size;
+
+	// writes to one output only leave the other one out of step with the shadow
+	if (spi_osd_target() != osdshadow_target)
+	{
+		osdshadow_target = spi_osd_target();
+		osdshadow_valid = 0;
+	}
+
+	// the menu marks many lines which are redrawn with the same content
+	uint32_t dirty = 0;
 	for (int i = 0; i < n; i++)
 	{
-		if (osdset & (1 << i))
+		if (!(osdset & (1 << i))) continue;
+		if ((osdshadow_valid & (1 << i)) && !memcmp(osdbuf + i * 256, osdshadow + i * 256, 256)) continue;
+		dirty |= 1 << i;
+	}
+	osdset = 0;
+
+	int sent = 0;
+	for (int i = 0; i < n;)
+	{
+		if (!(dirty & (1 << i)))
 		{
-			spi_osd_cmd_cont(OSD_CMD_WRITE | i);
-			spi_write(osdbuf + i * 256, 256, 0);
-			DisableOsd();
-			if (is_megacd()) mcd_poll();
-			if (is_pce()) pcecd_poll();
-			if (is_saturn()) saturn_poll();
-			if (is_neogeo_cd()) neocd_poll();
-			if (is_3do()) p3do_poll();
+			i++;
+			continue;
 		}
+
+		int cnt = 1;
+		while (cnt < OSD_BURST_LINES && i + cnt < n && (dirty & (1 << (i + cnt)))) cnt++;
+
+		// the OSD write address continues into the next line
+		spi_osd_cmd_cont(OSD_CMD_WRITE | i);
+		spi_block_write(osdbuf + i * 256, 0, cnt * 256);
+		DisableOsd();
+
+		memcpy(osdshadow + i * 256, osdbuf + i * 256, cnt * 256);
+		osdshadow_valid |= ((1 << cnt) - 1) << i;
+		sent += cnt;
+		i += cnt;
+
+		if (is_megacd()) mcd_poll();
+		if (is_pce()) pcecd_poll();
+		if (is_saturn()) saturn_poll();
+		if (is_neogeo_cd()) neocd_poll();
+		if (is_3do()) p3do_poll();
 	}
 
-	osdset = 0;
+	TRACE_COUNTER("osd", "osd lines sent", sent);
 }
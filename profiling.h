@@ -2,6 +2,7 @@
 #define PROFILING_H 1
 
 #include <inttypes.h>
+#include "trace.h"
 
 #ifdef PROFILING
 
@@ -36,18 +37,20 @@ struct ProfilingScopedEvent
 	}
 };
 
-#define PROFILE_SCOPE(name) ProfilingScopedEvent __scope_timer(name)
-#define PROFILE_FUNCTION() ProfilingScopedEvent __scope_timer(__FUNCTION__)
-#define SPIKE_SCOPE(name, us) ProfilingScopedEvent __scope_timer(name, us)
-#define SPIKE_FUNCTION(us) ProfilingScopedEvent __scope_timer(__FUNCTION__, us)
+#define PROFILE_SCOPE_CAT(cat, name) ProfilingScopedEvent __scope_timer(name); TRACE_SCOPE(cat, name)
+#define SPIKE_SCOPE(name, us) ProfilingScopedEvent __scope_timer(name, us); TRACE_SCOPE("main", name)
+#define SPIKE_FUNCTION(us) ProfilingScopedEvent __scope_timer(__FUNCTION__, us); TRACE_SCOPE("main", __FUNCTION__)
 
 #else // PROFILING
 
-#define PROFILE_SCOPE(name) 
-#define PROFILE_FUNCTION()
-#define SPIKE_SCOPE(name, us)
-#define SPIKE_FUNCTION(us)
+// release builds only record into the trace rings, see trace.h
+#define PROFILE_SCOPE_CAT(cat, name) TRACE_SCOPE(cat, name)
+#define SPIKE_SCOPE(name, us) TRACE_SCOPE("main", name)
+#define SPIKE_FUNCTION(us) TRACE_SCOPE("main", __FUNCTION__)
 
 #endif // PROFILING
 
+#define PROFILE_SCOPE(name) PROFILE_SCOPE_CAT("main", name)
+#define PROFILE_FUNCTION() PROFILE_SCOPE_CAT("main", __FUNCTION__)
+
 #endif // PROFILING_H
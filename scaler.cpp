@@ -12,7 +12,7 @@ with help from the MiSTer contributors including Grabulosaure
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <atomic>
+#include <time.h>
 
 #include <sys/types.h>
 #include <err.h>
@@ -31,9 +31,7 @@ const int VEC_WIDTH = 16;
 #include "file_io.h"
 #include "menu.h"
 
-#ifdef PROFILING
 #include "profiling.h"
-#endif
 
 mister_scaler * mister_scaler_init()
 {
@@ -138,31 +136,30 @@ int mister_scaler_read_yuv(mister_scaler *ms,int lineY,unsigned char *bufY, int
 
 // ARGB32 explicitly respects endianness, the other formats don't
 
-int mister_scaler_read(mister_scaler *ms, unsigned char *gbuf, mister_scaler_format_t format)
+static void scaler_convert(const unsigned char *buffer, int line, int width, int height, unsigned char *gbuf, mister_scaler_format_t format)
 {
     #ifdef PROFILING
         PROFILE_FUNCTION();
     #endif
 
-    unsigned char *buffer = (unsigned char *)(ms->map + ms->map_off);
     
     // this is a "splat" - prefilling a vector register with a single value
     const uint8x16_t alpha = vdupq_n_u8(0xFF);
 
-    for (int y = 0; y < ms->height; y++) {
-        unsigned char *pixbuf = &buffer[ms->header + y * ms->line];
+    for (int y = 0; y < height; y++) {
+        const unsigned char *pixbuf = &buffer[y * line];
         unsigned char *outbuf;
 
         if (format == RGBA || format == BGRA || format == ARGB32)
-            outbuf = &gbuf[y * (ms->width * 4)];
+            outbuf = &gbuf[y * (width * 4)];
         else
-            outbuf = &gbuf[y * (ms->width * 3)];
+            outbuf = &gbuf[y * (width * 3)];
         
         // VEC_WIDTH is the number of elements a vector register can hold.
         // 24/32-bit image data is stored as pixels of 3 or 4 bytes (8 bits).
         // our ARMv7 NEON registers are 128 bits / 8 bits = 16 bytes per register.
         // any data left after doing 16-byte chunks falls back to our scalar code to be completed.
-        int limit = ms->width - (ms->width % VEC_WIDTH);
+        int limit = width - (width % VEC_WIDTH);
         for (int x = 0; x < limit; x += VEC_WIDTH) {
             
             // load 16 pixels (48 bytes) from the scaler buffer into our vector registers.
@@ -230,21 +227,21 @@ int mister_scaler_read(mister_scaler *ms, unsigned char *gbuf, mister_scaler_for
         switch (format)
         {
             case RGB:
-                for (int x = limit; x < ms->width; x++) {
+                for (int x = limit; x < width; x++) {
                     outbuf[x * 3 + 0] = pixbuf[x * 3 + 0];
                     outbuf[x * 3 + 1] = pixbuf[x * 3 + 1];
                     outbuf[x * 3 + 2] = pixbuf[x * 3 + 2];
                 }
                 break;
             case BGR:
-                for (int x = limit; x < ms->width; x++) {
+                for (int x = limit; x < width; x++) {
                     outbuf[x * 3 + 2] = pixbuf[x * 3 + 0];
                     outbuf[x * 3 + 1] = pixbuf[x * 3 + 1];
                     outbuf[x * 3 + 0] = pixbuf[x * 3 + 2];
                 }
                 break;
             case RGBA:
-                for (int x = limit; x < ms->width; x++) {
+                for (int x = limit; x < width; x++) {
                     outbuf[x * 4 + 0] = pixbuf[x * 3 + 0];
                     outbuf[x * 4 + 1] = pixbuf[x * 3 + 1];
                     outbuf[x * 4 + 2] = pixbuf[x * 3 + 2];
@@ -252,7 +249,7 @@ int mister_scaler_read(mister_scaler *ms, unsigned char *gbuf, mister_scaler_for
                 }
                 break;
             case BGRA:
-                for (int x = limit; x < ms->width; x++) {
+                for (int x = limit; x < width; x++) {
                     outbuf[x * 4 + 2] = pixbuf[x * 3 + 0];
                     outbuf[x * 4 + 1] = pixbuf[x * 3 + 1];
                     outbuf[x * 4 + 0] = pixbuf[x * 3 + 2];
@@ -260,7 +257,7 @@ int mister_scaler_read(mister_scaler *ms, unsigned char *gbuf, mister_scaler_for
                 }
                 break;
             case ARGB32:
-                for (int x = limit; x < ms->width; x++) {
+                for (int x = limit; x < width; x++) {
                 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
                     outbuf[x * 4 + 0] = pixbuf[x * 3 + 2]; // B
                     outbuf[x * 4 + 1] = pixbuf[x * 3 + 1]; // G
@@ -280,48 +277,46 @@ int mister_scaler_read(mister_scaler *ms, unsigned char *gbuf, mister_scaler_for
                 break;
         }
     }
-    return 0;
 }
 
 #else
 
 // no NEON available, do all scalar
-int mister_scaler_read(mister_scaler *ms, unsigned char *gbuf, mister_scaler_format_t format = RGB)
+static void scaler_convert(const unsigned char *buffer, int line, int width, int height, unsigned char *gbuf, mister_scaler_format_t format)
 {
     #ifdef PROFILING
         PROFILE_FUNCTION();
     #endif
 
-    unsigned char *buffer = (unsigned char *)(ms->map + ms->map_off);
 
-    for (int y = 0; y < ms->height; y++) {
-        unsigned char *pixbuf = &buffer[ms->header + y * ms->line];
+    for (int y = 0; y < height; y++) {
+        const unsigned char *pixbuf = &buffer[y * line];
         unsigned char *outbuf;
 
-        if (format == RGBA || format == BGRA)
-            outbuf = &gbuf[y * (ms->width * 4)];
+        if (format == RGBA || format == BGRA || format == ARGB32)
+            outbuf = &gbuf[y * (width * 4)];
         else
-            outbuf = &gbuf[y * (ms->width * 3)];
+            outbuf = &gbuf[y * (width * 3)];
 
         // scalar version
         switch (format)
         {
             case RGB:
-                for (int x = 0; x < ms->width; x++) {
+                for (int x = 0; x < width; x++) {
                     outbuf[x * 3 + 0] = pixbuf[x * 3 + 0];
                     outbuf[x * 3 + 1] = pixbuf[x * 3 + 1];
                     outbuf[x * 3 + 2] = pixbuf[x * 3 + 2];
                 }
                 break;
             case BGR:
-                for (int x = 0; x < ms->width; x++) {
+                for (int x = 0; x < width; x++) {
                     outbuf[x * 3 + 2] = pixbuf[x * 3 + 0];
                     outbuf[x * 3 + 1] = pixbuf[x * 3 + 1];
                     outbuf[x * 3 + 0] = pixbuf[x * 3 + 2];
                 }
                 break;
             case RGBA:
-                for (int x = 0; x < ms->width; x++) {
+                for (int x = 0; x < width; x++) {
                     outbuf[x * 4 + 0] = pixbuf[x * 3 + 0];
                     outbuf[x * 4 + 1] = pixbuf[x * 3 + 1];
                     outbuf[x * 4 + 2] = pixbuf[x * 3 + 2];
@@ -329,7 +324,7 @@ int mister_scaler_read(mister_scaler *ms, unsigned char *gbuf, mister_scaler_for
                 }
                 break;
             case BGRA:
-                for (int x = 0; x < ms->width; x++) {
+                for (int x = 0; x < width; x++) {
                     outbuf[x * 4 + 2] = pixbuf[x * 3 + 0];
                     outbuf[x * 4 + 1] = pixbuf[x * 3 + 1];
                     outbuf[x * 4 + 0] = pixbuf[x * 3 + 2];
@@ -337,7 +332,7 @@ int mister_scaler_read(mister_scaler *ms, unsigned char *gbuf, mister_scaler_for
                 }
                 break;
             case ARGB32:
-            for (int x = limit; x < ms->width; x++) {
+            for (int x = 0; x < width; x++) {
             #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
                 outbuf[x * 4 + 0] = pixbuf[x * 3 + 2]; // B
                 outbuf[x * 4 + 1] = pixbuf[x * 3 + 1]; // G
@@ -357,65 +352,83 @@ int mister_scaler_read(mister_scaler *ms, unsigned char *gbuf, mister_scaler_for
                 break;
         }
     }
-    return 0;
 }
 
 #endif
 
+int mister_scaler_read(mister_scaler *ms, unsigned char *gbuf, mister_scaler_format_t format)
+{
+    unsigned char *buffer = (unsigned char *)(ms->map + ms->map_off);
+    scaler_convert(buffer + ms->header, ms->line, ms->width, ms->height, gbuf, format);
+    return 0;
+}
+
 /*
     screenshots
     ===========
-    screenshot_cb -> screenshot callback that runs every vsync and checks for requests/results
+    screenshot_cb -> screenshot callback that runs every vsync and checks for requests
     request_screenshot -> say we want a screenshot
-    do_screenshot -> runs on main thread and copies from the scaler
-    save_screenshot -> wrapper to call write_screenshot with expected parameters (worker thread)
-    write_screenshot -> does the actual work of writing the screenshot to disk (worker thread)
-
-    only one screenshot can be in process at a time. we gate this via screenshot_pending_atomic.
-    
-    this is important because we use a static buffer to capture the image into to avoid the
-    overhead of a malloc/free every time we take a screenshot.
+    do_screenshot -> runs on main thread and grabs the frame from the scaler
+    save_screenshot -> converts and encodes the frame (worker thread)
+    write_screenshot / write_qoi -> do the actual work of writing the screenshot to disk (worker thread)
 
     a screenshot callback set in user_io_poll() runs every vsync and checks if a screenshot
     has been requested. we do it this way to reduce the risk of taking a screenshot while the
     scaler is being updated and getting a corrupted image or tearing.
 
-    the scaler is copied to a static buffer in the main thread, then all scaling/compression/saving
-    to the final image is offloaded to an asynchronous worker.
+    the main thread only copies the raw RGB24 lines out of the scaler memory, the conversion
+    to ARGB and the encoding are done by an offload worker. with screenshot_direct=1 even that
+    copy is skipped and the worker reads the mapped scaler memory itself. this costs nothing on
+    the main thread but moving pictures may tear.
 
-    the worker reports back via the ScreenshotResult_atomic struct.
-    the same callback that checks for screenshot requests also checks those results.
-    
+    there are two slots with their own buffers, so a screenshot can be taken while the previous
+    one is still being encoded. the buffers are allocated on first use and kept.
+
+    the worker reports back through the offload done callback which runs on the main thread.
     Info() corrupted the screen if I called it from a worker thread, so I assume this means it's
     not thread safe.
 */
 
-// static buffers to avoid malloc/free every screenshot
-static uint8_t screenshot_outputbuf[MISTER_SCALER_BUFFERSIZE];
+#define SCREENSHOT_SLOTS 2
 
-extern char last_filename[1024];
+enum ScreenshotFormat {
+    SCREENSHOT_PNG,
+    SCREENSHOT_BMP,
+    SCREENSHOT_QOI
+};
 
-enum ScreenshotResult {
-    SCREENSHOT_SUCCESS,
-    SCREENSHOT_FAILURE
+struct ScreenshotSlot {
+    bool busy;
+    uint8_t *raw;   // RGB24 lines as in the scaler
+    uint8_t *argb;
 };
 
-struct ScreenshotResult_atomic {
-    int result;
-    char *filename;
+struct ScreenshotJob {
+    ScreenshotSlot *slot;
+    mister_scaler *ms;      // direct read, unmapped by the worker
+    const uint8_t *src;
+    int line;
+    int width;
+    int height;
+    int scaled_width;       // 0 = native resolution
+    int scaled_height;
+    int format;
+    int png_compression;
+    bool success;
+    uint32_t grab_us;
+    uint32_t encode_us;
+    char path[1024];
+    char name[1024];
 };
 
+static ScreenshotSlot screenshot_slots[SCREENSHOT_SLOTS] = {};
+
+extern char last_filename[1024];
+
 static bool screenshot_requested = false;
 static int screenshot_rescale = 0;
 static char* screenshot_filename = NULL;
 
-bool write_screenshot(const char *filename, const uint8_t *argb,
-                      int width, int height, int output_width = 0, int output_height = 0);
-
-// atomic variables for worker process
-static std::atomic<bool> screenshot_pending_atomic{false};
-static std::atomic<ScreenshotResult_atomic*> screenshot_result_data_atomic{nullptr};
-
 static struct { const char *fmtstr; Imlib_Load_Error err_code; } err_strings[] = {
   {"file '%s' does not exist", IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST},
   {"file '%s' is a directory", IMLIB_LOAD_ERROR_FILE_IS_DIRECTORY},
@@ -446,12 +459,139 @@ static void print_imlib_load_error (Imlib_Load_Error err, const char *filepath)
   return ;
 }
 
+// QOI (qoiformat.org): lossless like png but encodes many times faster, which matters
+// for full resolution screenshots on the ARM. expects argb, alpha is not stored.
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xC0
+#define QOI_OP_RGB   0xFE
+
+static bool write_qoi(const char *filename, const uint32_t *pixels, int width, int height)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        printf("Screenshot Error: cannot create '%s'\n", filename);
+        return false;
+    }
+
+    // screenshots may be encoded on several workers at once
+    const int out_size = 64 * 1024;
+    uint8_t *out = (uint8_t *)malloc(out_size);
+    if (!out) {
+        fclose(fp);
+        printf("Screenshot Error: out of memory\n");
+        return false;
+    }
+    int pos = 0;
+
+    const uint8_t header[14] = {
+        'q', 'o', 'i', 'f',
+        (uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+        (uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height,
+        3, 0
+    };
+    memcpy(out, header, sizeof(header));
+    pos = sizeof(header);
+
+    uint32_t index[64] = {};
+    uint32_t prev = 0xFF000000;
+    int run = 0;
+    bool ok = true;
+
+    size_t count = (size_t)width * height;
+    for (size_t i = 0; i < count; i++)
+    {
+        // room for the largest op
+        if (pos > out_size - 8)
+        {
+            ok &= fwrite(out, 1, pos, fp) == (size_t)pos;
+            pos = 0;
+        }
+
+        uint32_t px = pixels[i] | 0xFF000000;
+        if (px == prev)
+        {
+            if (++run == 62 || i == count - 1)
+            {
+                out[pos++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run)
+        {
+            out[pos++] = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        int r = (px >> 16) & 0xFF, g = (px >> 8) & 0xFF, b = px & 0xFF;
+        int hash = (r * 3 + g * 5 + b * 7 + 255 * 11) & 63;
+
+        if (index[hash] == px)
+        {
+            out[pos++] = QOI_OP_INDEX | hash;
+        }
+        else
+        {
+            index[hash] = px;
+
+            int8_t dr = r - ((prev >> 16) & 0xFF);
+            int8_t dg = g - ((prev >> 8) & 0xFF);
+            int8_t db = b - (prev & 0xFF);
+            int8_t dr_dg = dr - dg;
+            int8_t db_dg = db - dg;
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            {
+                out[pos++] = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+            }
+            else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+            {
+                out[pos++] = QOI_OP_LUMA | (dg + 32);
+                out[pos++] = (dr_dg + 8) << 4 | (db_dg + 8);
+            }
+            else
+            {
+                out[pos++] = QOI_OP_RGB;
+                out[pos++] = r;
+                out[pos++] = g;
+                out[pos++] = b;
+            }
+        }
+
+        prev = px;
+    }
+
+    static const uint8_t padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    if (pos > out_size - (int)sizeof(padding))
+    {
+        ok &= fwrite(out, 1, pos, fp) == (size_t)pos;
+        pos = 0;
+    }
+    memcpy(out + pos, padding, sizeof(padding));
+    pos += sizeof(padding);
+
+    ok &= fwrite(out, 1, pos, fp) == (size_t)pos;
+    ok &= !fclose(fp);
+    free(out);
+
+    if (!ok) printf("Screenshot Error: cannot write '%s'\n", filename);
+    return ok;
+}
+
 // use imlib2 to save screenshot to disk. expects argb (bgra on little-endian) format.
 // imlib2 determines output format by filename extension
 // if we pass anything to output_width/height it will be scaled to that size
-bool write_screenshot(const char *filename, const uint8_t *inbuf,
-                      int width, int height, int output_width, int output_height)
+static bool write_screenshot_locked(const ScreenshotJob *job, const uint8_t *inbuf)
 {
+    int width = job->width;
+    int height = job->height;
+    int output_width = job->scaled_width;
+    int output_height = job->scaled_height;
+    const char *filename = job->path;
+
     Imlib_Image im = imlib_create_image_using_data(width, height, (unsigned int *)inbuf);
     if (!im) {
         printf("Failed to create imlib image for screenshot\n");
@@ -485,8 +625,18 @@ bool write_screenshot(const char *filename, const uint8_t *inbuf,
         imlib_context_set_blend(0);
     }
 
-    Imlib_Load_Error error;
-    imlib_save_image_with_error_return(getFullPath(filename), &error);
+    Imlib_Load_Error error = IMLIB_LOAD_ERROR_NONE;
+    bool success = true;
+
+    if (job->format == SCREENSHOT_QOI) {
+        // only here for the scaling
+        success = write_qoi(filename, (const uint32_t *)imlib_image_get_data_for_reading_only(),
+                            imlib_image_get_width(), imlib_image_get_height());
+    } else {
+        if (job->format == SCREENSHOT_PNG && job->png_compression >= 0)
+            imlib_image_attach_data_value("compression", NULL, job->png_compression, NULL);
+        imlib_save_image_with_error_return(filename, &error);
+    }
 
     if (scaled && scaled != im) {
         imlib_context_set_image(scaled);
@@ -503,126 +653,218 @@ bool write_screenshot(const char *filename, const uint8_t *inbuf,
         return false;
     }
 
-    return true;
+    return success;
+}
+
+static bool write_screenshot(const ScreenshotJob *job, const uint8_t *inbuf)
+{
+    // own context so the flags set here don't leak into the menu drawing
+    video_imlib_lock();
+    Imlib_Context ctx = imlib_context_new();
+    imlib_context_push(ctx);
+
+    bool success = write_screenshot_locked(job, inbuf);
+
+    imlib_context_pop();
+    imlib_context_free(ctx);
+    video_imlib_unlock();
+    return success;
+}
+
+static uint32_t screenshot_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
 }
 
-static void save_screenshot(int do_rescale, int base_width, int base_height, int scaled_width, int scaled_height, unsigned char *outputbuf, char *filename) {
-    bool success = false;
-    if (do_rescale)
+static void save_screenshot(ScreenshotJob *job)
+{
+    uint32_t start = screenshot_us();
+    uint8_t *argb = job->slot->argb;
+
+    scaler_convert(job->src, job->line, job->width, job->height, argb, ARGB32);
+    if (job->ms)
     {
-        printf("rescaling screenshot from %dx%d to %dx%d\n", base_width, base_height, scaled_width, scaled_height);
-        success = write_screenshot(filename, outputbuf, base_width, base_height, scaled_width, scaled_height);
+        mister_scaler_free(job->ms);
+        job->ms = NULL;
     }
+
+    if (job->scaled_width > 0)
+        printf("rescaling screenshot from %dx%d to %dx%d\n", job->width, job->height, job->scaled_width, job->scaled_height);
     else
+        printf("saving screenshot at native res %dx%d\n", job->width, job->height);
+
+    if (job->format == SCREENSHOT_QOI && job->scaled_width <= 0)
+        job->success = write_qoi(job->path, (const uint32_t *)argb, job->width, job->height);
+    else
+        job->success = write_screenshot(job, argb);
+
+    job->encode_us = screenshot_us() - start;
+}
+
+static void screenshot_done(ScreenshotJob *job, bool cancelled)
+{
+    if (job->ms) mister_scaler_free(job->ms);
+    job->slot->busy = false;
+
+    if (cancelled)
     {
-        printf("saving screenshot at native res %dx%d\n", base_width, base_height);
-        success = write_screenshot(filename, outputbuf, base_width, base_height);
+        printf("Screenshot cancelled\n");
     }
-
-    ScreenshotResult_atomic *result_data =
-    (ScreenshotResult_atomic *)malloc(sizeof(ScreenshotResult_atomic));
-    
-    if (result_data)
+    else if (job->success)
     {
-        result_data->result = success ? SCREENSHOT_SUCCESS : SCREENSHOT_FAILURE;
-        result_data->filename = filename;
-        screenshot_result_data_atomic = result_data;
+        char msg[1024];
+        snprintf(msg, sizeof(msg), "Screen saved to\n%s", job->name + strlen(SCREENSHOT_DIR "/"));
+        printf("%s (grab %.1fms, encode %.1fms)\n", msg, job->grab_us / 1000.0f, job->encode_us / 1000.0f);
+        Info(msg);
     }
     else
     {
-        free(filename);
+        printf("Screenshot failed\n");
+        Info("Screenshot failed");
     }
 
-    screenshot_pending_atomic = false;
-};
+    delete job;
+}
+
+static ScreenshotSlot *screenshot_free_slot()
+{
+    for (int i = 0; i < SCREENSHOT_SLOTS; i++)
+    {
+        if (!screenshot_slots[i].busy) return &screenshot_slots[i];
+    }
+    return NULL;
+}
 
 void do_screenshot(char* imgname)
 {
-	#ifdef PROFILING
-		PROFILE_FUNCTION();
-	#endif
-	
-	screenshot_pending_atomic = true;
+	PROFILE_FUNCTION();
+
+	uint32_t start = screenshot_us();
 	screenshot_requested = false;
 
+	int do_rescale = screenshot_rescale;
+	screenshot_rescale = 0;
+
+	ScreenshotSlot *slot = screenshot_free_slot();
+	if (!slot)
+	{
+		free(imgname);
+		return;
+	}
+
 	mister_scaler *ms = mister_scaler_init();
 	if (ms == NULL)
 	{
 		printf("problem with scaler, maybe not a new enough version\n");
 		Info("Scaler not compatible");
-		screenshot_pending_atomic = false;
 		free(imgname);
-		imgname = NULL;
 		return;
 	}
-	
+
 	const char *basename = last_filename;
 	if( imgname && *imgname )
 		basename = imgname;
 
-	char filename[1024];
+	size_t needed = (size_t)ms->width * (size_t)ms->height * 4;
+	size_t frame = (size_t)ms->line * (size_t)ms->height;
+	if (needed > MISTER_SCALER_BUFFERSIZE || ms->header + frame > (size_t)ms->num_bytes)
+	{
+		mister_scaler_free(ms);
+		free(imgname);
+		return;
+	}
 
-	int base_width = ms->width;
-	int base_height = ms->height;
-	int scaled_width = ms->output_width;
-	int scaled_height = ms->output_height;
+	ScreenshotJob *job = new ScreenshotJob();
+	job->slot = slot;
+	job->line = ms->line;
+	job->width = ms->width;
+	job->height = ms->height;
+	job->png_compression = cfg.screenshot_png_compression;
 
-    size_t needed = (size_t)base_width * (size_t)base_height * 4;
-    
-    if (needed > sizeof(screenshot_outputbuf))
-    { mister_scaler_free(ms);
-		screenshot_pending_atomic = false;
-		screenshot_rescale = 0;
-		return; 
-    }
-	
-    const char *extension;
+	const char *extension;
 
-    if (!strcasecmp(cfg.screenshot_image_format, "png"))
-    {
-        extension = ".png";
-    }
-    else if (!strcasecmp(cfg.screenshot_image_format, "bmp"))
-    {   
-        extension = ".bmp";
-    } else {
-        printf("Unknown screenshot image format in config: %s; defaulting to PNG\n", cfg.screenshot_image_format);
-        extension = ".png";
-    }
+	if (!strcasecmp(cfg.screenshot_image_format, "png"))
+	{
+		extension = ".png";
+		job->format = SCREENSHOT_PNG;
+	}
+	else if (!strcasecmp(cfg.screenshot_image_format, "bmp"))
+	{
+		extension = ".bmp";
+		job->format = SCREENSHOT_BMP;
+	}
+	else if (!strcasecmp(cfg.screenshot_image_format, "qoi"))
+	{
+		extension = ".qoi";
+		job->format = SCREENSHOT_QOI;
+	}
+	else
+	{
+		printf("Unknown screenshot image format in config: %s; defaulting to PNG\n", cfg.screenshot_image_format);
+		extension = ".png";
+		job->format = SCREENSHOT_PNG;
+	}
 
-    mister_scaler_read(ms, screenshot_outputbuf);
-    FileGenerateScreenshotName(basename, filename, extension, 1024);
+	FileGenerateScreenshotName(basename, job->name, extension, sizeof(job->name));
+	snprintf(job->path, sizeof(job->path), "%s", getFullPath(job->name));
 
-    free(imgname);
+	free(imgname);
 	imgname = NULL;
-	
-    mister_scaler_free(ms);
 
-	if (video_get_rotated())
+	if (do_rescale)
 	{
-		//If the video is rotated, the scaled output resolution results in a squished image.
-		//Calculate the scaled output res using the original AR
-		scaled_width = scaled_height * ((float)base_width/base_height);
+		job->scaled_width = ms->output_width;
+		job->scaled_height = ms->output_height;
+
+		if (video_get_rotated())
+		{
+			//If the video is rotated, the scaled output resolution results in a squished image.
+			//Calculate the scaled output res using the original AR
+			job->scaled_width = job->scaled_height * ((float)job->width / job->height);
+		}
 	}
-	
-	char* filename_copy = strdup(filename);
-	
-	if (!filename_copy) {
-		screenshot_pending_atomic = false;
-		screenshot_rescale = 0;
+
+	if (!slot->argb) slot->argb = (uint8_t *)malloc(MISTER_SCALER_BUFFERSIZE);
+	if (!cfg.screenshot_direct && !slot->raw) slot->raw = (uint8_t *)malloc(MISTER_SCALER_BUFFERSIZE);
+	if (!slot->argb || (!cfg.screenshot_direct && !slot->raw))
+	{
+		mister_scaler_free(ms);
+		delete job;
 		return;
 	}
 
-	int do_rescale = screenshot_rescale;
-	offload_add_work([=]() {
-        save_screenshot(do_rescale, base_width, base_height, scaled_width, scaled_height, screenshot_outputbuf, filename_copy);
-    });
-	return;
+	const uint8_t *frame_start = (const uint8_t *)(ms->map + ms->map_off + ms->header);
+	if (cfg.screenshot_direct)
+	{
+		job->ms = ms;
+		job->src = frame_start;
+	}
+	else
+	{
+		memcpy(slot->raw, frame_start, frame);
+		mister_scaler_free(ms);
+		job->src = slot->raw;
+	}
+
+	job->grab_us = screenshot_us() - start;
+	slot->busy = true;
+
+	if (!offload_try_add_work([job]() { save_screenshot(job); },
+		[job](bool cancelled) { screenshot_done(job, cancelled); }))
+	{
+		// worker queue is full, drop the screenshot rather than stall the main loop
+		printf("Screenshot skipped: offload queue is full\n");
+		if (job->ms) mister_scaler_free(job->ms);
+		slot->busy = false;
+		delete job;
+	}
 }
 
 void request_screenshot(char *cmd, int scaled)
 {
-    if (screenshot_pending_atomic || screenshot_requested)
+    if (screenshot_requested || !screenshot_free_slot())
         return;
     
     if (!cmd) // guard against NULL
@@ -642,46 +884,10 @@ void request_screenshot(char *cmd, int scaled)
 
 void screenshot_cb(void)
 {
-    ScreenshotResult_atomic *result_data =
-        screenshot_result_data_atomic.exchange(nullptr);
-
-    if (result_data) {
-
-        switch (result_data->result)
-        {
-            case SCREENSHOT_SUCCESS:
-                if (result_data->filename)
-                {
-                    char msg[1024];
-                    snprintf(msg, sizeof(msg), "Screen saved to\n%s",
-                            result_data->filename + strlen(SCREENSHOT_DIR "/"));
-                    printf("%s\n", msg);
-                    Info(msg);
-                }
-                else
-                {
-                    printf("Screenshot saved\n");
-                    Info("Screenshot saved");
-                }
-                break;
-
-            case SCREENSHOT_FAILURE:
-                printf("Screenshot failed\n");
-                Info("Screenshot failed");
-                break;
-
-            default:
-                break;
-        }
-        free(result_data->filename);
-        free(result_data);
-    }
-
-	if (screenshot_requested && !screenshot_pending_atomic)
+	if (screenshot_requested)
 	{
 		char *imgname = screenshot_filename;
 		screenshot_filename = NULL;
 		do_screenshot(imgname);
 	}
-    
 }
@@ -1,5 +1,7 @@
 #include "scheduler.h"
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "libco.h"
 #include "menu.h"
 #include "user_io.h"
@@ -9,11 +11,46 @@
 #include "osd.h"
 #include "profiling.h"
 #include "video.h"
+#include "offload.h"
+#include "hardware.h"
+
+#define MAX_TASKS      8
+#define SLICE_BUCKETS  16     // 2us doubling, last one is everything above
+#define MAX_BOOST      16     // co_poll runs in a row before co_ui gets a turn
+#define STATS_FILE     "/tmp/SCHEDULER_STATS"
+
+struct sched_task_t
+{
+	const char *name;
+	cothread_t co;
+	void (*func)(void);
+	uint32_t period_us;
+	uint32_t budget_us;
+	uint64_t next_run;
+
+	uint64_t total_us;
+	uint32_t slices;
+	uint32_t over;
+	uint32_t max_us;
+	uint32_t hist[SLICE_BUCKETS];
+};
 
 static cothread_t co_scheduler = nullptr;
-static cothread_t co_poll = nullptr;
-static cothread_t co_ui = nullptr;
-static cothread_t co_last = nullptr;
+static sched_task_t tasks[MAX_TASKS] = {};
+static int task_num = 2;   // 0 is co_poll, 1 is co_ui
+static int task_cur = 0;
+
+static bool io_pending = false;
+static uint32_t poll_boost = 0;
+static uint32_t boosts = 0;
+static unsigned long stats_timer = 0;
+
+static uint64_t time_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 static void scheduler_wait_fpga_ready(void)
 {
@@ -35,6 +72,7 @@ static void scheduler_co_poll(void)
 			frame_timer();
 			input_poll(0);
 			video_poll();
+			offload_poll();
 		}
 
 		scheduler_yield();
@@ -55,26 +93,138 @@ static void scheduler_co_ui(void)
 	}
 }
 
-static void scheduler_schedule(void)
+static void scheduler_co_task(void)
 {
-	if (co_last == co_poll)
+	sched_task_t *task = &tasks[task_cur];
+	for (;;)
 	{
-		co_last = co_ui;
-		co_switch(co_ui);
+		if (is_fpga_ready(1)) task->func();
+		scheduler_yield();
 	}
-	else
+}
+
+static bool create_task(sched_task_t *task, const char *name, void (*entry)(void), void (*func)(void), uint32_t period_us, uint32_t budget_us)
+{
+	const unsigned int co_stack_size = 262144 * sizeof(void*);
+
+	task->name = name;
+	task->func = func;
+	task->period_us = period_us;
+	task->budget_us = budget_us;
+
+	// the coroutine finds its task through task_cur on the first switch
+	task->co = co_create(co_stack_size, entry);
+	if (!task->co) printf("Scheduler: cannot create %s.\n", name);
+	return task->co != nullptr;
+}
+
+static void account(sched_task_t *task, uint32_t us)
+{
+	task->total_us += us;
+	task->slices++;
+	if (us > task->max_us) task->max_us = us;
+	if (task->budget_us && us > task->budget_us) task->over++;
+
+	int b = 0;
+	while (b < SLICE_BUCKETS - 1 && us >= (2u << b)) b++;
+	task->hist[b]++;
+}
+
+static uint32_t percentile(const sched_task_t *task, uint32_t pct)
+{
+	uint32_t limit = (uint32_t)((uint64_t)task->slices * pct / 100);
+	uint32_t sum = 0;
+	for (int b = 0; b < SLICE_BUCKETS - 1; b++)
+	{
+		sum += task->hist[b];
+		if (sum > limit) return ((2u << b) < task->max_us) ? (2u << b) : task->max_us;
+	}
+	return task->max_us;
+}
+
+void scheduler_print_stats(FILE *f)
+{
+	fprintf(f, "%-16s %10s %10s %8s %8s %8s %8s\n", "task", "slices", "total ms", "p50 us", "p99 us", "max us", "over");
+	for (int i = 0; i < task_num; i++)
 	{
-		co_last = co_poll;
-		co_switch(co_poll);
+		sched_task_t *task = &tasks[i];
+		fprintf(f, "%-16s %10u %10llu %8u %8u %8u %8u\n", task->name, task->slices, (unsigned long long)(task->total_us / 1000),
+			percentile(task, 50), percentile(task, 99), task->max_us, task->over);
 	}
+	fprintf(f, "co_poll boosts for pending I/O: %u\n", boosts);
+}
+
+static void stats_report()
+{
+	if (stats_timer && !CheckTimer(stats_timer)) return;
+	stats_timer = GetTimer(5000);
+
+	FILE *f = fopen(STATS_FILE, "w");
+	if (!f) return;
+	scheduler_print_stats(f);
+	fclose(f);
+}
+
+// co_poll and co_ui alternate, other tasks are run in between once their
+// period has passed. A pending IDE/CD/SD request gets co_poll straight back,
+// up to MAX_BOOST times before co_ui has to run.
+static sched_task_t *scheduler_next(uint64_t now)
+{
+	if (io_pending && poll_boost < MAX_BOOST)
+	{
+		io_pending = false;
+		poll_boost++;
+		boosts++;
+		task_cur = 0;
+		return &tasks[0];
+	}
+	io_pending = false;
+
+	for (int n = 0; n < task_num; n++)
+	{
+		task_cur = (task_cur + 1) % task_num;
+		sched_task_t *task = &tasks[task_cur];
+		if (task->period_us && now < task->next_run) continue;
+
+		if (task->period_us) task->next_run = now + task->period_us;
+		if (task_cur == 1) poll_boost = 0;
+		return task;
+	}
+
+	return &tasks[0];
+}
+
+static void scheduler_schedule(void)
+{
+	uint64_t start = time_us();
+	sched_task_t *task = scheduler_next(start);
+
+	co_switch(task->co);
+	account(task, (uint32_t)(time_us() - start));
 }
 
 void scheduler_init(void)
 {
-	const unsigned int co_stack_size = 262144 * sizeof(void*);
+	create_task(&tasks[0], "co_poll", scheduler_co_poll, scheduler_co_poll, 0, 1000);
+	input_thread_start();
+	create_task(&tasks[1], "co_ui", scheduler_co_ui, scheduler_co_ui, 0, 1000);
+}
 
-	co_poll = co_create(co_stack_size, scheduler_co_poll);
-	co_ui = co_create(co_stack_size, scheduler_co_ui);
+void scheduler_add(const char *name, void (*poll)(void), uint32_t period_us, uint32_t budget_us)
+{
+	for (int i = 2; i < task_num; i++) if (tasks[i].func == poll) return;
+	if (task_num >= MAX_TASKS)
+	{
+		printf("Scheduler: no room for %s.\n", name);
+		return;
+	}
+
+	if (create_task(&tasks[task_num], name, scheduler_co_task, poll, period_us, budget_us)) task_num++;
+}
+
+void scheduler_io_pending(void)
+{
+	io_pending = true;
 }
 
 void scheduler_run(void)
@@ -84,10 +234,10 @@ void scheduler_run(void)
 	for (;;)
 	{
 		scheduler_schedule();
+		stats_report();
 	}
 
-	co_delete(co_ui);
-	co_delete(co_poll);
+	for (int i = 0; i < task_num; i++) if (tasks[i].co) co_delete(tasks[i].co);
 	co_delete(co_scheduler);
 }
 
@@ -1,10 +1,23 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
+#include <inttypes.h>
+#include <stdio.h>
+
 #define USE_SCHEDULER
 
 void scheduler_init(void);
 void scheduler_run(void);
 void scheduler_yield(void);
 
+// Run poll() in its own coroutine, at most every period_us (0 = every round).
+// Slices longer than budget_us are counted in the stats. May be called before scheduler_init.
+void scheduler_add(const char *name, void (*poll)(void), uint32_t period_us, uint32_t budget_us);
+
+// An IDE/CD/SD request is being served, give co_poll the next slice.
+void scheduler_io_pending(void);
+
+// Per task slice statistics, also written to /tmp/SCHEDULER_STATS every 5s.
+void scheduler_print_stats(FILE *f);
+
 #endif
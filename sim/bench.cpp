@@ -0,0 +1,146 @@
+// File transfer benchmark for host builds: MiSTer --bench [options] file [file...]
+//   -r <runs>    runs per file and chunk size (default 5)
+//   -c <sizes>   comma separated list of chunk sizes (default 4096)
+//   -x <index>   file index as sent by OSD (default 1)
+//   -a <addr>    load address (hex), file goes through DDR instead of SPI
+//   -m           composite file (MiSTer header)
+//   -s           serial upload (no read ahead thread)
+// The core specific loaders are selected by MISTER_SIM_CONFSTR as usual (e.g. "SNES;").
+// Files in zip archives are given as path/archive.zip/name.
+// Results go to stderr since stdout is muted unless debug is enabled in MiSTer.ini.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <vector>
+
+#include "../fpga_io.h"
+#include "../user_io.h"
+#include "../file_io.h"
+#include "sim.h"
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void bench_file(const char *name, uint32_t chunk, int runs, int index, uint32_t addr, int composite)
+{
+	fileTYPE f = {};
+	if (!FileOpen(&f, name, 1))
+	{
+		fprintf(stderr, "%s: cannot open\n", name);
+		return;
+	}
+	uint64_t size = f.size;
+	FileClose(&f);
+
+	user_io_set_file_tx_chunk(chunk);
+
+	std::vector<uint32_t> lat;
+	uint64_t total_us = 0, best_us = 0;
+	int done = 0;
+
+	for (int i = 0; i < runs; i++)
+	{
+		sim_fio_reset();
+
+		uint64_t start = now_us();
+		if (!user_io_file_tx(name, index, 0, 1, composite, addr))
+		{
+			fprintf(stderr, "%s: load failed\n", name);
+			break;
+		}
+		uint64_t us = now_us() - start;
+		if (!us) us = 1;
+
+		// count what was actually sent over SPI (headers, mirroring etc.)
+		if (sim_fio_bytes()) size = sim_fio_bytes();
+
+		total_us += us;
+		if (!best_us || us < best_us) best_us = us;
+		done++;
+
+		std::vector<uint32_t> &l = sim_fio_latency();
+		lat.insert(lat.end(), l.begin(), l.end());
+	}
+
+	if (!done) return;
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	fprintf(stderr, "%s, chunk %u: %llu bytes, %.2f MB/s avg, %.2f MB/s best, maxrss %ldKB\n", name, chunk,
+		(unsigned long long)size, (double)size * done / total_us, (double)size / best_us, ru.ru_maxrss);
+
+	if (!lat.empty())
+	{
+		std::sort(lat.begin(), lat.end());
+		uint64_t sum = 0;
+		for (uint32_t v : lat) sum += v;
+
+		fprintf(stderr, "  %u chunks/run, latency avg %lluus p50 %uus p99 %uus max %uus\n",
+			(uint32_t)(lat.size() / done), (unsigned long long)(sum / lat.size()),
+			lat[lat.size() / 2], lat[lat.size() * 99 / 100], lat.back());
+	}
+}
+
+int sim_bench(int argc, char *argv[])
+{
+	int runs = 5;
+	int index = 1;
+	int composite = 0;
+	uint32_t addr = 0;
+	std::vector<uint32_t> chunks;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "r:c:x:a:ms")) != -1)
+	{
+		switch (opt)
+		{
+		case 'r':
+			runs = atoi(optarg);
+			break;
+
+		case 'c':
+			for (char *p = strtok(optarg, ","); p; p = strtok(0, ",")) chunks.push_back(strtoul(p, 0, 0));
+			break;
+
+		case 'x':
+			index = atoi(optarg);
+			break;
+
+		case 'a':
+			addr = strtoul(optarg, 0, 16);
+			break;
+
+		case 'm':
+			composite = 1;
+			break;
+
+		case 's':
+			user_io_set_file_tx_pipeline(0);
+			break;
+
+		default:
+			fprintf(stderr, "Usage: %s --bench [-r runs] [-c chunk,chunk...] [-x index] [-a addr] [-m] [-s] file...\n", getappname());
+			return 1;
+		}
+	}
+
+	if (chunks.empty()) chunks.push_back(4096);
+	if (runs < 1) runs = 1;
+
+	for (int i = optind; i < argc; i++)
+	{
+		for (uint32_t chunk : chunks) bench_file(argv[i], chunk, runs, index, addr, composite);
+	}
+
+	return 0;
+}
@@ -0,0 +1,618 @@
+// Simulated FPGA bridge for host builds (make SIM=1).
+// Replaces fpga_io.cpp: SPI words are answered by a simple model of the core side
+// of hps_io, so the main loop, menu, file transfers and disk emulation can run
+// (and be profiled) on a normal Linux box.
+//
+// Environment:
+//   MISTER_SIM_CORE     core type reported by the FPGA (default A4 - 8bit core)
+//   MISTER_SIM_CONFSTR  config string returned by UIO_GET_STRING (default "MENU;")
+//   MISTER_SIM_FIO      1 - 16bit file I/O (default), 0 - 8bit
+//   MISTER_SIM_SCRIPT   file with the stream of core requests, one per line:
+//       delay <ms>                       - pause before the next request
+//       ide <port> <op> <lba> <count>    - IDE command, op is read/write/readm/writem or command code
+//       sd <disk> <read|write> <lba> <blocks>
+//                                        - SD card request through UIO_GET_SDSTAT (512 byte blocks)
+//       uio <cmd> <word> [word...]       - raw answer (hex) for the next transfer of UIO command
+//                                          (UIO_CD_GET etc.), first word answers the command itself
+//       loop                             - start the script over
+//       quit                             - print statistics and exit
+//   Every request is issued after the previous one has been serviced, so timings are reproducible.
+//
+// Storage is expected at /media/fat as usual (a symlink is enough). Set debug=1 in MiSTer.ini to get the log.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <vector>
+
+#include "../fpga_io.h"
+#include "../user_io.h"
+#include "../input.h"
+#include "../ide.h"
+#include "../ide_cache.h"
+#include "../offload.h"
+#include "sim.h"
+
+#define SSPI_FPGA_EN (1<<18)
+#define SSPI_OSD_EN  (1<<19)
+#define SSPI_IO_EN   (1<<20)
+
+#define IDE0_BASE 0xF000
+#define IDE1_BASE 0xF100
+
+enum
+{
+	REQ_DELAY,
+	REQ_IDE,
+	REQ_SD,
+	REQ_UIO,
+	REQ_LOOP,
+	REQ_QUIT,
+
+	REQ_COUNT
+};
+
+struct sim_req_t
+{
+	int type;
+	int port;
+	int op;
+	uint32_t lba;
+	uint32_t cnt;
+	std::vector<uint16_t> words;
+};
+
+struct sim_ide_t
+{
+	uint32_t cmd_regs[3]; // read by ide_get_regs()
+	uint16_t regs[6];     // written by ide_set_regs()
+	int req;
+	bool busy;
+};
+
+static int core_type = CORE_TYPE_8BIT;
+static int fio_size = 1;
+static const char *sim_confstr = "MENU;";
+
+static uint32_t spi_en = 0;
+static int core_reset = 0;
+
+// current transfer
+static uint16_t xfer_cmd;
+static uint32_t xfer_pos;
+static uint32_t xfer_addr;
+
+static std::vector<sim_req_t> script;
+static uint32_t script_pos = 0;
+static sim_req_t *cur_req = nullptr;
+static struct timespec req_start;
+static struct timespec delay_end;
+static bool delaying = false;
+
+static std::vector<uint32_t> fio_latency;
+static struct timespec fio_last;
+
+static sim_ide_t ide[2] = {};
+static uint16_t sd_stat = 0;
+static uint32_t sd_lba = 0;
+
+static struct
+{
+	uint32_t count[REQ_COUNT];
+	uint32_t errors[REQ_COUNT];
+	uint64_t us_total[REQ_COUNT];
+	uint32_t us_max[REQ_COUNT];
+	uint64_t io_words;
+	uint64_t dma_bytes;
+	uint64_t fio_bytes;
+	uint64_t osd_bytes;
+} stats = {};
+
+static uint32_t elapsed_us(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)((now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000);
+}
+
+static void print_stats()
+{
+	static const char *names[REQ_COUNT] = { "delay", "ide", "sd", "uio", "loop", "quit" };
+
+	printf("Sim: %llu I/O words, %llu DMA bytes, %llu file I/O bytes, %llu OSD bytes\n",
+		(unsigned long long)stats.io_words, (unsigned long long)stats.dma_bytes,
+		(unsigned long long)stats.fio_bytes, (unsigned long long)stats.osd_bytes);
+
+	for (int i = REQ_IDE; i <= REQ_UIO; i++)
+	{
+		if (!stats.count[i]) continue;
+		printf("  %-4s: %u requests, %u errors, avg %uus max %uus\n", names[i], stats.count[i], stats.errors[i],
+			(uint32_t)(stats.us_total[i] / stats.count[i]), stats.us_max[i]);
+	}
+}
+
+static void req_done(int err)
+{
+	uint32_t us = elapsed_us(&req_start);
+	stats.count[cur_req->type]++;
+	if (err) stats.errors[cur_req->type]++;
+	stats.us_total[cur_req->type] += us;
+	if (stats.us_max[cur_req->type] < us) stats.us_max[cur_req->type] = us;
+	cur_req = nullptr;
+}
+
+static void ide_issue(sim_req_t *req)
+{
+	sim_ide_t *drv = &ide[req->port];
+
+	// LBA28 mode, drive 0
+	drv->cmd_regs[0] = ((req->cnt & 0xFF) << 16) | ((req->lba & 0xFF) << 24);
+	drv->cmd_regs[1] = (req->lba >> 8) & 0xFFFF;
+	drv->cmd_regs[2] = (((req->lba >> 24) & 0xF) << 16) | (1 << 22) | (req->op << 24);
+	drv->req = 4;
+	drv->busy = true;
+}
+
+// called after ide_set_regs() has been received
+static void ide_status(sim_ide_t *drv)
+{
+	if (!drv->busy) return;
+
+	uint8_t status = drv->regs[5] >> 8;
+	if ((status & ATA_STATUS_ERR) || !(status & ATA_STATUS_DRQ) || (status & ATA_STATUS_END))
+	{
+		drv->busy = false;
+		drv->req = 0;
+		req_done(status & ATA_STATUS_ERR);
+	}
+	else
+	{
+		// more data to transfer
+		drv->req = 5;
+	}
+}
+
+static void script_step()
+{
+	if (cur_req || script.empty()) return;
+
+	if (delaying)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec < delay_end.tv_sec || (now.tv_sec == delay_end.tv_sec && now.tv_nsec < delay_end.tv_nsec)) return;
+		delaying = false;
+	}
+
+	if (script_pos >= script.size()) return;
+
+	sim_req_t *req = &script[script_pos++];
+	switch (req->type)
+	{
+	case REQ_DELAY:
+		clock_gettime(CLOCK_MONOTONIC, &delay_end);
+		delay_end.tv_sec += req->lba / 1000;
+		delay_end.tv_nsec += (req->lba % 1000) * 1000000;
+		if (delay_end.tv_nsec >= 1000000000)
+		{
+			delay_end.tv_sec++;
+			delay_end.tv_nsec -= 1000000000;
+		}
+		delaying = true;
+		return;
+
+	case REQ_LOOP:
+		script_pos = 0;
+		return;
+
+	case REQ_QUIT:
+		ide_cache_flush_all();
+		print_stats();
+		exit(0);
+
+	case REQ_IDE:
+		ide_issue(req);
+		break;
+
+	case REQ_SD:
+		sd_stat = 0x8000 | (((req->cnt - 1) & 0x3F) << 9) | (2 << 6) | ((req->port & 0xF) << 2) | req->op;
+		break;
+	}
+
+	cur_req = req;
+	clock_gettime(CLOCK_MONOTONIC, &req_start);
+}
+
+static void load_script(const char *name)
+{
+	FILE *f = fopen(name, "r");
+	if (!f)
+	{
+		printf("Sim: cannot open script %s\n", name);
+		return;
+	}
+
+	char line[1024];
+	int num = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		num++;
+
+		char *p = line;
+		while (isspace(*p)) p++;
+		if (!*p || *p == '#') continue;
+
+		sim_req_t req = {};
+		char cmd[16] = {}, op[16] = {};
+		int n = 0;
+		sscanf(p, "%15s%n", cmd, &n);
+		p += n;
+
+		bool ok = true;
+		if (!strcmp(cmd, "delay"))
+		{
+			req.type = REQ_DELAY;
+			ok = sscanf(p, "%u", &req.lba) == 1;
+		}
+		else if (!strcmp(cmd, "ide"))
+		{
+			req.type = REQ_IDE;
+			ok = sscanf(p, "%d %15s %u %u", &req.port, op, &req.lba, &req.cnt) == 4 && req.port >= 0 && req.port <= 1 && req.cnt && req.cnt <= 255;
+			if (!strcmp(op, "read")) req.op = 0x20;
+			else if (!strcmp(op, "readm")) req.op = 0xC4;
+			else if (!strcmp(op, "write")) req.op = 0x30;
+			else if (!strcmp(op, "writem")) req.op = 0xC5;
+			else req.op = strtoul(op, 0, 16);
+		}
+		else if (!strcmp(cmd, "sd"))
+		{
+			req.type = REQ_SD;
+			ok = sscanf(p, "%d %15s %u %u", &req.port, op, &req.lba, &req.cnt) == 4 && req.cnt && req.cnt <= 64;
+			req.op = strcmp(op, "write") ? 1 : 2;
+		}
+		else if (!strcmp(cmd, "uio"))
+		{
+			req.type = REQ_UIO;
+			uint32_t val;
+			ok = sscanf(p, "%x%n", &req.port, &n) == 1;
+			p += n;
+			while (ok && sscanf(p, "%x%n", &val, &n) == 1)
+			{
+				req.words.push_back(val);
+				p += n;
+			}
+			ok = ok && !req.words.empty();
+		}
+		else if (!strcmp(cmd, "loop")) req.type = REQ_LOOP;
+		else if (!strcmp(cmd, "quit")) req.type = REQ_QUIT;
+		else ok = false;
+
+		if (ok) script.push_back(req);
+		else printf("Sim: %s:%d: invalid line\n", name, num);
+	}
+
+	fclose(f);
+	printf("Sim: %d requests in script %s\n", (int)script.size(), name);
+}
+
+static uint16_t io_word(uint16_t word)
+{
+	stats.io_words++;
+
+	if (!xfer_pos)
+	{
+		xfer_cmd = word & 0xFF;
+		script_step();
+
+		switch (xfer_cmd)
+		{
+		case UIO_GET_SDSTAT:
+			// previous request is serviced once the core is polled again
+			if (cur_req && cur_req->type == REQ_SD && !sd_stat) req_done(0);
+			if (sd_stat)
+			{
+				uint16_t res = sd_stat;
+				sd_lba = cur_req->lba;
+				sd_stat = 0;
+				return res;
+			}
+			return 0;
+		}
+
+		if (cur_req && cur_req->type == REQ_UIO && cur_req->port == xfer_cmd) return cur_req->words[0];
+		return 0;
+	}
+
+	uint32_t pos = xfer_pos - 1;
+	switch (xfer_cmd)
+	{
+	case UIO_GET_SDSTAT:
+		if (pos == 1) return (uint16_t)sd_lba;
+		if (pos == 2) return (uint16_t)(sd_lba >> 16);
+		return 0;
+
+	case UIO_GET_STRING:
+		return (pos < strlen(sim_confstr)) ? (uint8_t)sim_confstr[pos] : 0;
+
+	case UIO_DMA_SDIO:
+		if (!pos)
+		{
+			uint16_t res = ide[0].req | (ide[1].req << 3);
+			ide[0].req = 0;
+			ide[1].req = 0;
+			return res;
+		}
+		return 0;
+
+	case UIO_DMA_WRITE:
+	case UIO_DMA_READ:
+		if (pos == 0) xfer_addr = word;
+		else if (pos == 1) xfer_addr |= word << 16;
+		else
+		{
+			uint32_t ofs = pos - 2;
+			int port = (xfer_addr & ~0xFF) == IDE1_BASE;
+			if ((xfer_addr & ~0xFF) != IDE0_BASE && !port) return 0;
+
+			sim_ide_t *drv = &ide[port];
+			uint32_t reg = xfer_addr & 0xFF;
+			stats.dma_bytes += 2;
+
+			if (xfer_cmd == UIO_DMA_WRITE)
+			{
+				if (!reg && ofs < 6) drv->regs[ofs] = word;
+			}
+			else if (!reg && ofs < 6)
+			{
+				return (uint16_t)(drv->cmd_regs[ofs / 2] >> ((ofs & 1) * 16));
+			}
+			else if (reg == 255)
+			{
+				// data for write commands
+				return (uint16_t)(ofs * 0x0101);
+			}
+		}
+		return 0;
+	}
+
+	if (cur_req && cur_req->type == REQ_UIO && cur_req->port == xfer_cmd && xfer_pos < cur_req->words.size())
+	{
+		return cur_req->words[xfer_pos];
+	}
+
+	return 0;
+}
+
+static void io_end()
+{
+	if (xfer_cmd == UIO_DMA_WRITE && xfer_pos >= 9 && !(xfer_addr & 0xFF))
+	{
+		if ((xfer_addr & ~0xFF) == IDE0_BASE) ide_status(&ide[0]);
+		if ((xfer_addr & ~0xFF) == IDE1_BASE) ide_status(&ide[1]);
+	}
+
+	if (cur_req && cur_req->type == REQ_UIO && cur_req->port == xfer_cmd) req_done(0);
+}
+
+static void fio_end()
+{
+	if (xfer_cmd == FIO_FILE_TX_DAT) fio_latency.push_back(elapsed_us(&fio_last));
+	if (xfer_cmd == FIO_FILE_TX || xfer_cmd == FIO_FILE_TX_DAT) clock_gettime(CLOCK_MONOTONIC, &fio_last);
+}
+
+std::vector<uint32_t> &sim_fio_latency()
+{
+	return fio_latency;
+}
+
+uint64_t sim_fio_bytes()
+{
+	return stats.fio_bytes;
+}
+
+void sim_fio_reset()
+{
+	fio_latency.clear();
+	stats.fio_bytes = 0;
+}
+
+static uint16_t sim_xfer(uint16_t word)
+{
+	uint16_t res = 0;
+
+	if (spi_en & SSPI_OSD_EN) stats.osd_bytes++;
+	else if (spi_en & SSPI_IO_EN) res = io_word(word);
+	else if (spi_en & SSPI_FPGA_EN)
+	{
+		if (xfer_pos && (xfer_cmd == FIO_FILE_TX_DAT)) stats.fio_bytes += fio_size ? 2 : 1;
+		else if (!xfer_pos) xfer_cmd = word & 0xFF;
+	}
+
+	xfer_pos++;
+	return res;
+}
+
+int fpga_io_init()
+{
+	const char *str;
+	if ((str = getenv("MISTER_SIM_CORE"))) core_type = strtoul(str, 0, 16);
+	if ((str = getenv("MISTER_SIM_CONFSTR"))) sim_confstr = str;
+	if ((str = getenv("MISTER_SIM_FIO"))) fio_size = atoi(str) ? 1 : 0;
+	if ((str = getenv("MISTER_SIM_SCRIPT"))) load_script(str);
+
+	printf("Sim: core type %02X, confstr \"%s\"\n", core_type, sim_confstr);
+	return 0;
+}
+
+void fpga_spi_en(uint32_t mask, uint32_t en)
+{
+	if (en)
+	{
+		spi_en |= mask;
+		xfer_pos = 0;
+		xfer_cmd = 0;
+	}
+	else
+	{
+		if (!(spi_en & SSPI_OSD_EN) && xfer_pos)
+		{
+			if (spi_en & SSPI_IO_EN) io_end();
+			else if (spi_en & SSPI_FPGA_EN) fio_end();
+		}
+		spi_en &= ~mask;
+	}
+}
+
+uint16_t fpga_spi(uint16_t word)
+{
+	return sim_xfer(word);
+}
+
+uint16_t fpga_spi_fast(uint16_t word)
+{
+	return sim_xfer(word);
+}
+
+void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length)
+{
+	while (length--) sim_xfer(*buf++);
+}
+
+void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
+{
+	while (length--) *buf++ = sim_xfer(0);
+}
+
+void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
+{
+	while (length--) sim_xfer(*buf++);
+}
+
+void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
+{
+	while (length--) *buf++ = (uint8_t)sim_xfer(0);
+}
+
+void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length)
+{
+	while (length--)
+	{
+		uint16_t tmp = *buf++;
+		sim_xfer((tmp << 8) | (tmp >> 8));
+	}
+}
+
+void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length)
+{
+	while (length--)
+	{
+		uint16_t tmp = sim_xfer(0);
+		*buf++ = (tmp << 8) | (tmp >> 8);
+	}
+}
+
+void fpga_set_led(uint32_t)
+{
+}
+
+int fpga_get_buttons()
+{
+	return 0;
+}
+
+int fpga_get_io_type()
+{
+	return 0;
+}
+
+int fpga_get_hdmi_int()
+{
+	return 0;
+}
+
+void fpga_core_reset(int reset)
+{
+	core_reset = reset;
+}
+
+void fpga_core_write(uint32_t, uint32_t)
+{
+}
+
+uint32_t fpga_core_read(uint32_t)
+{
+	return 0;
+}
+
+int fpga_core_id()
+{
+	return core_type & 0xFF;
+}
+
+int is_fpga_ready(int)
+{
+	return 1;
+}
+
+int fpga_get_fio_size()
+{
+	return fio_size;
+}
+
+int fpga_get_io_version()
+{
+	return 0;
+}
+
+int fpga_load_rbf(const char *name, const char *, const char *xml)
+{
+	printf("Sim: loading RBF %s\n", name);
+	app_restart(name, xml);
+	return 0;
+}
+
+void reboot(int cold)
+{
+	printf("Sim: %s reboot\n", cold ? "cold" : "warm");
+	ide_cache_flush_all();
+	print_stats();
+	exit(0);
+}
+
+char *getappname()
+{
+	static char dest[PATH_MAX];
+	memset(dest, 0, sizeof(dest));
+	readlink("/proc/self/exe", dest, PATH_MAX - 1);
+	return dest;
+}
+
+void app_restart(const char *path, const char *xml, const char *exe)
+{
+	ide_cache_flush_all();
+	sync();
+	fpga_core_reset(1);
+
+	input_switch(0);
+	input_uinp_destroy();
+
+	offload_stop();
+	print_stats();
+
+	// stay in the same process so profilers keep following it
+	const char *appname = exe ? exe : getappname();
+	printf("restarting to %s\n", appname);
+	execl(appname, appname, path, xml, NULL);
+
+	printf("Something went wrong.\n");
+	_exit(1);
+}
+
+void fpga_wait_to_reset()
+{
+	printf("Sim: FPGA is never reset.\n");
+	exit(0);
+}
@@ -0,0 +1,64 @@
+// Simulated DDR for host builds (make SIM=1). Replaces shmem.cpp.
+// The whole 1GB of HPS address space is backed by anonymous memory which is
+// only committed when touched, so data persists between mappings like on real DDR.
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../shmem.h"
+
+#define SIM_MEM_SIZE 0x40000000ULL
+
+static uint8_t *mem = 0;
+
+void *shmem_map(uint32_t address, uint32_t size)
+{
+	if (!mem)
+	{
+		void *res = mmap(0, SIM_MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (res == MAP_FAILED)
+		{
+			printf("Error: Unable to allocate simulated memory!\n");
+			return 0;
+		}
+		mem = (uint8_t *)res;
+	}
+
+	if ((uint64_t)address + size > SIM_MEM_SIZE)
+	{
+		printf("Error: Unable to mmap (0x%X, %d)!\n", address, size);
+		return 0;
+	}
+
+	return mem + address;
+}
+
+int shmem_unmap(void*, uint32_t)
+{
+	return 1;
+}
+
+int shmem_put(uint32_t address, uint32_t size, void *buf)
+{
+	void *shmem = shmem_map(address, size);
+	if (shmem)
+	{
+		memcpy(shmem, buf, size);
+		shmem_unmap(shmem, size);
+	}
+
+	return shmem != 0;
+}
+
+int shmem_get(uint32_t address, uint32_t size, void *buf)
+{
+	void *shmem = shmem_map(address, size);
+	if (shmem)
+	{
+		memcpy(buf, shmem, size);
+		shmem_unmap(shmem, size);
+	}
+
+	return shmem != 0;
+}
@@ -0,0 +1,15 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <inttypes.h>
+#include <vector>
+
+// Time in us of every FIO_FILE_TX_DAT transfer since the previous one (or since
+// start of download), i.e. the time it took to produce and send the chunk.
+std::vector<uint32_t> &sim_fio_latency();
+uint64_t sim_fio_bytes();
+void sim_fio_reset();
+
+int sim_bench(int argc, char *argv[]);
+
+#endif
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include "spi.h"
 #include "hardware.h"
 #include "fpga_io.h"
@@ -8,14 +9,73 @@
 
 #define SWAPW(a) ((((a)<<8)&0xff00)|(((a)>>8)&0x00ff))
 
+// Once another thread talks to the FPGA, every transaction (enable to
+// disable) is done under a lock. Enable bits are tracked per thread since
+// not all callers pair Enable/Disable exactly.
+static pthread_mutex_t spi_mutex;
+static bool spi_shared = false;
+static __thread uint32_t spi_en_bits = 0;
+static __thread int spi_lock_depth = 0;
+
+void spi_set_shared()
+{
+	if (spi_shared) return;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&spi_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	spi_shared = true;
+}
+
+uint32_t spi_max_transfer()
+{
+	return spi_shared ? 4096 : UINT32_MAX;
+}
+
+void spi_lock()
+{
+	if (!spi_shared) return;
+	if (!spi_en_bits && !spi_lock_depth) pthread_mutex_lock(&spi_mutex);
+	spi_lock_depth++;
+}
+
+void spi_unlock()
+{
+	if (!spi_shared || !spi_lock_depth) return;
+	if (!--spi_lock_depth && !spi_en_bits) pthread_mutex_unlock(&spi_mutex);
+}
+
+static void spi_enable(uint32_t mask)
+{
+	if (spi_shared)
+	{
+		if (!spi_en_bits && !spi_lock_depth) pthread_mutex_lock(&spi_mutex);
+		spi_en_bits |= mask;
+	}
+	fpga_spi_en(mask, 1);
+}
+
+static void spi_disable(uint32_t mask)
+{
+	fpga_spi_en(mask, 0);
+	if (spi_shared && spi_en_bits)
+	{
+		spi_en_bits &= ~mask;
+		if (!spi_en_bits && !spi_lock_depth) pthread_mutex_unlock(&spi_mutex);
+	}
+}
+
 void EnableFpga()
 {
-	fpga_spi_en(SSPI_FPGA_EN, 1);
+	spi_enable(SSPI_FPGA_EN);
 }
 
 void DisableFpga()
 {
-	fpga_spi_en(SSPI_FPGA_EN, 0);
+	spi_disable(SSPI_FPGA_EN);
 }
 
 static int osd_target = OSD_ALL;
@@ -26,6 +86,11 @@ void EnableOsd_on(int target)
 	osd_target = target;
 }
 
+int spi_osd_target()
+{
+	return osd_target;
+}
+
 void EnableOsd()
 {
 	if (!(osd_target & OSD_ALL)) osd_target = OSD_ALL;
@@ -34,22 +99,22 @@ void EnableOsd()
 	if (osd_target & OSD_HDMI) mask &= ~SSPI_FPGA_EN;
 	if (osd_target & OSD_VGA) mask &= ~SSPI_IO_EN;
 
-	fpga_spi_en(mask, 1);
+	spi_enable(mask);
 }
 
 void DisableOsd()
 {
-	fpga_spi_en(SSPI_OSD_EN | SSPI_IO_EN | SSPI_FPGA_EN, 0);
+	spi_disable(SSPI_OSD_EN | SSPI_IO_EN | SSPI_FPGA_EN);
 }
 
 void EnableIO()
 {
-	fpga_spi_en(SSPI_IO_EN, 1);
+	spi_enable(SSPI_IO_EN);
 }
 
 void DisableIO()
 {
-	fpga_spi_en(SSPI_IO_EN, 0);
+	spi_disable(SSPI_IO_EN);
 }
 
 uint32_t spi32_w(uint32_t parm)
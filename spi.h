@@ -8,6 +8,16 @@
 #define OSD_VGA  2
 #define OSD_ALL  (OSD_VGA|OSD_HDMI)
 
+// Serialize FPGA access between threads, off until spi_set_shared() is called.
+// Enable*/Disable* lock implicitly, spi_lock() is for other register access.
+void spi_set_shared();
+void spi_lock();
+void spi_unlock();
+
+// Longest data phase to send in one transaction. Bulk transfers are split to
+// this size while the bus is shared, so the input thread isn't held up.
+uint32_t spi_max_transfer();
+
 /* chip select functions */
 void EnableFpga();
 void DisableFpga();
@@ -46,6 +56,7 @@ void spi_block_write(const uint8_t *addr, int wide, int sz = 512);
 
 /* OSD related SPI functions */
 void EnableOsd_on(int target);
+int spi_osd_target();
 void spi_osd_cmd_cont(uint8_t cmd);
 void spi_osd_cmd(uint8_t cmd);
 void spi_osd_cmd8_cont(uint8_t cmd, uint8_t parm);
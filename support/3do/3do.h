@@ -57,8 +57,6 @@ private:
 	uint8_t stat[8];
 	uint8_t comm[8];
 	uint8_t cd_buf[4096 + 2];
-	int chd_hunknum;
-	uint8_t *chd_hunkbuf;
 
 	int LoadCUE(const char* filename);
 	int LoadISO(const char* filename);
@@ -6,6 +6,7 @@
 
 #include "3do.h"
 #include "../chd/mister_chd.h"
+#include "../../cd_cache.h"
 
 p3docdd_t p3docdd;
 
@@ -19,8 +20,6 @@ p3docdd_t::p3docdd_t() {
 	track = 0;
 	lba = 0;
 	speed = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
 	SendData = NULL;
 }
 
@@ -341,13 +340,6 @@ int p3docdd_t::Load(const char *filename)
 			return -1;
 		}
 
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
 		if (this->toc.tracks[0].sector_size)
 		{
 			this->sectorSize = this->toc.tracks[0].sector_size;
@@ -359,7 +351,7 @@ int p3docdd_t::Load(const char *filename)
 
 	/*if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header);
 	}
 	else {
 		fd_img = &this->toc.tracks[0].f;
@@ -395,13 +387,7 @@ void p3docdd_t::Unload()
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
-		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
+			mister_chd_close(this->toc.chd_f);
 		}
 
 		for (int i = 0; i < this->toc.last; i++)
@@ -687,19 +673,17 @@ void p3docdd_t::ReadData(uint8_t *buf)
 				read_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->sectorSize, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->sectorSize, buf);
 		}
 		else {
 			if (this->sectorSize == 2048)
 			{
 				offs = (lba_ * 2048) - this->toc.tracks[this->track].offset;
-				FileSeek(&this->toc.tracks[this->track].f, offs, SEEK_SET);
-				FileReadAdv(&this->toc.tracks[this->track].f, buf + 16, 2048);
+				cdcache_read_file(&this->toc.tracks[this->track].f, offs, buf + 16, 2048);
 			}
 			else {
 				offs = (lba_ * 2352) - this->toc.tracks[this->track].offset;
-				FileSeek(&this->toc.tracks[this->track].f, offs, SEEK_SET);
-				FileReadAdv(&this->toc.tracks[this->track].f, buf, 2352);
+				cdcache_read_file(&this->toc.tracks[this->track].f, offs, buf, 2352);
 			}
 #ifdef P3DO_DEBUG
 			//printf("\x1b[32m3DO: ");
@@ -18,6 +18,7 @@
 #include "cdi.h"
 #include "../../cd.h"
 #include "../chd/mister_chd.h"
+#include "../../cd_cache.h"
 #include <libchdr/chd.h>
 #include <arpa/inet.h>
 #include "cdg_unpacker.hpp"
@@ -74,8 +75,6 @@ static std::array<struct toc_entry, (99 + 3) * 3> toc_buffer;
 uint32_t toc_entry_count = 0;
 static enum DiscType disc_type = DT_CDDA;
 
-static uint8_t* chd_hunkbuf = NULL;
-static int chd_hunknum;
 static toc_t toc = {};
 CdgUnpacker cdg_unpack;
 bool sub_loaded_from_cdg;
@@ -117,13 +116,9 @@ static void unload_chd(toc_t* table)
 {
 	if (table->chd_f)
 	{
-		chd_close(table->chd_f);
+		mister_chd_close(table->chd_f);
 	}
-	if (chd_hunkbuf)
-		free(chd_hunkbuf);
-	chd_hunkbuf = nullptr;
 	memset(table, 0, sizeof(toc_t));
-	chd_hunknum = -1;
 }
 
 static void unload_cue(toc_t* table)
@@ -167,14 +162,6 @@ static int load_chd(const char* filename, toc_t* table)
 
 	table->end += 150;
 
-	chd_hunkbuf = (uint8_t*)malloc(table->chd_hunksize);
-	if (!chd_hunkbuf)
-	{
-		unload_chd(table);
-		return 0;
-	}
-	chd_hunknum = -1;
-
 	return 1;
 }
 
@@ -939,22 +926,11 @@ void cdi_read_cd(uint8_t* buffer, int lba, int cnt)
 				// ... check for sectors in reading range
 				if (lba >= (toc.tracks[i].start - toc.tracks[i].pregap) && lba <= toc.tracks[i].end)
 				{
+					__off64_t file_ofs = (__off64_t)(lba - toc.tracks[i].start + toc.tracks[i].pregap) * CDI_SECTOR_LEN;
+					if (toc.tracks[i].offset) file_ofs += toc.tracks[i].offset;
+
 					if (!toc.chd_f)
 					{
-						if (toc.tracks[i].offset)
-						{
-							FileSeek(&toc.tracks[0].f,
-									 toc.tracks[i].offset +
-										 ((lba - toc.tracks[i].start + toc.tracks[i].pregap) * CDI_SECTOR_LEN),
-									 SEEK_SET);
-						}
-						else
-						{
-							FileSeek(&toc.tracks[i].f,
-									 (lba - toc.tracks[i].start + toc.tracks[i].pregap) * CDI_SECTOR_LEN,
-									 SEEK_SET);
-						}
-
 						if (toc.sub.opened())
 						{
 							// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
@@ -992,9 +968,7 @@ void cdi_read_cd(uint8_t* buffer, int lba, int cnt)
 													   0,
 													   0,
 													   CDI_SECTOR_LEN,
-													   buffer,
-													   chd_hunkbuf,
-													   &chd_hunknum) == CHDERR_NONE)
+													   buffer) == CHDERR_NONE)
 							{
 								if (!toc.tracks[i].type) // CHD requires byteswap of audio data
 								{
@@ -1019,9 +993,7 @@ void cdi_read_cd(uint8_t* buffer, int lba, int cnt)
 														   0,
 														   CDI_SECTOR_LEN,
 														   subc.size(),
-														   subc.data(),
-														   chd_hunkbuf,
-														   &chd_hunknum) == CHDERR_NONE)
+														   subc.data()) == CHDERR_NONE)
 								{
 									subc_filled = true;
 								}
@@ -1040,9 +1012,10 @@ void cdi_read_cd(uint8_t* buffer, int lba, int cnt)
 						else
 						{
 							if (toc.tracks[i].offset)
-								FileReadAdv(&toc.tracks[0].f, buffer, CDI_SECTOR_LEN);
+								cdcache_read_file(&toc.tracks[0].f, file_ofs, buffer, CDI_SECTOR_LEN);
 							else
-								FileReadAdv(&toc.tracks[i].f, buffer, CDI_SECTOR_LEN);
+								cdcache_read_file(&toc.tracks[i].f, file_ofs, buffer, CDI_SECTOR_LEN);
+							file_ofs += CDI_SECTOR_LEN;
 
 							if (toc.sub.opened())
 							{
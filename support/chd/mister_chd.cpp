@@ -8,6 +8,7 @@
 #include "../../file_io.h"
 #include "../../cd.h"
 #include "mister_chd.h"
+#include "../../cd_cache.h"
 
 void lba_to_hunkinfo(chd_file *chd_f, int lba, int *hunknumber, int *hunkoffset)
 {
@@ -160,9 +161,9 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 	return CHDERR_NONE;
 }
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum)
+// hunks are decompressed and cached by cd_cache
+chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf)
 {
-
 	int tmphnum = 0;
 	int hunkofs = 0;
 
@@ -170,17 +171,17 @@ chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, ui
 
 
 	//mister_chd_log("READ LBA: %d, dest_offset: %d sector offset: %d length %d chd_f %p\n", lba, d_offset, s_offset, length, chd_f);
-	if (tmphnum != *hunknum)
+	int sector_offset = hunkofs * CD_FRAME_SIZE;
+	chd_error err = cdcache_read_chd(chd_f, tmphnum, sector_offset + s_offset, destbuf + d_offset, length);
+	if (err != CHDERR_NONE)
 	{
-		chd_error err = chd_read(chd_f, tmphnum, hunkbuf);
-		if (err != CHDERR_NONE)
-		{
-			mister_chd_log("ERROR %s\n", chd_error_string(err));
-			return err;
-		}
-		*hunknum = tmphnum;
+		mister_chd_log("ERROR %s\n", chd_error_string(err));
 	}
-	int sector_offset = hunkofs * CD_FRAME_SIZE;
-	memcpy(destbuf + d_offset, hunkbuf + sector_offset + s_offset, length);
-	return CHDERR_NONE;
+	return err;
+}
+
+void mister_chd_close(chd_file *chd_f)
+{
+	cdcache_release(chd_f);
+	chd_close(chd_f);
 }
@@ -17,8 +17,6 @@ struct mac_cdrom_state
 	int      is_chd;
 
 	toc_t    toc;          // full track table, disc-LBA space (no +150)
-	uint8_t *hunkbuf;      // chd hunk cache
-	int      hunknum;
 
 	int      trk;          // index of the served data track in toc.tracks[]
 	uint32_t data_soff;    // user-data byte offset inside the data track's raw sector
@@ -50,10 +48,9 @@ static uint32_t layout_data_off(int is_mode2, uint32_t sec_size)
 void mac_cdrom_unmount(int index)
 {
 	if (index != mac_cdrom_slot()) return;
-	if (cd.is_chd && cd.toc.chd_f) chd_close(cd.toc.chd_f);
+	if (cd.is_chd && cd.toc.chd_f) mister_chd_close(cd.toc.chd_f);
 	for (int i = 0; i < cd.toc.last; i++)
 		if (cd.toc.tracks[i].f.opened()) FileClose(&cd.toc.tracks[i].f);
-	if (cd.hunkbuf) free(cd.hunkbuf);
 	memset(&cd, 0, sizeof(cd));
 	cd.aframe_lba = -1;
 }
@@ -141,9 +138,6 @@ static int mount_chd(const char *name)
 		printf("Mac CD: failed to load chd %s\n", name);
 		return MAC_CDROM_REJECT;
 	}
-	cd.hunkbuf = (uint8_t *)malloc(cd.toc.chd_hunksize);
-	if (!cd.hunkbuf) return MAC_CDROM_REJECT;
-	cd.hunknum = -1;
 	cd.is_chd  = 1;
 	return finish_mount("chd");
 }
@@ -422,7 +416,7 @@ static int audio_frame(uint32_t disc_lba)
 	if (cd.is_chd)
 	{
 		if (mister_chd_read_sector(cd.toc.chd_f, (int)disc_lba + k->offset, 0, 0,
-		                           2352, cd.aframe, cd.hunkbuf, &cd.hunknum) != CHDERR_NONE)
+		                           2352, cd.aframe) != CHDERR_NONE)
 			return 0;
 		// CHD stores CD-DA byteswapped; the window contract is bin byte order
 		for (int i = 0; i < 2352; i += 2)
@@ -494,7 +488,7 @@ void mac_cdrom_fill(int index, uint64_t lba, uint8_t *buf, int sz)
 	{
 		int chd_lba = (int)cd_lba + k->start + k->offset;
 		if (mister_chd_read_sector(cd.toc.chd_f, chd_lba, 0, cd.data_soff + off,
-		                           sz, buf, cd.hunkbuf, &cd.hunknum) != CHDERR_NONE)
+		                           sz, buf) != CHDERR_NONE)
 			memset(buf, 0, sz);
 	}
 	else
@@ -213,8 +213,7 @@ static bool cdtv_read_audio_sector(drive_t *drv, uint32_t lba, uint8_t *buf2352)
 
 	uint32_t chd_lba = lba + track->chd_offset;
 	if (mister_chd_read_sector(drv->chd_f, chd_lba, 0, 0,
-	                           CDTV_CDDA_BYTES, buf2352,
-	                           drv->chd_hunkbuf, &drv->chd_hunknum)
+	                           CDTV_CDDA_BYTES, buf2352)
 	    != CHDERR_NONE) {
 		return false;
 	}
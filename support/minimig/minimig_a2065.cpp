@@ -42,8 +42,10 @@ extern int  rings_rx_has_space(void);
 extern void mac_set_addresses(const uint8_t *fake, const uint8_t *real);
 extern int  ethernet_open(const char *iface, int promiscuous);
 extern void ethernet_close(void);
-extern int  ethernet_recv(uint8_t *buf, int maxlen);
-extern int  ethernet_recv_nb(uint8_t *buf, int maxlen);
+extern const uint8_t *ethernet_rx_peek(int *len);
+extern void ethernet_rx_release(void);
+extern void ethernet_flush(void);
+extern void ethernet_io_stats(unsigned long *rx_frames, unsigned long *tx_frames, unsigned long *syscalls);
 extern void ethernet_get_mac(uint8_t *mac_out);
 extern int  ethernet_read_iface_mac(const char *iface, uint8_t *out);
 extern int  ethernet_set_mac_filter(const uint8_t *mac);
@@ -269,7 +271,6 @@ static int on_transmit_cb(void)
 
 static void a2065_drain_rx(void)
 {
-	static uint8_t rxbuf[MAX_PACKET_SIZE];
 	int taken = 0;
 
 	// Backpressure: with no free descriptor, leave the frames in the kernel
@@ -287,9 +288,11 @@ static void a2065_drain_rx(void)
 	rx_batching = 1;
 	while (taken < RX_BATCH_MAX && (loop || rings_rx_has_space()))
 	{
-		int len = ethernet_recv_nb(rxbuf, sizeof rxbuf);
-		if (len <= 0) break;          // socket empty (0) or error (-1)
-		if (!loop) gotfunc(rxbuf, len);
+		int len;
+		const uint8_t *frame = ethernet_rx_peek(&len);
+		if (!frame) break;            // socket empty or error
+		if (!loop) gotfunc(frame, len);
+		ethernet_rx_release();
 		taken++;
 	}
 	rx_batching = 0;
@@ -301,6 +304,30 @@ static void a2065_drain_rx(void)
 	}
 }
 
+// Frame rates and kernel drops, so batching and ring sizing can be judged
+// from the log. Only worth a LOG line when the kernel actually dropped.
+#define STATS_INTERVAL 30
+
+static void a2065_report_stats(void)
+{
+	static time_t last = 0;
+	time_t now = time(NULL);
+	if (!last) last = now;
+	if (now - last < STATS_INTERVAL) return;
+
+	unsigned long rx, tx, calls, packets = 0, drops = 0;
+	ethernet_io_stats(&rx, &tx, &calls);
+	ethernet_packet_stats(&packets, &drops);
+
+	unsigned long secs = (unsigned long)(now - last);
+	last = now;
+	float per_call = calls ? (float)(rx + tx) / calls : 0.0f;
+	if (drops)
+		LOG("[a2065] rx %lu/s, tx %lu/s, %.1f frames/syscall, %lu kernel drops\n", rx / secs, tx / secs, per_call, drops);
+	else
+		DBG("[a2065] rx %lu/s, tx %lu/s, %.1f frames/syscall\n", rx / secs, tx / secs, per_call);
+}
+
 static void write_mbx_mac(const uint8_t *fakemac)
 {
 	uint64_t val = 1;
@@ -558,7 +585,10 @@ void a2065_poll(void)
 		}
 	}
 
+	// Frames queued by do_transmit() during this pass go out in one batch.
+	ethernet_flush();
 	a2065_drain_rx();
+	a2065_report_stats();
 }
 
 void a2065_stop(void)
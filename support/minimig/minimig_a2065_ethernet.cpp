@@ -4,6 +4,12 @@
  * Replaces Amiberry's WinPcap/libpcap layer.
  * Sends and receives raw Ethernet frames via Linux AF_PACKET socket.
  *
+ * Receive uses a PACKET_MMAP ring shared with the kernel, so draining a burst
+ * costs no syscalls and each frame is copied only by gotfunc(). Transmit
+ * queues frames built in place by do_transmit() and hands them to the kernel
+ * with one sendmmsg() per poll pass. Tap devices and kernels without ring
+ * support fall back to one non-blocking read/recv per frame.
+ *
  * Stub implementation for non-Linux builds (macOS native testing).
  */
 
@@ -26,12 +32,35 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <sys/mman.h>
 
 static int sock_fd = -1;
 static int is_tap = 0;
 static uint8_t host_mac[6];
 
+/* RX ring: 64 blocks of 16 frames, 4MB like the socket buffer it replaces.
+ * TPACKET_V2 rather than V3: V3 hands over whole blocks on a retire timer,
+ * which would hold back the lone ACKs a TCP stream waits for. */
+#define RX_RING_BLOCK_SIZE (64 * 1024)
+#define RX_RING_BLOCKS     64
+#define RX_RING_FRAME_SIZE 4096
+#define RX_RING_FRAMES     (RX_RING_BLOCKS * (RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE))
+#define RX_RING_SIZE       (RX_RING_BLOCKS * RX_RING_BLOCK_SIZE)
+
+static uint8_t *rx_ring = NULL;
+static unsigned rx_ring_pos = 0;
+static int      rx_held = 0;
+static uint8_t  rx_copy[MAX_PACKET_SIZE];   /* read/recv fallback */
+
+/* TX batch, flushed by ethernet_flush() at the end of each poll pass. */
+#define TX_BATCH_MAX 32
+
+static uint8_t tx_buf[TX_BATCH_MAX][MAX_PACKET_SIZE];
+static int     tx_len[TX_BATCH_MAX];
+static int     tx_count = 0;
+
+static unsigned long stat_rx_frames = 0, stat_tx_frames = 0, stat_syscalls = 0;
+
 void ethernet_iface_up(const char *iface);  /* forward decl for open_tap */
 
 int ethernet_is_tap(void) { return is_tap; }
@@ -51,6 +80,9 @@ static int open_tap(const char *iface)
         return 0;
     }
 
+    /* drained without a poll() per frame, see ethernet_rx_peek() */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
     sock_fd = fd;
     is_tap = 1;
 
@@ -75,6 +107,38 @@ static int open_tap(const char *iface)
     return 1;
 }
 
+static void rx_ring_open(void)
+{
+    int ver = TPACKET_V2;
+    if (setsockopt(sock_fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof ver) < 0) {
+        perror("[a2065] PACKET_VERSION");
+        return;
+    }
+
+    struct tpacket_req req = {};
+    req.tp_block_size = RX_RING_BLOCK_SIZE;
+    req.tp_block_nr   = RX_RING_BLOCKS;
+    req.tp_frame_size = RX_RING_FRAME_SIZE;
+    req.tp_frame_nr   = RX_RING_FRAMES;
+    if (setsockopt(sock_fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof req) < 0) {
+        perror("[a2065] PACKET_RX_RING");
+        return;
+    }
+
+    void *ring = mmap(NULL, RX_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, sock_fd, 0);
+    if (ring == MAP_FAILED) {
+        perror("[a2065] mmap rx ring");
+        req = {};
+        setsockopt(sock_fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof req);
+        return;
+    }
+
+    rx_ring = (uint8_t *)ring;
+    rx_ring_pos = 0;
+    rx_held = 0;
+    LOG("[a2065] rx ring %d frames\n", RX_RING_FRAMES);
+}
+
 int ethernet_open(const char *iface, int promiscuous)
 {
     if (!strncmp(iface, "tap", 3)) return open_tap(iface);
@@ -151,6 +215,9 @@ int ethernet_open(const char *iface, int promiscuous)
     if (getsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &got, &glen) == 0)
         LOG("[a2065] socket rcvbuf = %d bytes\n", got);
 
+    /* With the ring the socket buffer above is only the fallback. */
+    rx_ring_open();
+
     LOG("[a2065] Opened %s idx=%d MAC=%02X:%02X:%02X:%02X:%02X:%02X\n",
             iface, ifindex,
             host_mac[0], host_mac[1], host_mac[2],
@@ -173,53 +240,116 @@ void ethernet_packet_stats(unsigned long *packets, unsigned long *drops)
     }
 }
 
+/* Frames handed over since the last call, and the syscalls it took. */
+void ethernet_io_stats(unsigned long *rx_frames, unsigned long *tx_frames, unsigned long *syscalls)
+{
+    *rx_frames = stat_rx_frames;
+    *tx_frames = stat_tx_frames;
+    *syscalls  = stat_syscalls;
+    stat_rx_frames = stat_tx_frames = stat_syscalls = 0;
+}
+
+void ethernet_flush(void)
+{
+    if (!tx_count) return;
+
+    if (sock_fd >= 0 && is_tap) {
+        /* a tap takes exactly one frame per write */
+        for (int i = 0; i < tx_count; i++) {
+            stat_syscalls++;
+            if (write(sock_fd, tx_buf[i], (size_t)tx_len[i]) < 0 && errno != EAGAIN)
+                perror("[a2065] send");
+        }
+    } else if (sock_fd >= 0) {
+        struct iovec iov[TX_BATCH_MAX];
+        struct mmsghdr msgs[TX_BATCH_MAX];
+        memset(msgs, 0, sizeof(msgs[0]) * tx_count);
+        for (int i = 0; i < tx_count; i++) {
+            iov[i].iov_base = tx_buf[i];
+            iov[i].iov_len  = (size_t)tx_len[i];
+            msgs[i].msg_hdr.msg_iov    = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int done = 0;
+        while (done < tx_count) {
+            stat_syscalls++;
+            int n = sendmmsg(sock_fd, msgs + done, (unsigned)(tx_count - done), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) { perror("[a2065] sendmmsg"); break; }
+            done += n;
+        }
+    }
+
+    stat_tx_frames += tx_count;
+    tx_count = 0;
+}
+
 void ethernet_close(void)
 {
+    ethernet_flush();
+    if (rx_ring) { munmap(rx_ring, RX_RING_SIZE); rx_ring = NULL; }
+    rx_held = 0;
     if (sock_fd >= 0) { close(sock_fd); sock_fd = -1; }
 }
 
-void ethernet_send(const uint8_t *frame, int len)
+/* Buffer for the next outgoing frame, filled in place by do_transmit().
+ * Nothing is sent until ethernet_tx_commit(). */
+uint8_t *ethernet_tx_slot(void)
+{
+    if (tx_count == TX_BATCH_MAX) ethernet_flush();
+    return tx_buf[tx_count];
+}
+
+void ethernet_tx_commit(int len)
 {
     if (sock_fd < 0 || len <= 0) return;
-    ssize_t sent = is_tap ? write(sock_fd, frame, (size_t)len)
-                          : send(sock_fd, frame, (size_t)len, 0);
-    if (sent < 0) perror("[a2065] send");
+    tx_len[tx_count++] = len > MAX_PACKET_SIZE ? MAX_PACKET_SIZE : len;
+    if (tx_count == TX_BATCH_MAX) ethernet_flush();
 }
 
-int ethernet_recv(uint8_t *buf, int maxlen)
+/* Non-blocking receive for batch draining. Returns the next queued frame, or
+ * NULL when there is none (drain complete) or on error. The frame stays valid
+ * until ethernet_rx_release(); with the ring it is read in place from the
+ * kernel's buffer and stays queued until released. Lets the drain pull every
+ * queued frame into the RX ring in one pass so a TSO pair lands together and
+ * the Amiga issues an immediate (2-segment) ACK. */
+const uint8_t *ethernet_rx_peek(int *len)
 {
-    if (sock_fd < 0) return -1;
-    ssize_t n = is_tap ? read(sock_fd, buf, (size_t)maxlen)
-                       : recv(sock_fd, buf, (size_t)maxlen, 0);
-    if (n < 0) {
-        if (errno != EINTR) perror("[a2065] recv");
-        return -1;
+    if (sock_fd < 0) return NULL;
+
+    if (rx_ring) {
+        struct tpacket2_hdr *h = (struct tpacket2_hdr *)(rx_ring + rx_ring_pos * RX_RING_FRAME_SIZE);
+        if (!(__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) return NULL;
+        rx_held = 1;
+        *len = (int)h->tp_snaplen;
+        return (const uint8_t *)h + h->tp_mac;
     }
-    return (int)n;
-}
-
-/* Non-blocking receive for batch draining. Returns the frame length (>0),
- * 0 when the socket queue is empty (EAGAIN — drain complete), or -1 on error.
- * Lets the rx_thread pull every queued frame into the RX ring in one pass so
- * a TSO pair lands together and the Amiga issues an immediate (2-segment) ACK. */
-int ethernet_recv_nb(uint8_t *buf, int maxlen)
-{
-    if (sock_fd < 0) return -1;
-    if (is_tap) {
-        struct pollfd pfd = { sock_fd, POLLIN, 0 };
-        int pr = poll(&pfd, 1, 0);
-        if (pr <= 0) return 0;
-        ssize_t n = read(sock_fd, buf, (size_t)maxlen);
-        if (n < 0) { if (errno != EINTR) perror("[a2065] tap recv_nb"); return -1; }
-        return (int)n;
+
+    stat_syscalls++;
+    ssize_t n = is_tap ? read(sock_fd, rx_copy, sizeof rx_copy)
+                       : recv(sock_fd, rx_copy, sizeof rx_copy, MSG_DONTWAIT);
+    if (n <= 0) {
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            perror("[a2065] recv_nb");
+        return NULL;
     }
-    ssize_t n = recv(sock_fd, buf, (size_t)maxlen, MSG_DONTWAIT);
-    if (n < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
-        if (errno != EINTR) perror("[a2065] recv_nb");
-        return -1;
+    rx_held = 1;
+    *len = (int)n;
+    return rx_copy;
+}
+
+void ethernet_rx_release(void)
+{
+    if (!rx_held) return;
+    rx_held = 0;
+    stat_rx_frames++;
+
+    if (rx_ring) {
+        struct tpacket2_hdr *h = (struct tpacket2_hdr *)(rx_ring + rx_ring_pos * RX_RING_FRAME_SIZE);
+        __atomic_store_n(&h->tp_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        rx_ring_pos = (rx_ring_pos + 1) % RX_RING_FRAMES;
     }
-    return (int)n;
 }
 
 void ethernet_get_mac(uint8_t *mac_out)
@@ -487,23 +617,25 @@ int ethernet_open(const char *iface, int promiscuous)
 
 void ethernet_close(void) {}
 
-void ethernet_send(const uint8_t *frame, int len)
-{
-    (void)frame; (void)len;
-}
+static uint8_t tx_buf[MAX_PACKET_SIZE];
+
+uint8_t *ethernet_tx_slot(void) { return tx_buf; }
+void ethernet_tx_commit(int len) { (void)len; }
+void ethernet_flush(void) {}
 
-int ethernet_recv(uint8_t *buf, int maxlen)
+void ethernet_io_stats(unsigned long *rx_frames, unsigned long *tx_frames, unsigned long *syscalls)
 {
-    (void)buf; (void)maxlen;
-    return -1;
+    *rx_frames = *tx_frames = *syscalls = 0;
 }
 
-int ethernet_recv_nb(uint8_t *buf, int maxlen)
+const uint8_t *ethernet_rx_peek(int *len)
 {
-    (void)buf; (void)maxlen;
-    return 0;
+    (void)len;
+    return NULL;
 }
 
+void ethernet_rx_release(void) {}
+
 void ethernet_get_mac(uint8_t *mac_out)
 {
     memset(mac_out, 0, 6);
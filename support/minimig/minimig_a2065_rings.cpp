@@ -16,7 +16,8 @@
 extern volatile uint8_t *boardram;
 extern int mungepacket(uint8_t *packet, int len);
 extern uint32_t crc32_compute(const uint8_t *data, int len);
-extern void ethernet_send(const uint8_t *frame, int len);
+extern uint8_t *ethernet_tx_slot(void);
+extern void ethernet_tx_commit(int len);
 
 /* Register accessors from registers.cpp */
 extern uint16_t registers_csr0(void);
@@ -34,9 +35,6 @@ extern uint64_t registers_ladrf(void);
 extern void     registers_get_fakemac(uint8_t *out);
 extern void     rethink(void);
 
-static uint8_t transmitbuffer[MAX_PACKET_SIZE];
-static int     transmitlen = 0;
-
 /* ── Boardram accessors (see boardram_access.h) ─ */
 
 /* ── Forward declaration (gotfunc defined after do_transmit) ──── */
@@ -46,6 +44,9 @@ void gotfunc(const uint8_t *databuf, int len);
 int do_transmit(void)
 {
     int err = 0, outsize = 0, add_fcs;
+    /* built in place in the ethernet layer's TX batch */
+    uint8_t *transmitbuffer = ethernet_tx_slot();
+    int transmitlen;
     uint32_t addr, off;
     uint16_t tmd0, tmd1, tmd2, tmd3;
 
@@ -186,7 +187,7 @@ int do_transmit(void)
                 outsize -= 4;
             transmitlen = outsize;
             mungepacket(transmitbuffer, transmitlen);
-            ethernet_send(transmitbuffer, transmitlen);
+            ethernet_tx_commit(transmitlen);
             DBG("[a2065] TX %d bytes DST=%02X:%02X:%02X:%02X:%02X:%02X\n",
                     transmitlen,
                     transmitbuffer[0], transmitbuffer[1], transmitbuffer[2],
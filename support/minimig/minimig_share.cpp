@@ -6,10 +6,13 @@
 #include <sys/statvfs.h>
 #include <dirent.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include <map>
 #include <string>
 #include <vector>
+#include <atomic>
 
 #include "../../hardware.h"
 #include "../../file_io.h"
@@ -17,6 +20,7 @@
 #include "../../spi.h"
 #include "../../cfg.h"
 #include "../../shmem.h"
+#include "../../offload.h"
 #include "miminig_fs_messages.h"
 
 #define SHMEM_ADDR      0x27FF4000
@@ -53,6 +57,21 @@ struct lock
 	std::vector<dirent64> dir_items;
 };
 
+// Directory listings are kept until the directory changes, so examining the
+// same directory again through a new lock doesn't read it again. Directories
+// changed in the last few seconds are always read as the timestamp resolution
+// of the file system may hide a change.
+#define LISTINGS_MAX 32
+
+struct dir_listing_t
+{
+	struct timespec mtime;
+	bool stable;
+	std::vector<dirent64> items;
+};
+
+static std::map<std::string, dir_listing_t> dir_listings;
+
 static std::map<uint32_t, lock> locks;
 static uint32_t next_key = 1;
 
@@ -120,6 +139,316 @@ static uint32_t get_fp()
 	return fp;
 }
 
+// Per handle buffering. The Amiga side moves at most 4KB per packet, so
+// sequential reads are served from a read-ahead buffer which is refilled in the
+// background, and sequential writes are collected and written in large chunks.
+#define RA_SIZE      (256 * 1024)
+#define WB_SIZE      (256 * 1024)
+#define WB_FLUSH_MS  200
+
+enum
+{
+	RA_IDLE = 0,
+	RA_BUSY,
+	RA_READY
+};
+
+struct handle_io_t
+{
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	bool pos_stale;        // FILE position differs from fileTYPE offset
+	int error;             // failed buffered write, reported by the next request
+
+	uint8_t *rbuf;         // data being served
+	__off64_t rstart;
+	uint32_t rlen;
+	__off64_t next_read;
+	uint32_t seq;
+
+	uint8_t *abuf;         // filled by the offload worker
+	__off64_t astart;
+	uint32_t alen;
+	std::atomic<int> astate;
+
+	uint8_t *wbuf;
+	__off64_t wstart;
+	uint32_t wlen;
+};
+
+static std::map<uint32_t, handle_io_t*> handle_io;
+static int pending_writes = 0;
+static unsigned long flush_timer = 0;
+
+static handle_io_t *get_io(uint32_t key, fileTYPE *f)
+{
+	if (!f->filp) return nullptr;
+
+	auto it = handle_io.find(key);
+	if (it != handle_io.end()) return it->second;
+
+	handle_io_t *io = new handle_io_t();
+	io->fd = fileno(f->filp);
+	io->next_read = -1;
+
+	struct stat64 st;
+	if (!fstat64(io->fd, &st))
+	{
+		io->dev = st.st_dev;
+		io->ino = st.st_ino;
+	}
+
+	handle_io[key] = io;
+	return io;
+}
+
+static bool same_file(const handle_io_t *a, const handle_io_t *b)
+{
+	return a == b || (a->ino && a->dev == b->dev && a->ino == b->ino);
+}
+
+static int take_error(handle_io_t *io)
+{
+	int error = io->error;
+	io->error = 0;
+	return error;
+}
+
+static void wait_ahead(handle_io_t *io)
+{
+	while (io->astate.load(std::memory_order_acquire) == RA_BUSY) usleep(100);
+}
+
+static void drop_reads(handle_io_t *io)
+{
+	wait_ahead(io);
+	io->astate.store(RA_IDLE, std::memory_order_relaxed);
+	io->rlen = 0;
+	io->seq = 0;
+	io->next_read = -1;
+}
+
+static int flush_writes(handle_io_t *io, fileTYPE *f)
+{
+	if (!io->wlen) return 1;
+
+	__off64_t offset = f->offset;
+	int ok = FileSeek(f, io->wstart, SEEK_SET) && FileWriteAdv(f, io->wbuf, io->wlen) == (int)io->wlen;
+	if (!ok)
+	{
+		printf("minimig_share: failed to write %u bytes to %s.\n", io->wlen, f->name);
+		io->error = (errno == EROFS) ? ERROR_DISK_WRITE_PROTECTED : ERROR_DISK_FULL;
+	}
+
+	io->wlen = 0;
+	io->pos_stale = true;
+	f->offset = offset;
+	pending_writes--;
+	return ok;
+}
+
+static void flush_all_writes()
+{
+	for (auto &pair : handle_io)
+	{
+		if (pair.second->wlen) flush_writes(pair.second, &open_file_handles[pair.first]);
+	}
+}
+
+// make the FILE match the buffered state before using it directly
+static void sync_handle(uint32_t key, fileTYPE *f)
+{
+	auto it = handle_io.find(key);
+	if (it == handle_io.end()) return;
+
+	handle_io_t *io = it->second;
+	flush_writes(io, f);
+	if (io->pos_stale)
+	{
+		FileSeek(f, f->offset, SEEK_SET);
+		io->pos_stale = false;
+	}
+}
+
+// returns the error of a write that could not be reported before
+static int close_handle(uint32_t key)
+{
+	fileTYPE *f = &open_file_handles[key];
+	int error = 0;
+
+	auto it = handle_io.find(key);
+	if (it != handle_io.end())
+	{
+		handle_io_t *io = it->second;
+		flush_writes(io, f);
+		error = take_error(io);
+		wait_ahead(io);
+		free(io->rbuf);
+		free(io->abuf);
+		free(io->wbuf);
+		delete io;
+		handle_io.erase(it);
+	}
+
+	FileClose(f);
+	open_file_handles.erase(key);
+	return error;
+}
+
+static void start_ahead(handle_io_t *io, __off64_t offset)
+{
+	if (!io->abuf) io->abuf = (uint8_t *)malloc(RA_SIZE);
+	if (!io->abuf) return;
+
+	io->astart = offset;
+	io->alen = 0;
+	io->astate.store(RA_BUSY, std::memory_order_relaxed);
+
+	if (!offload_try_add_work([io]()
+	{
+		ssize_t ret = pread(io->fd, io->abuf, RA_SIZE, io->astart);
+		io->alen = (ret > 0) ? ret : 0;
+		io->astate.store(RA_READY, std::memory_order_release);
+	}, nullptr, OFFLOAD_PRIO_HIGH))
+	{
+		io->astate.store(RA_IDLE, std::memory_order_relaxed);
+	}
+}
+
+// data read ahead through other handles of the same file is outdated by a write
+static void drop_other_reads(handle_io_t *io)
+{
+	for (auto &pair : handle_io)
+	{
+		if (pair.second != io && same_file(pair.second, io)) drop_reads(pair.second);
+	}
+}
+
+// returns -1 on error, the error code is left in io->error
+static int share_read(uint32_t key, fileTYPE *f, uint8_t *dst, uint32_t length)
+{
+	handle_io_t *io = get_io(key, f);
+	if (!io)
+	{
+		int ret = FileReadAdv(f, dst, length);
+		return (ret < 0) ? 0 : ret;
+	}
+
+	if (io->error) return -1;
+
+	// pending writes to the same file through other handles
+	for (auto &pair : handle_io)
+	{
+		if (pair.second->wlen && same_file(pair.second, io)) flush_writes(pair.second, &open_file_handles[pair.first]);
+	}
+
+	if (io->error) return -1;
+
+	__off64_t pos = f->offset;
+	io->seq = (pos == io->next_read) ? io->seq + 1 : 0;
+
+	uint32_t done = 0;
+	while (done < length)
+	{
+		__off64_t cur = pos + done;
+		if (io->rlen && cur >= io->rstart && cur < io->rstart + io->rlen)
+		{
+			uint32_t n = io->rstart + io->rlen - cur;
+			if (n > length - done) n = length - done;
+			memcpy(dst + done, io->rbuf + (cur - io->rstart), n);
+			done += n;
+			continue;
+		}
+
+		if (io->astate.load(std::memory_order_acquire) != RA_IDLE)
+		{
+			wait_ahead(io);
+			io->astate.store(RA_IDLE, std::memory_order_relaxed);
+			if (cur >= io->astart && cur < io->astart + io->alen)
+			{
+				std::swap(io->rbuf, io->abuf);
+				io->rstart = io->astart;
+				io->rlen = io->alen;
+				continue;
+			}
+		}
+
+		// sequential access, fill the whole buffer at once
+		if (io->seq && !io->rbuf) io->rbuf = (uint8_t *)malloc(RA_SIZE);
+		if (io->seq && io->rbuf)
+		{
+			ssize_t ret = pread(io->fd, io->rbuf, RA_SIZE, cur);
+			io->rstart = cur;
+			io->rlen = (ret > 0) ? ret : 0;
+			if (io->rlen) continue;
+			break;
+		}
+
+		ssize_t ret = pread(io->fd, dst + done, length - done, cur);
+		if (ret > 0) done += ret;
+		break;
+	}
+
+	f->offset = pos + done;
+	io->pos_stale = true;
+	io->next_read = f->offset;
+
+	if (io->seq && io->rlen == RA_SIZE && io->astate.load(std::memory_order_relaxed) == RA_IDLE)
+	{
+		start_ahead(io, io->rstart + io->rlen);
+	}
+
+	return done;
+}
+
+// returns -1 on error, the error code is left in io->error
+static int share_write(uint32_t key, fileTYPE *f, uint8_t *src, uint32_t length)
+{
+	handle_io_t *io = get_io(key, f);
+	if (io && io->error) return -1;
+
+	if (!io || length > WB_SIZE)
+	{
+		if (io)
+		{
+			drop_reads(io);
+			drop_other_reads(io);
+			sync_handle(key, f);
+			if (io->error) return -1;
+		}
+		int ret = FileWriteAdv(f, src, length);
+		return (ret < 0) ? 0 : ret;
+	}
+
+	drop_reads(io);
+	drop_other_reads(io);
+
+	if (io->wlen && (f->offset != io->wstart + io->wlen || io->wlen + length > WB_SIZE) && !flush_writes(io, f)) return -1;
+
+	if (!io->wbuf) io->wbuf = (uint8_t *)malloc(WB_SIZE);
+	if (!io->wbuf)
+	{
+		sync_handle(key, f);
+		int ret = FileWriteAdv(f, src, length);
+		return (ret < 0) ? 0 : ret;
+	}
+
+	if (!io->wlen)
+	{
+		io->wstart = f->offset;
+		pending_writes++;
+	}
+
+	memcpy(io->wbuf + io->wlen, src, length);
+	io->wlen += length;
+	f->offset += length;
+	if (f->offset > f->size) f->size = f->offset;
+
+	flush_timer = GetTimer(WB_FLUSH_MS);
+	return length;
+}
+
 static char* find_path(uint32_t key, const char *name)
 {
 	dbg_print("find_path(%d, %s)\n", key, name);
@@ -289,6 +618,9 @@ static int process_request(void *reqres_buffer)
 	// no base path => force fail
 	if (!baselen) rtype = ACTION_NIL;
 
+	// anything else may look at the files being written
+	if (pending_writes && rtype != ACTION_READ && rtype != ACTION_WRITE) flush_all_writes();
+
 	switch (rtype)
 	{
 		case ACTION_LOCATE_OBJECT:
@@ -421,24 +753,39 @@ static int process_request(void *reqres_buffer)
 				}
 
 				locks[key].dir_items.clear();
-				if (PathIsDir(name, 0))
+				struct stat64 *st = getPathStat(name);
+				if (st && (st->st_mode & S_IFMT) == S_IFDIR)
 				{
-					const char* full_path = getFullPath(name);
-					DIR *d = opendir(full_path);
-					if (!d)
+					struct timespec mtime = st->st_mtim;
+					auto it = dir_listings.find(name);
+					if (it == dir_listings.end() || !it->second.stable || it->second.mtime.tv_sec != mtime.tv_sec || it->second.mtime.tv_nsec != mtime.tv_nsec)
 					{
-						printf("Couldn't open dir: %s\n", full_path);
-						ret = ERROR_OBJECT_WRONG_TYPE;
-						break;
+						const char* full_path = getFullPath(name);
+						DIR *d = opendir(full_path);
+						if (!d)
+						{
+							printf("Couldn't open dir: %s\n", full_path);
+							ret = ERROR_OBJECT_WRONG_TYPE;
+							break;
+						}
+
+						if (dir_listings.size() >= LISTINGS_MAX) dir_listings.clear();
+						dir_listing_t &listing = dir_listings[name];
+						listing.mtime = mtime;
+						listing.stable = time(NULL) > mtime.tv_sec + 2;
+						listing.items.clear();
+
+						struct dirent64 *de;
+						while ((de = readdir64(d)))
+						{
+							if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) continue;
+							listing.items.push_back(*de);
+						}
+						closedir(d);
+						it = dir_listings.find(name);
 					}
 
-					struct dirent64 *de;
-					while ((de = readdir64(d)))
-					{
-						if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) continue;
-						locks[key].dir_items.push_back(*de);
-					}
-					closedir(d);
+					locks[key].dir_items = it->second.items;
 				}
 			}
 			else
@@ -467,26 +814,21 @@ static int process_request(void *reqres_buffer)
 			dbg_print("    fn: %s\n", fn);
 
 			int type = 0;
-			if (FileExists(name, 0)) type = ST_FILE;
-			else if (PathIsDir(name, 0)) type = ST_USERDIR;
+			struct stat64 *st = getPathStat(name);
+			if (st && (st->st_mode & S_IFMT) == S_IFREG) type = ST_FILE;
+			else if (st && (st->st_mode & S_IFMT) == S_IFDIR) type = ST_USERDIR;
 			else
 			{
 				ret = ERROR_OBJECT_NOT_FOUND;
 				break;
 			}
 
-			time_t time = 0;
+			time_t time = st->st_mtime;
 			uint32_t size = 0;
-
-			struct stat64 *st = getPathStat(name);
-			if (st)
+			if (type == ST_FILE)
 			{
-				time = st->st_mtime;
-				if (type == ST_FILE)
-				{
-					if (st->st_size > UINT32_MAX) size = UINT32_MAX;
-					else size = (uint32_t)st->st_size;
-				}
+				if (st->st_size > UINT32_MAX) size = UINT32_MAX;
+				else size = (uint32_t)st->st_size;
 			}
 
 			res->disk_key = SWAP_INT(disk_key);
@@ -519,6 +861,7 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
+			sync_handle(key, &open_file_handles[key]);
 			const char *fn = open_file_handles[key].name;
 			int disk_key = 666;
 			int type = 0;
@@ -621,11 +964,10 @@ static int process_request(void *reqres_buffer)
 			}
 
 			DISKLED_ON;
-			uint32_t length = SWAP_INT(req->length);
-			length = FileReadAdv(&open_file_handles[key], shmem + DATA_BUFFER, length);
+			int length = share_read(key, &open_file_handles[key], shmem + DATA_BUFFER, SWAP_INT(req->length));
 
 			res->actual = SWAP_INT(length);
-			ret = 0;
+			ret = (length < 0) ? take_error(handle_io[key]) : 0;
 		}
 		break;
 
@@ -644,11 +986,10 @@ static int process_request(void *reqres_buffer)
 			}
 
 			DISKLED_ON;
-			uint32_t length = SWAP_INT(req->length);
-			length = FileWriteAdv(&open_file_handles[key], shmem + DATA_BUFFER, length);
+			int length = share_write(key, &open_file_handles[key], shmem + DATA_BUFFER, SWAP_INT(req->length));
 
 			res->actual = SWAP_INT(length);
-			ret = 0;
+			ret = (length < 0) ? take_error(handle_io[key]) : 0;
 		}
 		break;
 
@@ -666,6 +1007,8 @@ static int process_request(void *reqres_buffer)
 				break;
 			}
 
+			sync_handle(key, &open_file_handles[key]);
+			if (handle_io.count(key) && (ret = take_error(handle_io[key]))) break;
 			int old_pos = open_file_handles[key].offset;
 
 			int new_pos = SWAP_INT(req->new_pos);
@@ -698,13 +1041,8 @@ static int process_request(void *reqres_buffer)
 			EndRequest *req = (EndRequest*)reqres_buffer;
 			uint32_t key = SWAP_INT(req->arg1);
 
-			if (open_file_handles.find(key) != open_file_handles.end())
-			{
-				FileClose(&open_file_handles[key]);
-				open_file_handles.erase(key);
-			}
-
 			ret = 0;
+			if (open_file_handles.find(key) != open_file_handles.end()) ret = close_handle(key);
 		}
 		break;
 
@@ -918,12 +1256,18 @@ void minimig_share_poll()
 				*(uint16_t*)(shmem + REQUEST_FLG + 2) = (uint16_t)req_id;
 			}
 		}
+		else if (pending_writes && CheckTimer(flush_timer))
+		{
+			flush_all_writes();
+		}
 	}
 }
 
 void minimig_share_reset()
 {
+	while (!handle_io.empty()) close_handle(handle_io.begin()->first);
 	open_file_handles.clear();
+	dir_listings.clear();
 	locks.clear();
 	next_fp = 1;
 	next_key = 1;
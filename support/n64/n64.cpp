@@ -14,6 +14,7 @@
 #include "../../osd.h"
 #include "../../shmem.h"
 #include "../../lib/md5/md5.h"
+#include "../../file_hash.h"
 
 #include "miniz.h"
 #include "n64.h"
@@ -789,97 +790,259 @@ static bool parse_and_apply_db_tags(char* tags) {
 	return (system_type != SystemType::UNKNOWN && cic_type != CIC::UNKNOWN);
 }
 
-static bool md5_matches(const char* line, const char* md5) {
-	for (size_t i = MD5_LENGTH * 2; i > 0; --i, line++, md5++) {
-		int c = *line;
-		if (!c || *md5 != tolower(c)) {
-			return false;
-		}
+/* The database files are compiled into an index on first use: MD5 entries sorted
+   for binary search, cart ID patterns (which may contain wildcards) in file order,
+   and the tag strings. The index is kept in memory and saved to the config folder,
+   it's rebuilt when the size or date of the text file changes. */
+
+static constexpr uint32_t DB_INDEX_MAGIC = 0x31424436; // "6DB1"
+static constexpr uint32_t DB_TAGS_MALFORMED = 0x80000000;
+
+struct db_md5_entry {
+	uint8_t md5[MD5_LENGTH];
+	uint32_t tags; // offset in tags, DB_TAGS_MALFORMED set if the tags couldn't be parsed
+};
+
+struct db_id_entry {
+	char id[CARTID_LENGTH];
+	uint8_t len;
+	uint8_t line_end;
+	uint32_t tags;
+};
+
+struct db_index_header {
+	uint32_t magic;
+	int64_t src_mtime;
+	int64_t src_size;
+	uint32_t md5_count;
+	uint32_t id_count;
+	uint32_t tags_size;
+};
+
+struct db_index {
+	const char* name;
+	int64_t src_mtime;
+	int64_t src_size;
+	bool valid;
+	std::vector<db_md5_entry> md5s;
+	std::vector<db_id_entry> ids;
+	std::vector<char> tags;
+};
+
+static bool parse_md5(const char* str, uint8_t* md5) {
+	for (size_t i = 0; i < MD5_LENGTH * 2; i++) {
+		int c = tolower(str[i]);
+		uint8_t v;
+		if (c >= '0' && c <= '9') v = c - '0';
+		else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+		else return false;
+
+		if (i & 1) md5[i / 2] |= v;
+		else md5[i / 2] = v << 4;
 	}
 
 	return true;
 }
 
-// Returns numbers of matching characters if match, otherwize 0
-static size_t cart_id_is_match(const char* line, const char* cart_id) {
-	const auto prefix_len = strlen(CARTID_PREFIX);
+static bool md5_less(const db_md5_entry& a, const db_md5_entry& b) {
+	return memcmp(a.md5, b.md5, MD5_LENGTH) < 0;
+}
 
-	// A valid ID line should start with "ID:"
-	if (strncmp(line, CARTID_PREFIX, prefix_len)) {
-		return 0;
+static uint32_t db_add_tags(db_index* db, const char* s) {
+	uint32_t ofs = db->tags.size();
+	char* tags = new char[strlen(s) + 1];
+	if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
+		// keep the rest of the line for the error message
+		db->tags.insert(db->tags.end(), s, s + strlen(s) + 1);
+		ofs |= DB_TAGS_MALFORMED;
+	}
+	else {
+		db->tags.insert(db->tags.end(), tags, tags + strlen(tags) + 1);
 	}
+	delete[] tags;
+	return ofs;
+}
+
+static bool db_index_build(db_index* db, const char* path) {
+	fileTextReader reader = {};
+	if (!FileOpenTextReader(&reader, path)) return false;
 
-	// Skip the line if it doesn't match our cart_id, '_' = don't care
-	const char* lp = line + prefix_len;
-	for (size_t i = 0; i < CARTID_LENGTH && *lp; i++, lp++) {
-		if (i && isspace(*lp)) {
-			return i; // Early termination
+	db->md5s.clear();
+	db->ids.clear();
+	db->tags.clear();
+
+	while (const char* line = FileReadLine(&reader)) {
+		db_md5_entry m;
+		if (parse_md5(line, m.md5)) {
+			m.tags = db_add_tags(db, line + (MD5_LENGTH * 2));
+			db->md5s.push_back(m);
+			continue;
 		}
 
-		if (*lp != '_' && *lp != cart_id[i]) {
-			return 0; // Character didn't match pattern
+		if (!strncmp(line, CARTID_PREFIX, strlen(CARTID_PREFIX))) {
+			db_id_entry e = {};
+			const char* lp = line + strlen(CARTID_PREFIX);
+			for (e.len = 0; e.len < CARTID_LENGTH && lp[e.len]; e.len++) {
+				if (e.len && isspace(lp[e.len])) break;
+				e.id[e.len] = lp[e.len];
+			}
+
+			// ID running into the end of the line, matches but has no tags
+			e.line_end = e.len < CARTID_LENGTH && !lp[e.len];
+			e.tags = db_add_tags(db, lp + e.len);
+			db->ids.push_back(e);
 		}
 	}
 
-	return CARTID_LENGTH;
+	// the first entry in the file wins
+	std::stable_sort(db->md5s.begin(), db->md5s.end(), md5_less);
+	return true;
 }
 
-static uint8_t detect_rom_settings_in_db(const char* lookup_hash, const char* db_file_name) {
-	fileTextReader reader = {};
+static bool db_index_load(db_index* db, const char* idx_name) {
+	db_index_header hdr;
+	int size = FileLoadConfig(idx_name, nullptr, 0);
+	if (size < (int)sizeof(hdr)) return false;
+
+	std::vector<uint8_t> buf(size);
+	if (FileLoadConfig(idx_name, buf.data(), size) != size) return false;
+	memcpy(&hdr, buf.data(), sizeof(hdr));
+
+	if (hdr.magic != DB_INDEX_MAGIC || hdr.src_mtime != db->src_mtime || hdr.src_size != db->src_size) return false;
+
+	size_t md5_bytes = hdr.md5_count * sizeof(db_md5_entry);
+	size_t id_bytes = hdr.id_count * sizeof(db_id_entry);
+	if (sizeof(hdr) + md5_bytes + id_bytes + hdr.tags_size != (size_t)size) return false;
+	if (!hdr.tags_size || buf[size - 1]) return false;
+
+	const uint8_t* p = buf.data() + sizeof(hdr);
+	db->md5s.resize(hdr.md5_count);
+	memcpy(db->md5s.data(), p, md5_bytes);
+	p += md5_bytes;
+	db->ids.resize(hdr.id_count);
+	memcpy(db->ids.data(), p, id_bytes);
+	p += id_bytes;
+	db->tags.assign(p, p + hdr.tags_size);
+
+	for (auto& m : db->md5s) if ((m.tags & ~DB_TAGS_MALFORMED) >= hdr.tags_size) return false;
+	for (auto& e : db->ids) if ((e.tags & ~DB_TAGS_MALFORMED) >= hdr.tags_size) return false;
+	return true;
+}
+
+static void db_index_save(db_index* db, const char* idx_name) {
+	db_index_header hdr = {};
+	hdr.magic = DB_INDEX_MAGIC;
+	hdr.src_mtime = db->src_mtime;
+	hdr.src_size = db->src_size;
+	hdr.md5_count = db->md5s.size();
+	hdr.id_count = db->ids.size();
+	hdr.tags_size = db->tags.size();
+
+	std::vector<uint8_t> buf;
+	buf.insert(buf.end(), (uint8_t*)&hdr, (uint8_t*)(&hdr + 1));
+	buf.insert(buf.end(), (uint8_t*)db->md5s.data(), (uint8_t*)(db->md5s.data() + db->md5s.size()));
+	buf.insert(buf.end(), (uint8_t*)db->ids.data(), (uint8_t*)(db->ids.data() + db->ids.size()));
+	buf.insert(buf.end(), db->tags.begin(), db->tags.end());
+
+	FileSaveConfig(idx_name, buf.data(), buf.size());
+}
+
+static db_index* db_index_get(const char* db_file_name) {
+	static db_index indexes[4] = {};
+
+	db_index* db = nullptr;
+	for (auto& i : indexes) {
+		if (i.name == db_file_name || !i.name) {
+			db = &i;
+			break;
+		}
+	}
+	if (!db) return nullptr;
+	db->name = db_file_name;
 
 	snprintf(full_path, sizeof(full_path), "%s/%s", HomeDir(), db_file_name);
 
-	if (!FileOpenTextReader(&reader, full_path)) {
+	struct stat st;
+	if (stat(getFullPath(full_path), &st)) {
 		printf("Failed to open N64 data file \"%s\".\n", db_file_name);
-		return 0;
+		db->valid = false;
+		return nullptr;
 	}
 
-	while (const char* line = FileReadLine(&reader)) {
-		// Skip the line if it doesn't start with our hash
-		if (!md5_matches(line, lookup_hash)) continue;
+	if (db->valid && db->src_mtime == st.st_mtime && db->src_size == st.st_size) return db;
 
-		const char* s = line + (MD5_LENGTH * 2);
-		char* tags = new char[strlen(s) + 1];
-		if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
-			printf("Found ROM entry for MD5 %s, but the tag was malformed! (%s)\n", lookup_hash, s);
-			return 2;
-		}
+	db->src_mtime = st.st_mtime;
+	db->src_size = st.st_size;
+	db->valid = false;
 
-		printf("Found ROM entry for MD5 %s: [%s]\n", lookup_hash, tags);
+	char idx_name[256];
+	snprintf(idx_name, sizeof(idx_name), "%s.idx", db_file_name);
 
-		// 2 = System region and/or CIC wasn't in DB, will need further detection
-		return parse_and_apply_db_tags(tags) ? 3 : 2;
+	if (db_index_load(db, idx_name)) {
+		db->valid = true;
+	}
+	else if (db_index_build(db, full_path)) {
+		db->tags.push_back('\0');
+		printf("Compiled N64 data file \"%s\": %u MD5s, %u IDs.\n", db_file_name, (uint32_t)db->md5s.size(), (uint32_t)db->ids.size());
+		db_index_save(db, idx_name);
+		db->valid = true;
+	}
+	else {
+		printf("Failed to open N64 data file \"%s\".\n", db_file_name);
 	}
 
-	return 0;
+	return db->valid ? db : nullptr;
 }
 
-static uint8_t detect_rom_settings_in_db_with_cartid(const char* cart_id, const char* db_file_name) {
-	fileTextReader reader = {};
+static uint8_t detect_rom_settings_in_db(const char* lookup_hash, const char* db_file_name) {
+	db_index* db = db_index_get(db_file_name);
+	if (!db) return 0;
 
-	snprintf(full_path, sizeof(full_path), "%s/%s", HomeDir(), db_file_name);
+	db_md5_entry key;
+	if (!parse_md5(lookup_hash, key.md5)) return 0;
 
-	if (!FileOpenTextReader(&reader, full_path)) {
-		printf("Failed to open N64 data file \"%s\".\n", db_file_name);
-		return 0;
+	auto it = std::lower_bound(db->md5s.begin(), db->md5s.end(), key, md5_less);
+	if (it == db->md5s.end() || memcmp(it->md5, key.md5, MD5_LENGTH)) return 0;
+
+	char* tags = &db->tags[it->tags & ~DB_TAGS_MALFORMED];
+	if (it->tags & DB_TAGS_MALFORMED) {
+		printf("Found ROM entry for MD5 %s, but the tag was malformed! (%s)\n", lookup_hash, tags);
+		return 2;
 	}
 
-	while (const char* line = FileReadLine(&reader)) {
-		// Skip lines that doesn't start with our ID
+	printf("Found ROM entry for MD5 %s: [%s]\n", lookup_hash, tags);
+
+	// parsing modifies the tags
+	std::vector<char> tmp(tags, tags + strlen(tags) + 1);
+
+	// 2 = System region and/or CIC wasn't in DB, will need further detection
+	return parse_and_apply_db_tags(tmp.data()) ? 3 : 2;
+}
+
+static uint8_t detect_rom_settings_in_db_with_cartid(const char* cart_id, const char* db_file_name) {
+	db_index* db = db_index_get(db_file_name);
+	if (!db) return 0;
+
+	for (auto& e : db->ids) {
+		// Skip IDs that don't match ours, '_' = don't care
 		size_t i;
-		if (!(i = cart_id_is_match(line, cart_id))) continue;
+		for (i = 0; i < e.len; i++) {
+			if (e.id[i] != '_' && e.id[i] != cart_id[i]) break;
+		}
+		if (i < e.len) continue;
 
-		auto s = line + strlen(CARTID_PREFIX) + i;
-		auto tags = new char[strlen(s) + 1];
-		if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
-			printf("Found ROM entry for ID [%s], but the tag was malformed! \"%s\".\n", cart_id, s);
+		char* tags = &db->tags[e.tags & ~DB_TAGS_MALFORMED];
+		if (e.line_end || (e.tags & DB_TAGS_MALFORMED)) {
+			printf("Found ROM entry for ID [%s], but the tag was malformed! \"%s\".\n", cart_id, tags);
 			return 2;
 		}
 
 		printf("Found ROM entry for ID [%s]: \"%s\".\n", cart_id, tags);
 
+		std::vector<char> tmp(tags, tags + strlen(tags) + 1);
+
 		// 2 = System region and/or CIC wasn't in DB, will need further detection
-		return parse_and_apply_db_tags(tags) ? 3 : 2;
+		return parse_and_apply_db_tags(tmp.data()) ? 3 : 2;
 	}
 
 	return 0;
@@ -2856,7 +3019,7 @@ int n64_rom_tx(const char* name, const unsigned char idx, const uint32_t load_ad
 
 		// CRC32 is used for cheat look-up. Cheat files from gamehacking.org use byte swapped CRC32 for some reason...
 		normalize_data(buf, chunk, ByteOrder::BYTE_SWAPPED);
-		file_crc = crc32(file_crc, buf, chunk);
+		file_crc = file_crc32(file_crc, buf, chunk);
 	}
 
 	MD5Final(md5, &ctx);
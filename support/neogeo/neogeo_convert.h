@@ -0,0 +1,166 @@
+#ifndef NEOGEO_CONVERT_H
+#define NEOGEO_CONVERT_H
+
+// Conversion of C and S ROM data into the order used by the core.
+// The permutation is fixed within 32/64 word blocks, so whole blocks are
+// moved at once (NEON interleaving stores where available) and only a partial
+// block at the end goes through the index formula.
+
+#include <inttypes.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+static inline void spr_convert(const uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	/*
+	In C ROMs, a word provides two bitplanes for an 8-pixel wide line
+	They're used in pairs to provide 32 bits at once (all four bitplanes)
+	For one sprite tile, bytes are used like this: ([...] represents one 8-pixel wide line)
+	Even ROM					Odd ROM
+	[  40 41  ][  00 01  ]		[  42 43  ][  02 03  ]
+	[  44 45  ][  04 05  ]  	[  46 47  ][  06 07  ]
+	[  48 49  ][  08 09  ]  	[  4A 4B  ][  0A 0B  ]
+	[  4C 4D  ][  0C 0D  ]  	[  4E 4F  ][  0E 0F  ]
+	[  50 51  ][  10 11  ]  	[  52 53  ][  12 13  ]
+	...							...
+	The data read for a given tile line (16 pixels) is always the same, only the rendering order of the pixels can change
+	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 16 pixels of a tile
+	line can be read sequentially: () are 16-bit words, [] is the 4-word burst read
+	[(40 41) (00 01) (42 43) (02 03)]
+	[(44 45) (04 05) (46 47) (06 07)]...
+	Word interleaving is done on the FPGA side to mix the two C ROMs data (even/odd)
+
+	In:  FEDCBA9876 54321 0
+	Out: FEDCBA9876 15432 0
+
+	So each block of 32 words is the second half interleaved with the first:
+	0 <- 10, 1 <- 00, 2 <- 11, 3 <- 01, ...
+	*/
+
+	uint32_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		const uint16_t *in = buf_in + i;
+		uint16_t *out = buf_out + i;
+#ifdef __ARM_NEON
+		uint16x8x2_t lo = { { vld1q_u16(in + 16), vld1q_u16(in) } };
+		uint16x8x2_t hi = { { vld1q_u16(in + 24), vld1q_u16(in + 8) } };
+		vst2q_u16(out, lo);
+		vst2q_u16(out + 16, hi);
+#else
+		for (int j = 0; j < 16; j++)
+		{
+			out[j * 2] = in[16 + j];
+			out[j * 2 + 1] = in[j];
+		}
+#endif
+	}
+
+	for (; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+}
+
+// Same as spr_convert but only every other output word is written, the
+// words in between belong to the other ROM of the pair.
+static inline void spr_convert_skp(const uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	// no NEON here: the output is uncached FPGA memory and must not be read back to fill the gaps
+	uint32_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		const uint16_t *in = buf_in + i;
+		uint16_t *out = buf_out + (i << 1);
+		for (int j = 0; j < 16; j++)
+		{
+			out[j * 4] = in[16 + j];
+			out[j * 4 + 2] = in[j];
+		}
+	}
+
+	for (; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+}
+
+static inline void spr_convert_dbl(const uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	/*
+	Both bitplane pairs in one ROM, 64 word blocks:
+	Out: word pair 2n   <- swapped word pair 16+n of the input
+	     word pair 2n+1 <- swapped word pair n of the input
+	*/
+
+	uint32_t i = 0;
+	for (; i + 64 <= size; i += 64)
+	{
+		const uint16_t *in = buf_in + i;
+#ifdef __ARM_NEON
+		uint32_t *out = (uint32_t*)(buf_out + i);
+		for (int n = 0; n < 16; n += 4)
+		{
+			uint32x4x2_t v = { {
+				vreinterpretq_u32_u16(vrev32q_u16(vld1q_u16(in + 32 + n * 2))),
+				vreinterpretq_u32_u16(vrev32q_u16(vld1q_u16(in + n * 2)))
+			} };
+			vst2q_u32(out + n * 2, v);
+		}
+#else
+		uint16_t *out = buf_out + i;
+		for (int n = 0; n < 16; n++)
+		{
+			out[n * 4] = in[33 + n * 2];
+			out[n * 4 + 1] = in[32 + n * 2];
+			out[n * 4 + 2] = in[1 + n * 2];
+			out[n * 4 + 3] = in[n * 2];
+		}
+#endif
+	}
+
+	for (; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
+}
+
+static inline void fix_convert(const uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
+{
+	/*
+	In S ROMs, a byte provides two pixels
+	For one fix tile, bytes are used like this: ([...] represents a pair of pixels)
+	[10][18][00][08]
+	[11][19][01][09]
+	[12][1A][02][0A]
+	[13][1B][03][0B]
+	[14][1C][04][0C]
+	[15][1D][05][0D]
+	[16][1E][06][0E]
+	[17][1F][07][0F]
+	The data read for a given tile line (8 pixels) is always the same
+	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 8 pixels of a tile
+	line can be read sequentially: () are 16-bit words, [] is the 2-word burst read
+	[(10 18) (00 08)]
+	[(11 19) (01 09)]...
+
+	In:  FEDCBA9876543210
+	Out: FEDCBA9876510432
+	*/
+
+	uint32_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		const uint8_t *in = buf_in + i;
+		uint8_t *out = buf_out + i;
+#ifdef __ARM_NEON
+		uint8x8x4_t v = { { vld1_u8(in + 16), vld1_u8(in + 24), vld1_u8(in), vld1_u8(in + 8) } };
+		vst4_u8(out, v);
+#else
+		for (int r = 0; r < 8; r++)
+		{
+			out[r * 4] = in[16 + r];
+			out[r * 4 + 1] = in[24 + r];
+			out[r * 4 + 2] = in[r];
+			out[r * 4 + 3] = in[8 + r];
+		}
+#endif
+	}
+
+	for (; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
+}
+
+#endif
@@ -0,0 +1,122 @@
+#ifdef NEOGEO_CONVERT_UNITTEST
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include "neogeo_convert.h"
+
+// Reference versions: the plain index formulas
+
+static void spr_convert_ref(const uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+}
+
+static void spr_convert_skp_ref(const uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+}
+
+static void spr_convert_dbl_ref(const uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
+}
+
+static void fix_convert_ref(const uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
+}
+
+typedef void (*conv16_t)(const uint16_t*, uint16_t*, uint32_t);
+
+static double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+#define BENCH_SIZE (16 * 1024 * 1024)
+
+static uint8_t *in, *out_ref, *out;
+
+static int check16(const char *name, conv16_t ref, conv16_t fast, int skp)
+{
+	// odd sizes cover the partial block at the end
+	static const uint32_t sizes[] = { 32, 64, 100, 2048, 4096 + 17, 65536 };
+	for (uint32_t size : sizes)
+	{
+		uint32_t outsz = size * 2 * (skp ? 2 : 1);
+		memset(out_ref, 0x55, outsz);
+		memset(out, 0x55, outsz);
+		ref((uint16_t*)in, (uint16_t*)out_ref, size);
+		fast((uint16_t*)in, (uint16_t*)out, size);
+		if (memcmp(out_ref, out, outsz))
+		{
+			printf("%s: mismatch with size %u\n", name, size);
+			return 1;
+		}
+	}
+
+	uint32_t words = BENCH_SIZE / (skp ? 4 : 2);
+	memset(out_ref, 0, BENCH_SIZE);
+	memset(out, 0, BENCH_SIZE);
+	double t0 = now_ms();
+	ref((uint16_t*)in, (uint16_t*)out_ref, words);
+	double t1 = now_ms();
+	fast((uint16_t*)in, (uint16_t*)out, words);
+	double t2 = now_ms();
+
+	printf("%-16s ok, reference %7.1fms, converted %7.1fms\n", name, t1 - t0, t2 - t1);
+	return memcmp(out_ref, out, BENCH_SIZE) ? 1 : 0;
+}
+
+static int check_fix()
+{
+	static const uint32_t sizes[] = { 32, 100, 4096, 4096 + 5, 65536 };
+	for (uint32_t size : sizes)
+	{
+		memset(out_ref, 0x55, size);
+		memset(out, 0x55, size);
+		fix_convert_ref(in, out_ref, size);
+		fix_convert(in, out, size);
+		if (memcmp(out_ref, out, size))
+		{
+			printf("fix_convert: mismatch with size %u\n", size);
+			return 1;
+		}
+	}
+
+	double t0 = now_ms();
+	fix_convert_ref(in, out_ref, BENCH_SIZE);
+	double t1 = now_ms();
+	fix_convert(in, out, BENCH_SIZE);
+	double t2 = now_ms();
+
+	printf("%-16s ok, reference %7.1fms, converted %7.1fms\n", "fix_convert", t1 - t0, t2 - t1);
+	return memcmp(out_ref, out, BENCH_SIZE) ? 1 : 0;
+}
+
+int main()
+{
+	in = (uint8_t*)malloc(BENCH_SIZE);
+	out_ref = (uint8_t*)malloc(BENCH_SIZE);
+	out = (uint8_t*)malloc(BENCH_SIZE);
+
+	srand(1);
+	for (uint32_t i = 0; i < BENCH_SIZE; i++) in[i] = rand();
+
+	int err = 0;
+	err |= check16("spr_convert", spr_convert_ref, spr_convert, 0);
+	err |= check16("spr_convert_skp", spr_convert_skp_ref, spr_convert_skp, 1);
+	err |= check16("spr_convert_dbl", spr_convert_dbl_ref, spr_convert_dbl, 0);
+	err |= check_fix();
+
+	printf(err ? "FAILED\n" : "PASSED\n");
+	return err;
+}
+
+// g++ -O3 -DNEOGEO_CONVERT_UNITTEST neogeo_convert_unittest.cpp && ./a.out
+// or with the ARM toolchain to check the NEON versions on the target.
+#endif
@@ -5,7 +5,9 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <time.h>   // clock_gettime, CLOCK_REALTIME
+#include <pthread.h>
 #include "neogeo_loader.h"
+#include "neogeo_convert.h"
 #include "neogeocd.h"
 #include "../../sxmlc.h"
 #include "../../user_io.h"
@@ -13,6 +15,7 @@
 #include "../../osd.h"
 #include "../../menu.h"
 #include "../../shmem.h"
+#include "../../offload.h"
 
 struct NeoFile
 {
@@ -28,86 +31,6 @@ struct NeoFile
 	uint8_t Filler2[4096 - 512];	//fill to 4096
 };
 
-static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
-{
-	/*
-	In C ROMs, a word provides two bitplanes for an 8-pixel wide line
-	They're used in pairs to provide 32 bits at once (all four bitplanes)
-	For one sprite tile, bytes are used like this: ([...] represents one 8-pixel wide line)
-	Even ROM					Odd ROM
-	[  40 41  ][  00 01  ]		[  42 43  ][  02 03  ]
-	[  44 45  ][  04 05  ]  	[  46 47  ][  06 07  ]
-	[  48 49  ][  08 09  ]  	[  4A 4B  ][  0A 0B  ]
-	[  4C 4D  ][  0C 0D  ]  	[  4E 4F  ][  0E 0F  ]
-	[  50 51  ][  10 11  ]  	[  52 53  ][  12 13  ]
-	...							...
-	The data read for a given tile line (16 pixels) is always the same, only the rendering order of the pixels can change
-	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 16 pixels of a tile
-	line can be read sequentially: () are 16-bit words, [] is the 4-word burst read
-	[(40 41) (00 01) (42 43) (02 03)]
-	[(44 45) (04 05) (46 47) (06 07)]...
-	Word interleaving is done on the FPGA side to mix the two C ROMs data (even/odd)
-
-	In:  FEDCBA9876 54321 0
-	Out: FEDCBA9876 15432 0
-	*/
-
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
-
-	/*
-	0 <- 20
-	1 <- 21
-	2 <- 00
-	3 <- 01
-	4 <- 22
-	5 <- 23
-	6 <- 02
-	7 <- 03
-	...
-
-	00 -> 02
-	01 -> 03
-	02 -> 06
-	03 -> 07
-	...
-	*/
-}
-
-static inline void spr_convert_skp(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
-{
-	for (uint32_t i = 0; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
-}
-
-static inline void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
-{
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
-}
-
-static void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
-{
-	/*
-	In S ROMs, a byte provides two pixels
-	For one fix tile, bytes are used like this: ([...] represents a pair of pixels)
-	[10][18][00][08]
-	[11][19][01][09]
-	[12][1A][02][0A]
-	[13][1B][03][0B]
-	[14][1C][04][0C]
-	[15][1D][05][0D]
-	[16][1E][06][0E]
-	[17][1F][07][0F]
-	The data read for a given tile line (8 pixels) is always the same
-	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 8 pixels of a tile
-	line can be read sequentially: () are 16-bit words, [] is the 2-word burst read
-	[(10 18) (00 08)]
-	[(11 19) (01 09)]...
-
-	In:  FEDCBA9876543210
-	Out: FEDCBA9876510432
-	*/
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
-}
-
 static const char *get_name(const char *path, const char *name)
 {
 	static char buf[1024];
@@ -214,6 +137,138 @@ static void make_path(const char *root, const char *name, char *path)
 }
 
 extern uint8_t loadbuf[];
+
+// ROM files are read on the other core while the main thread converts the
+// previous part and writes it to the core memory. Falls back to reading into
+// loadbuf if the reader can't be started.
+#define NEO_PIPE_BUFS 2
+
+static pthread_mutex_t neo_pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t neo_pipe_cond = PTHREAD_COND_INITIALIZER;
+
+static struct
+{
+	uint8_t *buf[NEO_PIPE_BUFS];
+	uint32_t len[NEO_PIPE_BUFS];
+	uint32_t head, tail;
+	bool running, held, done, abort;
+} neo_pipe = {};
+
+static void neo_pipe_reader(fileTYPE *f, uint32_t size, uint32_t chunk)
+{
+	auto &p = neo_pipe;
+
+	while (size)
+	{
+		pthread_mutex_lock(&neo_pipe_lock);
+		while (p.head - p.tail == NEO_PIPE_BUFS && !p.abort) pthread_cond_wait(&neo_pipe_cond, &neo_pipe_lock);
+		bool abort = p.abort;
+		uint32_t slot = p.head % NEO_PIPE_BUFS;
+		pthread_mutex_unlock(&neo_pipe_lock);
+		if (abort) break;
+
+		uint32_t part = (size > chunk) ? chunk : size;
+		int len = FileReadAdv(f, p.buf[slot], part);
+		if (len < 0) len = 0;
+
+		pthread_mutex_lock(&neo_pipe_lock);
+		p.len[slot] = len;
+		p.head++;
+		pthread_cond_signal(&neo_pipe_cond);
+		pthread_mutex_unlock(&neo_pipe_lock);
+
+		if ((uint32_t)len < part) break;
+		size -= part;
+	}
+
+	pthread_mutex_lock(&neo_pipe_lock);
+	p.done = true;
+	pthread_cond_signal(&neo_pipe_cond);
+	pthread_mutex_unlock(&neo_pipe_lock);
+}
+
+// the file is read in parts of chunk bytes (up to LOADBUF_SZ), the last one may be shorter
+static void neo_pipe_start(fileTYPE *f, uint32_t size, uint32_t chunk)
+{
+	auto &p = neo_pipe;
+
+	p.head = p.tail = 0;
+	p.held = p.done = p.abort = false;
+	p.running = true;
+	for (int i = 0; i < NEO_PIPE_BUFS; i++)
+	{
+		p.buf[i] = (uint8_t*)malloc(LOADBUF_SZ);
+		if (!p.buf[i]) p.running = false;
+	}
+
+	// the main thread blocks on the reader, so don't queue it behind other jobs
+	if (p.running && !offload_worker_idle()) p.running = false;
+	if (p.running && !offload_try_add_work([f, size, chunk]() { neo_pipe_reader(f, size, chunk); }, nullptr, OFFLOAD_PRIO_HIGH)) p.running = false;
+
+	if (!p.running)
+	{
+		for (int i = 0; i < NEO_PIPE_BUFS; i++)
+		{
+			free(p.buf[i]);
+			p.buf[i] = 0;
+		}
+	}
+}
+
+// returns the next part of the file, must be followed by neo_pipe_next()
+static uint32_t neo_pipe_get(fileTYPE *f, uint32_t part, uint8_t **buf)
+{
+	auto &p = neo_pipe;
+
+	if (!p.running)
+	{
+		*buf = loadbuf;
+		int len = part ? FileReadAdv(f, loadbuf, part) : 0;
+		return (len > 0) ? len : 0;
+	}
+
+	pthread_mutex_lock(&neo_pipe_lock);
+	while (p.tail == p.head && !p.done) pthread_cond_wait(&neo_pipe_cond, &neo_pipe_lock);
+	uint32_t slot = p.tail % NEO_PIPE_BUFS;
+	p.held = p.tail != p.head;
+	uint32_t len = p.held ? p.len[slot] : 0;
+	pthread_mutex_unlock(&neo_pipe_lock);
+
+	*buf = p.buf[slot];
+	return len;
+}
+
+static void neo_pipe_next()
+{
+	auto &p = neo_pipe;
+	if (!p.running || !p.held) return;
+
+	pthread_mutex_lock(&neo_pipe_lock);
+	p.tail++;
+	p.held = false;
+	pthread_cond_signal(&neo_pipe_cond);
+	pthread_mutex_unlock(&neo_pipe_lock);
+}
+
+static void neo_pipe_stop()
+{
+	auto &p = neo_pipe;
+	if (!p.running) return;
+
+	pthread_mutex_lock(&neo_pipe_lock);
+	p.abort = true;
+	pthread_cond_signal(&neo_pipe_cond);
+	while (!p.done) pthread_cond_wait(&neo_pipe_cond, &neo_pipe_lock);
+	pthread_mutex_unlock(&neo_pipe_lock);
+
+	for (int i = 0; i < NEO_PIPE_BUFS; i++)
+	{
+		free(p.buf[i]);
+		p.buf[i] = 0;
+	}
+	p.running = false;
+}
+
 static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t index, uint32_t offset, uint32_t size)
 {
 	fileTYPE f = {};
@@ -240,6 +295,7 @@ static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t ind
 	uint32_t map_addr = 0x38000000 + (((index - 64) >> 1) * 1024 * 1024);
 
 	ProgressMessage();
+	neo_pipe_start(&f, size / 2, LOADBUF_SZ / 2);
 	while (remain)
 	{
 		uint32_t partsz = remain;
@@ -249,12 +305,16 @@ static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t ind
 		void *base = shmem_map(map_addr, partsz);
 		if (!base)
 		{
+			neo_pipe_stop();
 			FileClose(&f);
 			return 0;
 		}
 
-		FileReadAdv(&f, loadbuf, partsz/2);
-		spr_convert_skp((uint16_t*)loadbuf, ((uint16_t*)base) + ((index ^ 1) & 1), partsz / 4);
+		uint8_t *src;
+		uint32_t len = neo_pipe_get(&f, partsz / 2, &src);
+		if (len < partsz / 2) memset(src + len, 0, partsz / 2 - len);
+		spr_convert_skp((uint16_t*)src, ((uint16_t*)base) + ((index ^ 1) & 1), partsz / 4);
+		neo_pipe_next();
 
 		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
 
@@ -263,6 +323,7 @@ static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t ind
 		map_addr += partsz;
 	}
 
+	neo_pipe_stop();
 	FileClose(&f);
 	ProgressMessage();
 
@@ -299,7 +360,11 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 
 	uint32_t map_addr = 0x30000000 + (addr ? (addr + 0x8000000) : ((index >= 16) && (index < 64)) ? (index - 16) * 0x80000 : (index == 9) ? 0x2000000 : 0x8000000);
 
+	// other types are read straight into the core memory
+	bool convert = neo_file_type == NEO_FILE_FIX || neo_file_type == NEO_FILE_SPR;
+
 	ProgressMessage();
+	if (convert) neo_pipe_start(&f, remainf, LOADBUF_SZ);
 	while (remain)
 	{
 		uint32_t partsz = remain;
@@ -312,22 +377,27 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 		void *base = shmem_map(map_addr, partsz);
 		if (!base)
 		{
+			if (convert) neo_pipe_stop();
 			FileClose(&f);
 			return 0;
 		}
 
-		if (neo_file_type == NEO_FILE_FIX)
+		if (convert)
 		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			fix_convert(loadbuf, (uint8_t*)base, partsz);
-		}
-		else if (neo_file_type == NEO_FILE_SPR)
-		{
-			memset(loadbuf, 0, partsz);
-			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			if (swap) spr_bswap((uint32_t*)loadbuf, partsz / 4);
-			spr_convert_dbl((uint16_t*)loadbuf, (uint16_t*)base, partsz / 2);
+			uint8_t *src;
+			uint32_t len = neo_pipe_get(&f, partszf, &src);
+			if (len < partsz) memset(src + len, 0, partsz - len);
+
+			if (neo_file_type == NEO_FILE_FIX)
+			{
+				fix_convert(src, (uint8_t*)base, partsz);
+			}
+			else
+			{
+				if (swap) spr_bswap((uint32_t*)src, partsz / 4);
+				spr_convert_dbl((uint16_t*)src, (uint16_t*)base, partsz / 2);
+			}
+			neo_pipe_next();
 		}
 		else
 		{
@@ -342,6 +412,7 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 		map_addr += partsz;
 	}
 
+	if (convert) neo_pipe_stop();
 	FileClose(&f);
 	ProgressMessage();
 
@@ -8,6 +8,7 @@
 #include "../../user_io.h"
 
 #include "../chd/mister_chd.h"
+#include "../../cd_cache.h"
 #include "pcecd.h"
 
 #define PCECD_DATA_IO_INDEX 2
@@ -263,14 +264,6 @@ int pcecdd_t::Load(const char *filename)
 		if (LoadCUE(filename)) return -1;
 	} else if (!strncasecmp(".chd", ext, 4)) {
 		mister_load_chd(filename, &this->toc);
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
 	} else {
 		return -1;
 	}
@@ -305,14 +298,8 @@ void pcecdd_t::Unload()
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
+			mister_chd_close(this->toc.chd_f);
 			this->toc.chd_f = NULL;
-			if (this->chd_hunkbuf)
-			{
-				free(this->chd_hunkbuf);
-				this->chd_hunkbuf = NULL;
-				this->chd_hunknum = -1;
-			}
 		} else {
 			for (int i = 0; i < this->toc.last; i++)
 			{
@@ -917,15 +904,14 @@ void pcecdd_t::ReadData(uint8_t *buf)
 				s_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, s_offset, 2048, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, s_offset, 2048, buf);
 		} else {
 			if (this->toc.tracks[this->index].sector_size == 2048)
 			{
-				FileSeek(&this->toc.tracks[this->index].f, this->lba * 2048 - this->toc.tracks[this->index].offset, SEEK_SET);
+				cdcache_read_file(&this->toc.tracks[this->index].f, this->lba * 2048 - this->toc.tracks[this->index].offset, buf, 2048);
 			} else {
-				FileSeek(&this->toc.tracks[this->index].f, this->lba * 2352 + 16 - this->toc.tracks[this->index].offset, SEEK_SET);
+				cdcache_read_file(&this->toc.tracks[this->index].f, this->lba * 2352 + 16 - this->toc.tracks[this->index].offset, buf, 2048);
 			}
-			FileReadAdv(&this->toc.tracks[this->index].f, buf, 2048);
 		}
 	}
 }
@@ -938,7 +924,7 @@ int pcecdd_t::ReadCDDA(uint8_t *buf)
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, 0, this->audioLength, buf, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, 0, this->audioLength, buf);
 		for (int swapidx = 0; swapidx < this->audioLength; swapidx += 2)
 		{
 			uint8_t temp = buf[swapidx];
@@ -13,11 +13,10 @@
 #include "mcdheader.h"
 #include "../../cd.h"
 #include "../chd/mister_chd.h"
+#include "../../cd_cache.h"
 #include <libchdr/chd.h>
 
 static char buf[1024];
-static uint8_t *chd_hunkbuf = NULL;
-static int chd_hunknum;
 static int noreset = 0;
 
 static int sgets(char *out, int sz, char **in)
@@ -107,12 +106,9 @@ static void unload_chd(toc_t *table)
 {
 	if (table->chd_f)
 	{
-		chd_close(table->chd_f);
+		mister_chd_close(table->chd_f);
 	}
-	if (chd_hunkbuf) free(chd_hunkbuf);
 	memset(table, 0, sizeof(toc_t));
-	chd_hunknum = -1;
-
 }
 
 static void unload_cue(toc_t *table)
@@ -155,9 +151,6 @@ static int load_chd(const char *filename, toc_t *table)
 
 	table->end = table->tracks[table->last - 1].end + 1;
 
-	chd_hunkbuf = (uint8_t *)malloc(table->chd_hunksize);
-	chd_hunknum = -1;
-
 	return 1;
 }
 
@@ -488,16 +481,9 @@ void psx_read_cd(uint8_t *buffer, int lba, int cnt)
 			{
 				if (lba >= toc.tracks[i].start && lba <= toc.tracks[i].end)
 				{
-					if (!toc.chd_f)
-					{
-						if (toc.tracks[i].offset)
-            {
-							FileSeek(&toc.tracks[0].f, toc.tracks[i].offset+((lba-toc.tracks[i].start)*CD_SECTOR_LEN), SEEK_SET);
+					__off64_t file_ofs = (__off64_t)(lba - toc.tracks[i].start) * CD_SECTOR_LEN;
+					if (toc.tracks[i].offset) file_ofs += toc.tracks[i].offset;
 
-            }else {
-							FileSeek(&toc.tracks[i].f, (lba - toc.tracks[i].start) * CD_SECTOR_LEN, SEEK_SET);
-            }
-					}
 					while (cnt)
 					{
             if (toc.tracks[i+1].pregap && lba > (toc.tracks[i+1].start-toc.tracks[i+1].indexes[1]))
@@ -516,7 +502,7 @@ void psx_read_cd(uint8_t *buffer, int lba, int cnt)
 
 							// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
 							int read_lba = lba - toc.tracks[0].indexes[1];
-							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer, chd_hunkbuf, &chd_hunknum) == CHDERR_NONE)
+							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer) == CHDERR_NONE)
 							{
 								if (!toc.tracks[i].type) //CHD requires byteswap of audio data
 								{
@@ -534,10 +520,11 @@ void psx_read_cd(uint8_t *buffer, int lba, int cnt)
 						}
 						else {
 							if (toc.tracks[i].offset)
-								FileReadAdv(&toc.tracks[0].f, buffer, CD_SECTOR_LEN);
+								cdcache_read_file(&toc.tracks[0].f, file_ofs, buffer, CD_SECTOR_LEN);
 							else
-								FileReadAdv(&toc.tracks[i].f, buffer, CD_SECTOR_LEN);
+								cdcache_read_file(&toc.tracks[i].f, file_ofs, buffer, CD_SECTOR_LEN);
 						}
+						file_ofs += CD_SECTOR_LEN;
 						if ((lba + 1) > toc.tracks[i].end) break;
 						buffer += CD_SECTOR_LEN;
 						cnt--;
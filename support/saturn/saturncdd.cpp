@@ -7,6 +7,7 @@
 #include "saturn.h"
 #include "../../shmem.h"
 #include "../chd/mister_chd.h"
+#include "../../cd_cache.h"
 
 #define SHMEM_ADDR  0x31000000
 
@@ -28,8 +29,6 @@ satcdd_t::satcdd_t() {
 	speed = 0;
 	audioLength = 0;
 	audioFirst = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
 	SendData = NULL;
 
 	stat[0] = SATURN_STAT_OPEN;
@@ -336,13 +335,6 @@ int satcdd_t::Load(const char *filename)
 			return -1;
 		}
 
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
 		if (this->toc.tracks[0].sector_size)
 		{
 			this->sectorSize = this->toc.tracks[0].sector_size;
@@ -355,7 +347,7 @@ int satcdd_t::Load(const char *filename)
 
 	/*if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header);
 	}
 	else {
 		fd_img = &this->toc.tracks[0].f;
@@ -400,13 +392,7 @@ void satcdd_t::Unload()
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
-		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
+			mister_chd_close(this->toc.chd_f);
 		}
 
 		for (int i = 0; i < this->toc.last; i++)
@@ -441,7 +427,7 @@ int satcdd_t::GetBootHeader(uint8_t *buf) {
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf);
 	}
 	else 
 	{
@@ -1202,19 +1188,17 @@ void satcdd_t::ReadData(uint8_t *buf)
 				read_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->toc.tracks[this->track].sector_size, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->toc.tracks[this->track].sector_size, buf);
 		}
 		else {
 			if (this->toc.tracks[this->track].sector_size == 2048)
 			{
 				offs = (lba_ * 2048) - this->toc.tracks[this->track].offset;
-				FileSeek(&this->toc.tracks[this->track].f, offs, SEEK_SET);
-				FileReadAdv(&this->toc.tracks[this->track].f, buf + 16, 2048);
+				cdcache_read_file(&this->toc.tracks[this->track].f, offs, buf + 16, 2048);
 			}
 			else {
 				offs = (lba_ * 2352) - this->toc.tracks[this->track].offset;
-				FileSeek(&this->toc.tracks[this->track].f, offs, SEEK_SET);
-				FileReadAdv(&this->toc.tracks[this->track].f, buf, 2352);
+				cdcache_read_file(&this->toc.tracks[this->track].f, offs, buf, 2352);
 			}
 #ifdef SATURN_DEBUG
 			//printf("\x1b[32mSaturn: ");
@@ -1234,7 +1218,7 @@ int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 	{
 		for (int i = sec_offs; i < 2; i++, dest += 4096)
 		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + i, 0, 0, 2352, dest, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + i, 0, 0, 2352, dest);
 
 			//CHD audio requires byteswap. There's probably a better way to do this...
 			for (int swapidx = 0; swapidx < 2352; swapidx += 2)
@@ -1254,8 +1238,7 @@ int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 		int offs = (this->lba * 2352) - this->toc.tracks[this->track].offset;
 		for (int i = sec_offs; i < 2; i++, dest += 4096)
 		{
-			FileSeek(&this->toc.tracks[this->track].f, offs + (i * 2352), SEEK_SET);
-			FileReadAdv(&this->toc.tracks[this->track].f, dest, 2352);
+			cdcache_read_file(&this->toc.tracks[this->track].f, offs + (i * 2352), dest, 2352);
 		}
 	}
 
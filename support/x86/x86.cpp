@@ -760,8 +760,6 @@ static void fdd_io(uint8_t read)
 
 void x86_poll(int only_ide)
 {
-	if(!only_ide) x86_share_poll();
-
 	uint16_t sd_req = ide_check();
 	if (sd_req)
 	{
@@ -31,11 +31,16 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <sys/statvfs.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/inotify.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <map>
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 #include "../../hardware.h"
 #include "../../user_io.h"
@@ -51,6 +56,7 @@ static uint8_t *shmem = 0;
 #define REQUEST_BUFFER  4
 #define HDRLEN          8
 #define DATA_BUFFER     (REQUEST_BUFFER+66)
+#define MULTI_MAX       ((SHMEM_SIZE - REQUEST_BUFFER - HDRLEN) / 24)
 
 //#define DEBUG
 
@@ -82,6 +88,7 @@ enum AL_SUBFUNCTIONS {
 	AL_SKFMEND    = 0x21,
 	AL_QUALIFY    = 0x23,
 	AL_SPOPEN     = 0x2E,
+	AL_FINDMULTI  = 0x80, // MiSTer extension: FINDNEXT returning as many entries as fit
 	AL_UNKNOWN    = 0xFF
 };
 
@@ -173,6 +180,178 @@ static short get_fp()
 	return fp;
 }
 
+// Stat results and directory listings of the shared folder are cached. Every
+// directory with cached entries is watched with inotify and the entries of a
+// changed directory are dropped before the next request is processed.
+// inotify doesn't see changes made by other hosts, so nothing is cached for
+// directories on network filesystems.
+#define CACHE_MAX 8192
+
+#ifndef CIFS_SUPER_MAGIC
+#define CIFS_SUPER_MAGIC 0xFF534D42
+#endif
+#ifndef SMB2_SUPER_MAGIC
+#define SMB2_SUPER_MAGIC 0xFE534D42
+#endif
+#define FUSE_SUPER_MAGIC 0x65735546
+
+struct dir_cache_t
+{
+	int wd; // -1: not cached
+	bool listed;
+	std::vector<dir_item_t> items;
+};
+
+static int notify_fd = -1;
+static std::unordered_map<std::string, stat64> stat_cache; // st_mode == 0: does not exist
+static std::unordered_map<std::string, dir_cache_t> dir_cache;
+static std::unordered_map<int, std::string> watch_dirs;
+
+static void cache_clear()
+{
+	for (auto &pair : watch_dirs) inotify_rm_watch(notify_fd, pair.first);
+	watch_dirs.clear();
+	dir_cache.clear();
+	stat_cache.clear();
+}
+
+static void cache_forget_dir(const std::string &dir, const char *name)
+{
+	auto it = dir_cache.find(dir);
+	if (it != dir_cache.end())
+	{
+		it->second.listed = false;
+		it->second.items.clear();
+	}
+
+	if (name && *name) stat_cache.erase(dir + "/" + name);
+}
+
+static void cache_update()
+{
+	if (notify_fd == -1)
+	{
+		notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (notify_fd < 0) notify_fd = -2;
+		return;
+	}
+	if (notify_fd < 0) return;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int len;
+	while ((len = read(notify_fd, buf, sizeof(buf))) > 0)
+	{
+		for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+		{
+			struct inotify_event *ev = (struct inotify_event *)p;
+
+			// a directory went away or was renamed, everything below it is stale
+			if ((ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) ||
+				((ev->mask & IN_ISDIR) && (ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))))
+			{
+				if (!(ev->mask & IN_IGNORED) || watch_dirs.count(ev->wd))
+				{
+					dbg_print("share cache: flush (%08X)\n", ev->mask);
+					cache_clear();
+					return;
+				}
+				continue;
+			}
+
+			auto it = watch_dirs.find(ev->wd);
+			if (it != watch_dirs.end()) cache_forget_dir(it->second, ev->len ? ev->name : nullptr);
+		}
+	}
+}
+
+static bool is_network_fs(const char *path)
+{
+	struct statfs fs;
+	if (statfs(path, &fs)) return false;
+
+	switch ((uint32_t)fs.f_type)
+	{
+	case NFS_SUPER_MAGIC:
+	case SMB_SUPER_MAGIC:
+	case CIFS_SUPER_MAGIC:
+	case SMB2_SUPER_MAGIC:
+	case V9FS_MAGIC:
+	case FUSE_SUPER_MAGIC:
+		return true;
+	}
+	return false;
+}
+
+static dir_cache_t *watch_dir(const std::string &dir)
+{
+	if (notify_fd < 0) return nullptr;
+
+	auto it = dir_cache.find(dir);
+	if (it != dir_cache.end()) return (it->second.wd >= 0) ? &it->second : nullptr;
+
+	if (stat_cache.size() + dir_cache.size() >= CACHE_MAX) cache_clear();
+
+	if (is_network_fs(getFullPath(dir.c_str())))
+	{
+		dir_cache[dir].wd = -1;
+		return nullptr;
+	}
+
+	int wd = inotify_add_watch(notify_fd, getFullPath(dir.c_str()), IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB |
+		IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+	if (wd < 0) return nullptr;
+
+	watch_dirs[wd] = dir;
+	dir_cache_t *dc = &dir_cache[dir];
+	dc->wd = wd;
+	dc->listed = false;
+	return dc;
+}
+
+static stat64 *share_stat(const char *path)
+{
+	auto it = stat_cache.find(path);
+	if (it != stat_cache.end()) return it->second.st_mode ? &it->second : nullptr;
+
+	stat64 *st = getPathStat(path);
+
+	const char *p = strrchr(path, '/');
+	if (!p || !watch_dir(std::string(path, p - path))) return st;
+
+	stat64 &cached = stat_cache[path];
+	if (st) cached = *st;
+	else memset(&cached, 0, sizeof(cached));
+	return st ? &cached : nullptr;
+}
+
+// all entries of a directory with their stats, raw names
+static std::vector<dir_item_t> *list_dir(const char *path)
+{
+	static std::vector<dir_item_t> uncached;
+	static char str[1024];
+
+	dir_cache_t *dc = watch_dir(path);
+	if (dc && dc->listed) return &dc->items;
+
+	std::vector<dir_item_t> *items = dc ? &dc->items : &uncached;
+	items->clear();
+
+	DIR *d = opendir(getFullPath(path));
+	if (!d) return nullptr;
+
+	struct dirent64 *de;
+	while ((de = readdir64(d)))
+	{
+		snprintf(str, sizeof(str), "%s/%s", path, de->d_name);
+		stat64 *st = share_stat(str);
+		if (st) items->push_back({ *de, *st });
+	}
+	closedir(d);
+
+	if (dc) dc->listed = true;
+	return items;
+}
+
 static char* find_path(const char *name)
 {
 	dbg_print("find_path(%s)\n", name);
@@ -259,7 +438,8 @@ static char* find_path(const char *name)
 		else
 		{
 			*p = 0;
-			if (!PathIsDir(str, 0)) str[0] = 0;
+			stat64 *st = share_stat(str);
+			if (!st || (st->st_mode & S_IFMT) != S_IFDIR) str[0] = 0;
 			else *p = '/';
 		}
 	}
@@ -291,7 +471,9 @@ static uint32_t get_attr(char *path, uint16_t *time, uint16_t *date, uint32_t *s
 	if (date) *date = 0;
 	if (size) *size = 0;
 
-	stat64 *st = getPathStat(path);
+	// pick up changes made by the current request
+	cache_update();
+	stat64 *st = share_stat(path);
 	if (!st) return 0;
 
 	tm *t = localtime(&st->st_mtime);
@@ -405,6 +587,34 @@ static int cmp_name(const char *name, const char *flt)
 	return 1;
 }
 
+// one FINDFIRST/FINDNEXT result, 24 bytes
+static int put_dir_item(char *buf, short key, unsigned short idx)
+{
+	dir_item_t *item = &locks[key].dir_items[idx];
+
+	*buf++ = (item->de.d_type == DT_DIR) ? FAT_DIR : 0;
+	memcpyb(buf, item->de.d_name, 11);
+	buf += 11;
+
+	tm *t = localtime(&item->st.st_mtime);
+	uint16_t time = (t->tm_sec / 2) | (t->tm_min << 5) | (t->tm_hour << 11);
+	uint16_t date = t->tm_mday | ((t->tm_mon + 1) << 5) | ((t->tm_year - 80) << 9);
+
+	*buf++ = time;
+	*buf++ = time >> 8;
+	*buf++ = date;
+	*buf++ = date >> 8;
+
+	memcpyb(buf, &item->st.st_size, 4);
+	buf += 4;
+	*buf++ = key;
+	*buf++ = key >> 8;
+	*buf++ = idx;
+	*buf++ = idx >> 8;
+
+	return 24;
+}
+
 static int process_request(void *reqres_buffer)
 {
 	static char str[1024];
@@ -451,6 +661,8 @@ static int process_request(void *reqres_buffer)
 	char *buf = ((char*)reqres_buffer) + 8;
 	buf[len] = 0;
 
+	cache_update();
+
 	switch (func)
 	{
 	case AL_RMDIR:
@@ -523,7 +735,8 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
-		if (!FileExists(path, 0))
+		stat64 *st = share_stat(path);
+		if (!st || (st->st_mode & S_IFMT) != S_IFREG)
 		{
 			res = 2;
 			break;
@@ -645,7 +858,8 @@ static int process_request(void *reqres_buffer)
 		int mode = openmode & 0x3;
 		uint16_t spopres = 0;
 
-		if (FileExists(path, 0))
+		stat64 *st = share_stat(path);
+		if (st && (st->st_mode & S_IFMT) == S_IFREG)
 		{
 			if ((actioncode & 0xF) == 1)
 			{
@@ -1013,12 +1227,11 @@ static int process_request(void *reqres_buffer)
 		*flt++ = 0;
 		key = add_lock(token);
 
-		const char* full_path = getFullPath(path);
-		DIR *d = opendir(full_path);
-		if (!d)
+		std::vector<dir_item_t> *items = list_dir(path);
+		if (!items)
 		{
 			locks.erase(key);
-			printf("Couldn't open dir: %s\n", full_path);
+			printf("Couldn't open dir: %s\n", getFullPath(path));
 			res = 0x12;
 			break;
 		}
@@ -1046,24 +1259,16 @@ static int process_request(void *reqres_buffer)
 		}
 		else
 		{
-			struct dirent64 de, *de2;
-			while ((de2 = readdir64(d)))
+			for (const dir_item_t &item : *items)
 			{
-				if (de2->d_type == DT_REG || (attr & FAT_DIR))
+				if ((item.de.d_type == DT_REG || (attr & FAT_DIR)) && cmp_name(item.de.d_name, flt))
 				{
-					memcpy(&de, de2, sizeof(dirent64));
-					sprintf(str, "%s/%s", path, de.d_name);
-					stat64 *st = getPathStat(str);
-
-					if (st && cmp_name(de.d_name, flt))
-					{
-						name83(de2->d_name, de.d_name);
-						de.d_name[11] = 0;
-						locks[key].dir_items.push_back({ de, *st });
-					}
+					dir_item_t found = item;
+					name83(item.de.d_name, found.de.d_name);
+					found.de.d_name[11] = 0;
+					locks[key].dir_items.push_back(found);
 				}
 			}
-			closedir(d);
 		}
 	}
 	// fall through
@@ -1095,28 +1300,36 @@ static int process_request(void *reqres_buffer)
 			break;
 		}
 
-		*buf++ = (locks[key].dir_items[idx].de.d_type == DT_DIR) ? FAT_DIR : 0;
-		memcpyb(buf, locks[key].dir_items[idx].de.d_name, 11);
-		buf += 11;
+		reslen = put_dir_item(buf, key, idx);
+		res = 0;
+	}
+	break;
 
-		tm *t = localtime(&locks[key].dir_items[idx].st.st_mtime);
-		uint16_t time = (t->tm_sec / 2) | (t->tm_min << 5) | (t->tm_hour << 11);
-		uint16_t date = t->tm_mday | ((t->tm_mon + 1) << 5) | ((t->tm_year - 80) << 9);
+	case AL_FINDMULTI:
+	{
+		dbg_print("> AL_FINDMULTI\n");
 
-		*buf++ = time;
-		*buf++ = time >> 8;
-		*buf++ = date;
-		*buf++ = date >> 8;
+		// key and last index as in FINDNEXT, then the max number of entries
+		key = *(short *)buf;
+		idx = *(unsigned short *)(buf + 2) + 1;
+		int max = *(unsigned short *)(buf + 4);
+		if (max <= 0 || max > MULTI_MAX) max = MULTI_MAX;
 
-		memcpyb(buf, &locks[key].dir_items[idx].st.st_size, 4);
-		buf += 4;
-		*buf++ = key;
-		*buf++ = key >> 8;
-		*buf++ = idx;
-		*buf++ = idx >> 8;
+		if (locks.find(key) == locks.end() || idx >= locks[key].dir_items.size())
+		{
+			locks.erase(key);
+			res = 0x12;
+			break;
+		}
+
+		while (max-- && idx < locks[key].dir_items.size())
+		{
+			int n = put_dir_item(buf, key, idx++);
+			buf += n;
+			reslen += n;
+		}
 
 		res = 0;
-		reslen = 24;
 	}
 	break;
 
@@ -1195,6 +1408,7 @@ void x86_share_poll()
 
 void x86_share_reset()
 {
+	cache_clear();
 	open_file_handles.clear();
 	locks.clear();
 	next_fp = 1;
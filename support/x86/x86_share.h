@@ -1,6 +1,6 @@
 
-#ifndef __MINIMIG_SHARE_H__
-#define __MINIMIG_SHARE_H__
+#ifndef __X86_SHARE_H__
+#define __X86_SHARE_H__
 
 #include <stdint.h>
 
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+#define RING_SIZE   8192   // events per thread, must be pow2
+#define MAX_RINGS   16
+#define TRACE_FILE  "/tmp/trace.json"
+
+enum
+{
+	EV_COMPLETE = 0,
+	EV_COUNTER,
+	EV_FLOW_BEGIN,
+	EV_FLOW_END,
+	EV_INSTANT
+};
+
+struct trace_event_t
+{
+	const char *cat;
+	const char *name;
+	uint64_t ts;
+	uint64_t dur;
+	int64_t  value;
+	uint8_t  type;
+};
+
+// single writer (the owning thread), the dump reads it without locking
+struct trace_ring_t
+{
+	std::atomic<uint32_t> head;
+	int tid;
+	char name[16];
+	trace_event_t ev[RING_SIZE];
+};
+
+std::atomic<bool> trace_on(false);
+uint32_t trace_min_ns = 20000;
+
+static trace_ring_t *rings[MAX_RINGS] = {};
+static std::atomic<int> ring_num(0);
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_ring_t *my_ring = nullptr;
+static __thread bool my_ring_failed = false;
+static uint64_t trace_start = 0;
+
+uint64_t trace_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static trace_ring_t *get_ring()
+{
+	if (my_ring || my_ring_failed) return my_ring;
+
+	pthread_mutex_lock(&ring_lock);
+	int n = ring_num.load(std::memory_order_relaxed);
+	if (n < MAX_RINGS) my_ring = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+	if (my_ring)
+	{
+		my_ring->tid = (int)syscall(SYS_gettid);
+		pthread_getname_np(pthread_self(), my_ring->name, sizeof(my_ring->name));
+		rings[n] = my_ring;
+		ring_num.store(n + 1, std::memory_order_release);
+	}
+	else
+	{
+		my_ring_failed = true;
+	}
+	pthread_mutex_unlock(&ring_lock);
+
+	return my_ring;
+}
+
+static trace_event_t *new_event(uint8_t type, const char *cat, const char *name, uint64_t ts)
+{
+	trace_ring_t *ring = get_ring();
+	if (!ring) return nullptr;
+
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	trace_event_t *ev = &ring->ev[head % RING_SIZE];
+	ev->type = type;
+	ev->cat = cat;
+	ev->name = name;
+	ev->ts = ts;
+	ev->dur = 0;
+	ev->value = 0;
+	return ev;
+}
+
+static void commit_event(trace_ring_t *ring)
+{
+	ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void trace_complete(const char *cat, const char *name, uint64_t start, uint64_t end)
+{
+	trace_event_t *ev = new_event(EV_COMPLETE, cat, name, start);
+	if (!ev) return;
+
+	ev->dur = end - start;
+	commit_event(my_ring);
+}
+
+void trace_counter(const char *cat, const char *name, int64_t value)
+{
+	trace_event_t *ev = new_event(EV_COUNTER, cat, name, trace_now());
+	if (!ev) return;
+
+	ev->value = value;
+	commit_event(my_ring);
+}
+
+void trace_flow(const char *cat, const char *name, uint32_t id, bool begin)
+{
+	trace_event_t *ev = new_event(begin ? EV_FLOW_BEGIN : EV_FLOW_END, cat, name, trace_now());
+	if (!ev) return;
+
+	ev->value = id;
+	commit_event(my_ring);
+}
+
+void trace_instant(const char *cat, const char *name)
+{
+	if (new_event(EV_INSTANT, cat, name, trace_now())) commit_event(my_ring);
+}
+
+void trace_enable(bool on)
+{
+	if (on == trace_enabled()) return;
+
+	if (on && !trace_start) trace_start = trace_now();
+	trace_on.store(on, std::memory_order_relaxed);
+	printf("Trace: %s.\n", on ? "on" : "off");
+}
+
+static double ts_us(uint64_t ns)
+{
+	return (ns < trace_start) ? 0 : (ns - trace_start) / 1000.0;
+}
+
+int trace_dump(const char *path)
+{
+	if (!path || !*path) path = TRACE_FILE;
+
+	FILE *f = fopen(path, "w");
+	if (!f)
+	{
+		printf("Trace: cannot create %s.\n", path);
+		return 0;
+	}
+
+	// stop recording so the rings are not overwritten while being read
+	bool was_on = trace_enabled();
+	trace_on.store(false, std::memory_order_relaxed);
+	usleep(1000);
+
+	uint32_t total = 0;
+	int pid = getpid();
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"MiSTer\"}}", pid);
+
+	int n = ring_num.load(std::memory_order_acquire);
+	for (int r = 0; r < n; r++)
+	{
+		trace_ring_t *ring = rings[r];
+		uint32_t head = ring->head.load(std::memory_order_acquire);
+		uint32_t tail = (head > RING_SIZE) ? head - RING_SIZE : 0;
+
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid, ring->tid, ring->name);
+
+		for (uint32_t i = tail; i != head; i++)
+		{
+			// a writer that was already past the trace_on check may still wrap
+			// onto the oldest entries, drop the ones reused during the copy
+			trace_event_t copy = ring->ev[i % RING_SIZE];
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (ring->head.load(std::memory_order_relaxed) - i >= RING_SIZE) continue;
+
+			trace_event_t *ev = &copy;
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", ev->name, ev->cat, pid, ring->tid, ts_us(ev->ts));
+
+			switch (ev->type)
+			{
+			case EV_COMPLETE:
+				fprintf(f, ",\"ph\":\"X\",\"dur\":%.3f}", ev->dur / 1000.0);
+				break;
+
+			case EV_COUNTER:
+				fprintf(f, ",\"ph\":\"C\",\"args\":{\"value\":%lld}}", (long long)ev->value);
+				break;
+
+			case EV_FLOW_BEGIN:
+				fprintf(f, ",\"ph\":\"s\",\"id\":%lld}", (long long)ev->value);
+				break;
+
+			case EV_FLOW_END:
+				fprintf(f, ",\"ph\":\"f\",\"bp\":\"e\",\"id\":%lld}", (long long)ev->value);
+				break;
+
+			default:
+				fprintf(f, ",\"ph\":\"i\",\"s\":\"t\"}");
+				break;
+			}
+			total++;
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	trace_on.store(was_on, std::memory_order_relaxed);
+	printf("Trace: %u events written to %s.\n", total, path);
+	return 1;
+}
+
+// "on", "off", "min <us>" or "dump [file]"
+void trace_cmd(const char *cmd)
+{
+	while (*cmd == ' ' || *cmd == '\t') cmd++;
+
+	if (!strcmp(cmd, "on")) trace_enable(true);
+	else if (!strcmp(cmd, "off")) trace_enable(false);
+	else if (!strncmp(cmd, "min ", 4))
+	{
+		trace_min_ns = strtoul(cmd + 4, NULL, 0) * 1000;
+		printf("Trace: minimum scope duration %uus.\n", trace_min_ns / 1000);
+	}
+	else if (!strncmp(cmd, "dump", 4))
+	{
+		cmd += 4;
+		while (*cmd == ' ' || *cmd == '\t') cmd++;
+		trace_dump(cmd);
+	}
+	else printf("Trace: unknown command: %s\n", cmd);
+}
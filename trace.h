@@ -0,0 +1,65 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <inttypes.h>
+#include <atomic>
+
+// Event tracing available in release builds. Enabled with trace=1 in MiSTer.ini
+// or by writing "trace on" to /dev/MiSTer_cmd. "trace dump [file]" writes the
+// recorded events in Chrome trace JSON format, which also opens in Perfetto.
+// Every thread records into its own ring, the oldest events are overwritten.
+// Scopes shorter than the minimum duration ("trace min <us>", 20us by default)
+// are dropped so the per-loop scopes don't push the interesting ones out.
+
+extern std::atomic<bool> trace_on;
+extern uint32_t trace_min_ns;
+
+void trace_enable(bool on);
+void trace_cmd(const char *cmd);
+int  trace_dump(const char *path);
+
+uint64_t trace_now();
+void trace_complete(const char *cat, const char *name, uint64_t start, uint64_t end);
+void trace_counter(const char *cat, const char *name, int64_t value);
+void trace_flow(const char *cat, const char *name, uint32_t id, bool begin);
+void trace_instant(const char *cat, const char *name);
+
+static inline bool trace_enabled()
+{
+	return trace_on.load(std::memory_order_relaxed);
+}
+
+struct TraceScope
+{
+	const char *cat;
+	const char *name;
+	uint64_t start;
+
+	TraceScope(const char *cat, const char *name)
+		: cat(cat)
+		, name(name)
+		, start(trace_enabled() ? trace_now() : 0)
+	{
+	}
+
+	~TraceScope()
+	{
+		// trace_dump turns recording off while it reads the rings
+		if (start && trace_enabled())
+		{
+			uint64_t end = trace_now();
+			if (end - start >= trace_min_ns) trace_complete(cat, name, start, end);
+		}
+	}
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+
+#define TRACE_SCOPE(cat, name) TraceScope TRACE_CONCAT(__trace_scope, __LINE__)(cat, name)
+#define TRACE_COUNTER(cat, name, value) do { if (trace_enabled()) trace_counter(cat, name, value); } while (0)
+#define TRACE_FLOW_BEGIN(cat, name, id) do { if (trace_enabled()) trace_flow(cat, name, id, true); } while (0)
+#define TRACE_FLOW_END(cat, name, id) do { if (trace_enabled()) trace_flow(cat, name, id, false); } while (0)
+#define TRACE_INSTANT(cat, name) do { if (trace_enabled()) trace_instant(cat, name); } while (0)
+
+#endif
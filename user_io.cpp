@@ -36,12 +36,14 @@
 #include "ide_cdrom.h"
 #include "support/minimig/akiko_cd32.h"
 #include "support/minimig/cdtv_cd.h"
-#ifdef PROFILING
 #include "profiling.h"
-#endif
 #include "frame_timer.h"
 #include "scaler.h"
 #include "support.h"
+#include "offload.h"
+#include "file_hash.h"
+#include "scheduler.h"
+#include <pthread.h>
 
 static char core_path[1024] = {};
 static char rbf_path[1024] = {};
@@ -1475,6 +1477,7 @@ void user_io_init(const char *path, const char *xml)
 
 	cfg_parse();
 	cfg_print();
+	if (cfg.trace) trace_enable(true);
 	while (cfg.waitmount[0] && !is_menu())
 	{
 		printf("> > > wait for %s mount < < <\n", cfg.waitmount);
@@ -1581,11 +1584,13 @@ void user_io_init(const char *path, const char *xml)
 					printf("Identified Minimig V2 core");
 					BootInit();
 					a2065_start();
+					scheduler_add("minimig_share", minimig_share_poll, 0, 1000);
 				}
 				else if (is_x86() || is_pcxt())
 				{
 					x86_config_load();
 					x86_init();
+					scheduler_add("x86_share", x86_share_poll, 0, 1000);
 				}
 				else if (is_archie())
 				{
@@ -1795,6 +1800,7 @@ void user_io_l_analog_joystick(unsigned char joystick, char valueX, char valueY)
 			spi8(valueY);
 		}
 		DisableIO();
+		input_latency_mark();
 	}
 }
 
@@ -1812,6 +1818,7 @@ void user_io_r_analog_joystick(unsigned char joystick, char valueX, char valueY)
 			spi8(valueY);
 		}
 		DisableIO();
+		input_latency_mark();
 	}
 }
 
@@ -1826,6 +1833,7 @@ void user_io_digital_joystick(unsigned char joystick, uint32_t map, int newdir)
 	spi_w(map);
 	if(use32) spi_w(map >> 16);
 	DisableIO();
+	input_latency_mark();
 
 	if (!is_minimig() && joy_transl == 1 && newdir)
 	{
@@ -2070,10 +2078,17 @@ void user_io_set_download(unsigned char enable, int addr)
 
 void user_io_file_tx_data(const uint8_t *addr, uint32_t len)
 {
-	EnableFpga();
-	spi8(FIO_FILE_TX_DAT);
-	spi_write(addr, len, fio_size);
-	DisableFpga();
+	uint32_t max = spi_max_transfer();
+	while (len)
+	{
+		uint32_t n = (len > max) ? max : len;
+		EnableFpga();
+		spi8(FIO_FILE_TX_DAT);
+		spi_write(addr, n, fio_size);
+		DisableFpga();
+		addr += n;
+		len -= n;
+	}
 }
 
 void user_io_set_upload(unsigned char enable, int addr)
@@ -2091,10 +2106,17 @@ void user_io_set_upload(unsigned char enable, int addr)
 
 void user_io_file_rx_data(uint8_t *addr, uint32_t len)
 {
-	EnableFpga();
-	spi8(FIO_FILE_TX_DAT);
-	spi_read(addr, len, fio_size);
-	DisableFpga();
+	uint32_t max = spi_max_transfer();
+	while (len)
+	{
+		uint32_t n = (len > max) ? max : len;
+		EnableFpga();
+		spi8(FIO_FILE_TX_DAT);
+		spi_read(addr, n, fio_size);
+		DisableFpga();
+		addr += n;
+		len -= n;
+	}
 }
 
 void user_io_file_info(const char *ext)
@@ -2556,12 +2578,19 @@ static void send_pcolchr(const char* name, unsigned char index, int type)
 }
 
 static uint32_t file_crc;
+static file_hash_t file_hash;
+
 uint32_t user_io_get_file_crc()
 {
 	return file_crc;
 }
 
-void user_io_write_gameid(const char *filename, uint32_t crc32_val, const char *serial)
+const file_hash_t *user_io_get_file_hash()
+{
+	return &file_hash;
+}
+
+void user_io_write_gameid(const char *filename, uint32_t crc32_val, const char *serial, const file_hash_t *hash)
 {
 	if (!cfg.log_file_entry) return;
 
@@ -2598,6 +2627,16 @@ void user_io_write_gameid(const char *filename, uint32_t crc32_val, const char *
 		printf(" [%s]", serial);
 		wrote_something = 1;
 	}
+	if (hash && (hash->flags & FILE_HASH_MD5))
+	{
+		fprintf(f, "MD5: %s\n", file_hash_hex(hash->md5, sizeof(hash->md5)));
+		wrote_something = 1;
+	}
+	if (hash && (hash->flags & FILE_HASH_SHA1))
+	{
+		fprintf(f, "SHA1: %s\n", file_hash_hex(hash->sha1, sizeof(hash->sha1)));
+		wrote_something = 1;
+	}
 
 	// Ensure we always write something to the file
 	if (!wrote_something)
@@ -2701,10 +2740,155 @@ int user_io_file_tx_a(const char* name, uint16_t index)
 	return 1;
 }
 
+static uint32_t file_tx_chunk = 4096;
+static uint8_t *file_tx_buf = 0;
+static int file_tx_pipeline = 1;
+
+void user_io_set_file_tx_chunk(uint32_t size)
+{
+	if (size < 512) size = 512;
+	if (size == file_tx_chunk) return;
+
+	free(file_tx_buf);
+	file_tx_buf = 0;
+	file_tx_chunk = size;
+}
+
+void user_io_set_file_tx_pipeline(int enable)
+{
+	file_tx_pipeline = enable;
+}
+
+// Pipelined upload: an offload worker reads (and unzips) the file into a ring
+// of buffers while the main thread sends the previous ones to the FPGA.
+#define FILE_TX_PIPE_BUFS 4
+#define FILE_TX_PIPE_SIZE (256 * 1024)
+
+static pthread_mutex_t file_tx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t file_tx_cond = PTHREAD_COND_INITIALIZER;
+
+static struct
+{
+	uint8_t *buf[FILE_TX_PIPE_BUFS];
+	uint32_t len[FILE_TX_PIPE_BUFS];
+	uint32_t head, tail;
+	bool done;
+} file_tx_pipe = {};
+
+static void file_tx_reader(fileTYPE *f, uint32_t size)
+{
+	auto &p = file_tx_pipe;
+
+	while (size)
+	{
+		pthread_mutex_lock(&file_tx_lock);
+		while (p.head - p.tail == FILE_TX_PIPE_BUFS) pthread_cond_wait(&file_tx_cond, &file_tx_lock);
+		uint32_t slot = p.head % FILE_TX_PIPE_BUFS;
+		pthread_mutex_unlock(&file_tx_lock);
+
+		uint32_t chunk = (size > FILE_TX_PIPE_SIZE) ? FILE_TX_PIPE_SIZE : size;
+		int len = FileReadAdv(f, p.buf[slot], chunk);
+		if (len <= 0) break;
+
+		file_hash_update(&file_hash, p.buf[slot], len);
+
+		pthread_mutex_lock(&file_tx_lock);
+		p.len[slot] = len;
+		p.head++;
+		pthread_cond_signal(&file_tx_cond);
+		pthread_mutex_unlock(&file_tx_lock);
+
+		size -= len;
+	}
+
+	pthread_mutex_lock(&file_tx_lock);
+	p.done = true;
+	pthread_cond_signal(&file_tx_cond);
+	pthread_mutex_unlock(&file_tx_lock);
+}
+
+// returns 0 if pipeline couldn't be started
+static int file_tx_pipelined(fileTYPE *f, uint32_t size)
+{
+	auto &p = file_tx_pipe;
+
+	int ok = 1;
+	for (int i = 0; i < FILE_TX_PIPE_BUFS; i++)
+	{
+		p.buf[i] = (uint8_t*)malloc(FILE_TX_PIPE_SIZE);
+		if (!p.buf[i]) ok = 0;
+	}
+
+	p.head = p.tail = 0;
+	p.done = false;
+
+	// the main thread blocks on the reader, so don't queue it behind other jobs
+	if (ok && !offload_worker_idle()) ok = 0;
+	if (ok && !offload_try_add_work([f, size]() { file_tx_reader(f, size); }, nullptr, OFFLOAD_PRIO_HIGH)) ok = 0;
+
+	uint32_t sent = 0;
+	while (ok)
+	{
+		pthread_mutex_lock(&file_tx_lock);
+		while (p.tail == p.head && !p.done) pthread_cond_wait(&file_tx_cond, &file_tx_lock);
+		if (p.tail == p.head)
+		{
+			// reader has finished
+			pthread_mutex_unlock(&file_tx_lock);
+			break;
+		}
+		uint32_t slot = p.tail % FILE_TX_PIPE_BUFS;
+		uint32_t len = p.len[slot];
+		pthread_mutex_unlock(&file_tx_lock);
+
+		for (uint32_t pos = 0; pos < len;)
+		{
+			uint32_t chunk = (len - pos > file_tx_chunk) ? file_tx_chunk : len - pos;
+			user_io_file_tx_data(p.buf[slot] + pos, chunk);
+			ProgressMessage("Loading", f->name, sent + pos, size);
+			pos += chunk;
+		}
+		sent += len;
+
+		pthread_mutex_lock(&file_tx_lock);
+		p.tail++;
+		pthread_cond_signal(&file_tx_cond);
+		pthread_mutex_unlock(&file_tx_lock);
+	}
+
+	if (ok && sent < size)
+	{
+		// the core expects the full size, pad it like a failed read on the plain path
+		printf("Read error: only %u of %u bytes read.\n", sent, size);
+		memset(p.buf[0], 0, FILE_TX_PIPE_SIZE);
+		while (sent < size)
+		{
+			uint32_t chunk = (size - sent > file_tx_chunk) ? file_tx_chunk : size - sent;
+			if (chunk > FILE_TX_PIPE_SIZE) chunk = FILE_TX_PIPE_SIZE;
+			user_io_file_tx_data(p.buf[0], chunk);
+			file_hash_update(&file_hash, p.buf[0], chunk);
+			sent += chunk;
+		}
+	}
+
+	for (int i = 0; i < FILE_TX_PIPE_BUFS; i++)
+	{
+		free(p.buf[i]);
+		p.buf[i] = 0;
+	}
+
+	return ok;
+}
+
 int user_io_file_tx(const char* name, unsigned char index, char opensave, char mute, char composite, uint32_t load_addr)
 {
+	PROFILE_SCOPE_CAT("file", "user_io_file_tx");
 	fileTYPE f = {};
-	static uint8_t buf[4096];
+
+	// buffer is also used for paths, so never smaller than 4KB
+	if (!file_tx_buf) file_tx_buf = (uint8_t*)malloc((file_tx_chunk > 4096) ? file_tx_chunk : 4096);
+	uint8_t *buf = file_tx_buf;
+	if (!buf) return 0;
 
 	if (!FileOpen(&f, name, mute)) return 0;
 
@@ -2742,6 +2926,9 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 	int dosend = 1;
 	file_crc = 0;
 
+	// MD5 and SHA1 are only needed for the game id file
+	file_hash_init(&file_hash, FILE_HASH_CRC32 | (cfg.log_file_entry ? FILE_HASH_MD5 | FILE_HASH_SHA1 : 0));
+
 	int snes_file = SNES_FILE_RAW;
 	if (is_snes() && bytes2send && !load_addr)
 	{
@@ -2782,7 +2969,7 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 				uint32_t sz = fb.size;
 				while (sz)
 				{
-					uint32_t chunk = (sz > sizeof(buf)) ? sizeof(buf) : sz;
+					uint32_t chunk = (sz > file_tx_chunk) ? file_tx_chunk : sz;
 					FileReadAdv(&fb, buf, chunk);
 					user_io_file_tx_data(buf, chunk);
 					sz -= chunk;
@@ -2818,15 +3005,16 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 			uint8_t *rom = snes_get_mirrored_rom(&f, &rom_size);
 			if (rom) {
 				uint32_t orig_size = (f.size & 512) ? f.size - 512 : f.size;
-				file_crc = crc32(0, rom, orig_size);
 
 				uint32_t remaining = rom_size;
 				uint32_t sent = 0;
-				const uint32_t chunk_size = 4096;
+				const uint32_t chunk_size = file_tx_chunk;
 				while (remaining) {
 					uint32_t chunk = (remaining > chunk_size) ? chunk_size : remaining;
 					ProgressMessage("Loading", f.name, sent, rom_size);
 					user_io_file_tx_data(rom + sent, chunk);
+					// hash the original ROM only, not the mirrored part
+					if (sent < orig_size) file_hash_update(&file_hash, rom + sent, (orig_size - sent > chunk) ? chunk : orig_size - sent);
 					sent += chunk;
 					remaining -= chunk;
 				}
@@ -2836,7 +3024,7 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 		}
 	}
 
-	uint32_t skip = bytes2send & 0x3FF; // skip possible header up to 1023 bytes
+	file_hash.skip = bytes2send & 0x3FF; // skip possible header up to 1023 bytes
 
 	int use_progress = 1; // (bytes2send > (1024 * 1024)) ? 1 : 0;
 	int size = bytes2send;
@@ -2860,7 +3048,7 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 				uint32_t sz = fg.size;
 				while (sz)
 				{
-					uint32_t chunk = (sz > sizeof(buf)) ? sizeof(buf) : sz;
+					uint32_t chunk = (sz > file_tx_chunk) ? file_tx_chunk : sz;
 					FileReadAdv(&fg, buf, chunk);
 					user_io_file_tx_data(buf, chunk);
 					sz -= chunk;
@@ -2891,9 +3079,7 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 
 				uint32_t chunk = (bytes2send > (256 * 1024)) ? (256 * 1024) : bytes2send;
 				FileReadAdv(&f, mem + size - bytes2send + gap, chunk);
-
-				if(!is_snes() && use_cheats) file_crc = crc32(file_crc, mem + skip + size - bytes2send, chunk - skip);
-				skip = 0;
+				file_hash_update(&file_hash, mem + size - bytes2send + gap, chunk);
 
 				if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
 				bytes2send -= chunk;
@@ -2904,33 +3090,33 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 	}
 	else
 	{
+		if (dosend && file_tx_pipeline && bytes2send > FILE_TX_PIPE_SIZE && snes_file != SNES_FILE_BS &&
+			file_tx_pipelined(&f, bytes2send)) dosend = 0;
+
 		while (dosend && bytes2send)
 		{
-			uint32_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
+			uint32_t chunk = (bytes2send > file_tx_chunk) ? file_tx_chunk : bytes2send;
 
 			FileReadAdv(&f, buf, chunk);
 			if (is_snes() && (snes_file == SNES_FILE_BS)) snes_patch_bs_header(&f, buf);
 			user_io_file_tx_data(buf, chunk);
+			file_hash_update(&file_hash, buf, chunk);
 
 			if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
 			bytes2send -= chunk;
-
-			if (skip >= chunk) skip -= chunk;
-			else
-			{
-				file_crc = crc32(file_crc, buf + skip, chunk - skip);
-				skip = 0;
-			}
 		}
 	}
 
 	// check if core requests some change while downloading
 	check_status_change();
 
+	file_hash_final(&file_hash);
+	file_crc = file_hash.crc32;
+
 	printf("Done.\n");
 	printf("CRC32: %08X\n", file_crc);
 
-	user_io_write_gameid(name, file_crc);
+	user_io_write_gameid(name, file_crc, NULL, &file_hash);
 
 	FileClose(&f);
 
@@ -3207,7 +3393,6 @@ void user_io_poll()
 			send_rtc(1);
 		}
 
-		minimig_share_poll();
 		a2065_poll();
 	}
 
@@ -3245,6 +3430,7 @@ void user_io_poll()
 			uint16_t c = spi_uio_cmd_cont(UIO_GET_SDSTAT);
 			if (c & 0x8000)
 			{
+				scheduler_io_pending();
 				disk = (c >> 2) & 0xF;
 				op = c & 3;
 				ack = disk << 8;
@@ -4293,7 +4479,7 @@ void user_io_kbd(uint16_t key, int press)
 
 					if (osd_is_visible) menu_key_set(UPSTROKE | key);
 					// these modifiers should be passed to core even if OSD is open or they will get stuck!
-					if (!osd_is_visible || key == KEY_LEFTALT || key == KEY_RIGHTALT || key == KEY_LEFTMETA || key == KEY_RIGHTMETA) {send_keycode(key, press);}
+					if (!osd_is_visible || key == KEY_LEFTALT || key == KEY_RIGHTALT || key == KEY_LEFTMETA || key == KEY_RIGHTMETA) {send_keycode(key, press); input_latency_mark();}
 				}
 				if (is_menu_event) menu_key_set(KEY_F12 | UPSTROKE);
 			}
@@ -4363,7 +4549,11 @@ void user_io_kbd(uint16_t key, int press)
 					else
 					{
 						if(key == KEY_MENU) key = KEY_F12;
-						if(input_state()) send_keycode(key, press);
+						if (input_state())
+						{
+							send_keycode(key, press);
+							input_latency_mark();
+						}
 					}
 				}
 			}
@@ -9,6 +9,8 @@
 #include <inttypes.h>
 #include "file_io.h"
 
+struct file_hash_t;
+
 #define UIO_STATUS      0x00
 #define UIO_BUT_SW      0x01
 
@@ -189,7 +191,8 @@ int user_io_status_save(const char *filename);
 void user_io_status_reset();
 
 uint32_t user_io_get_file_crc();
-void user_io_write_gameid(const char *filename, uint32_t crc32_val = 0, const char *product_code = NULL);
+const file_hash_t *user_io_get_file_hash();
+void user_io_write_gameid(const char *filename, uint32_t crc32_val = 0, const char *product_code = NULL, const file_hash_t *hash = NULL);
 int  user_io_file_mount(const char *name, unsigned char index = 0, char pre = 0, int pre_size = 0);
 void user_io_bufferinvalidate(unsigned char index);
 char *user_io_make_filepath(const char *path, const char *filename);
@@ -223,6 +226,8 @@ void user_io_send_buttons(char);
 uint16_t user_io_get_sdram_cfg();
 
 int user_io_file_tx(const char* name, unsigned char index = 0, char opensave = 0, char mute = 0, char composite = 0, uint32_t load_addr = 0);
+void user_io_set_file_tx_chunk(uint32_t size);
+void user_io_set_file_tx_pipeline(int enable);
 int user_io_file_tx_a(const char* name, uint16_t index);
 unsigned char user_io_ext_idx(char *, char*);
 void user_io_set_index(unsigned char index);
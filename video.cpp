@@ -11,6 +11,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <math.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "hardware.h"
 #include "user_io.h"
@@ -32,6 +34,7 @@
 #include "support/arcade/mra_loader.h"
 #include "lib/imlib2/Imlib2.h"
 #include "lib/md5/md5.h"
+#include "file_hash.h"
 
 #define FB_SIZE  (1920*1080)
 #define FB_ADDR  (0x20000000 + (32*1024*1024)) // 512mb + 32mb(Core's fb)
@@ -3788,54 +3791,350 @@ static void vs_wait()
 	printf("vs_wait(us): %llu\n", t2 - t1);
 }
 
-static char *get_file_fromdir(const char* dir, int num, int *count)
+static uint32_t get_random()
 {
-	static char name[256+32];
+	uint32_t rnd;
+	int rndfd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (rndfd >= 0)
+	{
+		read(rndfd, &rnd, sizeof(rnd));
+		close(rndfd);
+	}
+
+	return rnd;
+}
+
+// Menu wallpaper. Decoding a large picture takes seconds on the ARM, so it is
+// done by an offload worker, scaled to the framebuffer and kept in config/bgcache
+// as raw pixels. While the menu is shown the next wallpaper is prepared the
+// same way, so a random wallpaper comes up without decoding at the next start.
+#define BGCACHE_DIR   CONFIG_DIR"/bgcache"
+#define BGCACHE_MAGIC 0x3147424D // "MBG1"
+#define BGCACHE_FILES 4
+
+enum
+{
+	BG_IDLE = 0,
+	BG_PENDING,
+	BG_READY,
+	BG_NONE
+};
+
+struct bgcache_header_t
+{
+	uint32_t magic;
+	uint32_t width;
+	uint32_t height;
+	uint32_t reserved;
+	int64_t  mtime;
+	uint64_t size;
+	char     path[1024];
+};
+
+struct bg_job_t
+{
+	char      path[1024];   // wallpaper, picked from dir if empty
+	char      dir[1024];
+	char      cache[1024];
+	char      name[256];
+	int       width;
+	int       height;
+	uint32_t *pixels;
+};
+
+// imlib2 is not thread safe: held by the worker while it decodes
+static pthread_mutex_t imlib_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int bg_state = BG_IDLE;
+static uint32_t *bg_pixels = 0;
+static int bg_pixels_w = 0, bg_pixels_h = 0;
+static int bg_redraw = 0;
+
+void video_imlib_lock()
+{
+	pthread_mutex_lock(&imlib_mutex);
+}
+
+void video_imlib_unlock()
+{
+	pthread_mutex_unlock(&imlib_mutex);
+}
+
+static int is_wallpaper(const char *name)
+{
+	int len = strlen(name);
+	return len > 4 && name[0] != '.' && (!strcasecmp(name + len - 4, ".png") || !strcasecmp(name + len - 4, ".jpg"));
+}
+
+// Single pass over the folder: the wallpaper prepared last time if it is
+// still there, otherwise a random one (reservoir sampling) other than avoid.
+static int bg_pick(const char *dir, const char *hint, const char *avoid, char *name, size_t len)
+{
+	DIR *d = opendir(dir);
+	if (!d) return 0;
+
+	uint32_t rnd = get_random();
+	int cnt = 0, has_hint = 0;
 	name[0] = 0;
-	if(count) *count = 0;
-	DIR *d = opendir(getFullPath(dir));
-	if (d)
+
+	struct dirent *de;
+	while ((de = readdir(d)))
 	{
+		if (!is_wallpaper(de->d_name)) continue;
+		if (hint[0] && !strcmp(de->d_name, hint)) has_hint = 1;
+		if (avoid && !strcmp(de->d_name, avoid)) continue;
+
+		rnd = rnd * 1103515245 + 12345;
+		if (!((rnd >> 8) % ++cnt)) snprintf(name, len, "%s", de->d_name);
+	}
+	closedir(d);
+
+	if (has_hint) snprintf(name, len, "%s", hint);
+	return name[0] != 0;
+}
+
+static void bg_hint_file(const char *cache, char *file, size_t len)
+{
+	snprintf(file, len, "%s/next", cache);
+}
+
+static void bg_read_hint(const char *cache, char *hint, size_t len)
+{
+	char file[1100];
+	bg_hint_file(cache, file, sizeof(file));
+
+	hint[0] = 0;
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+
+	ssize_t n = read(fd, hint, len - 1);
+	hint[n > 0 ? n : 0] = 0;
+	close(fd);
+	unlink(file);
+}
+
+static void bg_write_hint(const char *cache, const char *name)
+{
+	char file[1100];
+	bg_hint_file(cache, file, sizeof(file));
+
+	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) return;
+	write(fd, name, strlen(name));
+	close(fd);
+}
+
+static uint32_t *bgcache_load(const char *file, const char *path, const struct stat *st, int width, int height)
+{
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	uint32_t *pixels = NULL;
+	size_t size = (size_t)width * height * 4;
+
+	bgcache_header_t hdr;
+	if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == BGCACHE_MAGIC &&
+		hdr.width == (uint32_t)width && hdr.height == (uint32_t)height &&
+		hdr.mtime == (int64_t)st->st_mtime && hdr.size == (uint64_t)st->st_size &&
+		!strncmp(hdr.path, path, sizeof(hdr.path)))
+	{
+		pixels = (uint32_t*)malloc(size);
+		if (pixels && read(fd, pixels, size) != (ssize_t)size)
+		{
+			free(pixels);
+			pixels = NULL;
+		}
+	}
+
+	close(fd);
+	return pixels;
+}
+
+// keep the most recently written ones, there is one per wallpaper and resolution
+static void bgcache_prune(const char *cache)
+{
+	while (1)
+	{
+		DIR *d = opendir(cache);
+		if (!d) return;
+
+		char oldest[256] = {};
+		time_t oldest_time = 0;
 		int cnt = 0;
-		struct dirent *de = readdir(d);
-		while (de)
+
+		struct dirent *de;
+		while ((de = readdir(d)))
 		{
 			int len = strlen(de->d_name);
-			if (len > 4 && (de->d_name[0] != '.') && (!strcasecmp(de->d_name + len - 4, ".png") || !strcasecmp(de->d_name + len - 4, ".jpg")))
+			if (len < 5 || strcasecmp(de->d_name + len - 4, ".raw")) continue;
+
+			char file[1400];
+			struct stat st;
+			snprintf(file, sizeof(file), "%s/%s", cache, de->d_name);
+			if (stat(file, &st)) continue;
+
+			if (!cnt++ || st.st_mtime < oldest_time)
 			{
-				if (num == cnt) break;
-				cnt++;
+				oldest_time = st.st_mtime;
+				snprintf(oldest, sizeof(oldest), "%s", de->d_name);
 			}
-
-			de = readdir(d);
 		}
+		closedir(d);
+
+		if (cnt <= BGCACHE_FILES) return;
+
+		char file[1400];
+		snprintf(file, sizeof(file), "%s/%s", cache, oldest);
+		if (unlink(file)) return;
+	}
+}
+
+static void bgcache_save(const char *file, const char *cache, const char *path, const struct stat *st, int width, int height, const uint32_t *pixels)
+{
+	bgcache_header_t hdr = {};
+	hdr.magic = BGCACHE_MAGIC;
+	hdr.width = width;
+	hdr.height = height;
+	hdr.mtime = st->st_mtime;
+	hdr.size = st->st_size;
+	snprintf(hdr.path, sizeof(hdr.path), "%s", path);
+
+	char tmp[1200];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) return;
+
+	size_t size = (size_t)width * height * 4;
+	int ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && write(fd, pixels, size) == (ssize_t)size;
+	close(fd);
+
+	if (!ok || rename(tmp, file))
+	{
+		unlink(tmp);
+		return;
+	}
+
+	bgcache_prune(cache);
+}
+
+// Same result as blending the picture onto the cleared framebuffer.
+static uint32_t *bg_decode(const char *path, int width, int height)
+{
+	uint32_t *pixels = NULL;
+
+	pthread_mutex_lock(&imlib_mutex);
+	Imlib_Context ctx = imlib_context_new();
+	imlib_context_push(ctx);
+
+	Imlib_Load_Error error = IMLIB_LOAD_ERROR_NONE;
+	Imlib_Image img = imlib_load_image_with_error_return(path, &error);
+	if (img)
+	{
+		imlib_context_set_image(img);
+		int src_w = imlib_image_get_width();
+		int src_h = imlib_image_get_height();
 
-		if (de)
+		Imlib_Image out = imlib_create_image(width, height);
+		if (out)
 		{
-			snprintf(name, sizeof(name), "%s/%s", dir, de->d_name);
+			imlib_context_set_image(out);
+			uint32_t *data = imlib_image_get_data();
+			memset(data, 0, (size_t)width * height * 4);
+			imlib_image_put_back_data(data);
+
+			imlib_blend_image_onto_image(img, 0, 0, 0, src_w, src_h, 0, 0, width, height);
+
+			pixels = (uint32_t*)malloc((size_t)width * height * 4);
+			if (pixels) memcpy(pixels, imlib_image_get_data_for_reading_only(), (size_t)width * height * 4);
+			imlib_free_image();
 		}
-		closedir(d);
-		if(count) *count = cnt;
+
+		imlib_context_set_image(img);
+		imlib_free_image_and_decache();
 	}
+	else
+	{
+		printf("Image %s loading error %d\n", path, error);
+	}
+
+	imlib_context_pop();
+	imlib_context_free(ctx);
+	pthread_mutex_unlock(&imlib_mutex);
 
-	return name;
+	return pixels;
 }
 
-static uint32_t get_random()
+static uint32_t *bg_prepare(const char *path, const char *cache, int width, int height)
 {
-	uint32_t rnd;
-	int rndfd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
-	if (rndfd >= 0)
+	struct stat st;
+	if (stat(path, &st)) return NULL;
+
+	int dim[2] = { width, height };
+	uint32_t crc = file_crc32(0, path, strlen(path));
+	crc = file_crc32(crc, dim, sizeof(dim));
+
+	char file[1100];
+	snprintf(file, sizeof(file), "%s/%08X.raw", cache, crc);
+
+	uint32_t *pixels = bgcache_load(file, path, &st, width, height);
+	if (pixels) return pixels;
+
+	uint64_t t = getus();
+	pixels = bg_decode(path, width, height);
+	if (!pixels) return NULL;
+
+	printf("Wallpaper %s decoded in %llums.\n", path, (unsigned long long)(getus() - t) / 1000);
+	bgcache_save(file, cache, path, &st, width, height, pixels);
+	return pixels;
+}
+
+static void bg_job_done()
+{
+	// redraw when the picture has arrived or a redraw had to skip imlib
+	if (bg_redraw && is_menu() && menu_bg && !video_fb_state())
 	{
-		read(rndfd, &rnd, sizeof(rnd));
-		close(rndfd);
+		bg_redraw = 0;
+		video_menu_bg(-1);
 	}
+}
 
-	return rnd;
+static void bg_prefetch(const bg_job_t *cur)
+{
+	if (!cur->dir[0] || !cur->name[0]) return;
+
+	bg_job_t *job = new bg_job_t(*cur);
+	job->pixels = NULL;
+
+	if (!offload_try_add_work([job]()
+		{
+			char hint[1] = {};
+			char cur_name[256];
+			strcpy(cur_name, job->name);
+			if (!bg_pick(job->dir, hint, cur_name, job->name, sizeof(job->name))) return;
+
+			snprintf(job->path, sizeof(job->path), "%s/%s", job->dir, job->name);
+			uint32_t *pixels = bg_prepare(job->path, job->cache, job->width, job->height);
+			if (pixels) bg_write_hint(job->cache, job->name);
+			free(pixels);
+		},
+		[job](bool)
+		{
+			delete job;
+			bg_job_done();
+		}, OFFLOAD_PRIO_LOW))
+	{
+		delete job;
+	}
 }
 
-static Imlib_Image load_bg()
+static void bg_request(int width, int height)
 {
+	bg_job_t *job = new bg_job_t;
+	memset(job, 0, sizeof(bg_job_t));
+	job->width = width;
+	job->height = height;
+
 	const char* fname = "menu.png";
 	if (!FileExists(fname))
 	{
@@ -3843,7 +4142,11 @@ static Imlib_Image load_bg()
 		if (!FileExists(fname)) fname = 0;
 	}
 
-	if (!fname)
+	if (fname)
+	{
+		snprintf(job->path, sizeof(job->path), "%s", getFullPath(fname));
+	}
+	else
 	{
 		static char bgdir[128];
 		static char label[64];
@@ -3857,27 +4160,87 @@ static Imlib_Image load_bg()
 		sprintf(bgdir, "wallpapers%s", label);
 		if (alt <= 0 || !cfg_name[0] || !PathIsDir(bgdir)) strcpy(bgdir, "wallpapers");
 
-		if (PathIsDir(bgdir))
+		if (!PathIsDir(bgdir))
 		{
-			int count = 0;
-			get_file_fromdir(bgdir, -1, &count);
-			if (count > 0) fname = get_file_fromdir(bgdir, get_random() % count, &count);
+			delete job;
+			bg_state = BG_NONE;
+			return;
 		}
+
+		snprintf(job->dir, sizeof(job->dir), "%s", getFullPath(bgdir));
 	}
 
-	if (fname)
+	FileCreatePath(BGCACHE_DIR);
+	snprintf(job->cache, sizeof(job->cache), "%s", getFullPath(BGCACHE_DIR));
+
+	if (!offload_try_add_work([job]()
+		{
+			if (!job->path[0])
+			{
+				char hint[256];
+				bg_read_hint(job->cache, hint, sizeof(hint));
+				if (!bg_pick(job->dir, hint, NULL, job->name, sizeof(job->name))) return;
+				snprintf(job->path, sizeof(job->path), "%s/%s", job->dir, job->name);
+			}
+
+			job->pixels = bg_prepare(job->path, job->cache, job->width, job->height);
+		},
+		[job](bool cancelled)
+		{
+			if (cancelled)
+			{
+				free(job->pixels);
+				job->pixels = NULL;
+			}
+
+			if (job->pixels)
+			{
+				free(bg_pixels);
+				bg_pixels = job->pixels;
+				bg_pixels_w = job->width;
+				bg_pixels_h = job->height;
+				bg_state = BG_READY;
+				bg_redraw = 1;
+			}
+			else
+			{
+				bg_state = cancelled ? BG_IDLE : BG_NONE;
+				bg_redraw = !cancelled;
+			}
+
+			// show the new picture before the next one is decoded
+			bg_job_done();
+			if (job->pixels) bg_prefetch(job);
+			delete job;
+		}))
+	{
+		delete job;
+		return;
+	}
+
+	bg_state = BG_PENDING;
+}
+
+// copy the prepared wallpaper inside the borders, returns 0 if there is none yet
+static int draw_wallpaper()
+{
+	int width = fb_width - (brd_x * 2);
+	int height = fb_height - (brd_y * 2);
+
+	if (bg_state == BG_READY && (bg_pixels_w != width || bg_pixels_h != height)) bg_state = BG_IDLE;
+	if (bg_state == BG_IDLE) bg_request(width, height);
+	if (bg_state != BG_READY) return 0;
+
+	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	for (int y = 0; y < height; y++)
 	{
-		Imlib_Load_Error error = IMLIB_LOAD_ERROR_NONE;
-		Imlib_Image img = imlib_load_image_with_error_return(getFullPath(fname), &error);
-		if (img) return img;
-		printf("Image %s loading error %d\n", fname, error);
+		memcpy((void*)(buf + (y + brd_y) * fb_width + brd_x), bg_pixels + y * width, width * 4);
 	}
 
-	return NULL;
+	return 1;
 }
 
 static Imlib_Image *bg = 0;
-static Imlib_Image menubg = 0;
 static int bg_has_picture = 0;
 extern uint8_t  _binary_logo_png_start[], _binary_logo_png_end[];
 
@@ -3886,17 +4249,26 @@ void video_menu_bg(int n, int idle)
 	static Imlib_Image bg1 = 0, bg2 = 0;
 	static Imlib_Image curtain = 0;
 
+	static Imlib_Image nobg = 0;
+
 	static int cached_idle = 0;
 	bg_has_picture = 0;
 
+	// while a wallpaper is being decoded, draw without logo and curtain and redo it when done
+	int imlib_ok = !pthread_mutex_trylock(&imlib_mutex);
+	if (!imlib_ok) bg_redraw = 1;
+
 	if (n < 0)
 	{
 		n = menu_bg;
 		idle = cached_idle;
 
-		if (bg1) { imlib_context_set_image(bg1); imlib_free_image(); bg1 = 0; }
-		if (bg2) { imlib_context_set_image(bg2); imlib_free_image(); bg2 = 0; }
-		if (curtain) { imlib_context_set_image(curtain); imlib_free_image(); curtain = 0; }
+		if (imlib_ok)
+		{
+			if (bg1) { imlib_context_set_image(bg1); imlib_free_image(); bg1 = 0; }
+			if (bg2) { imlib_context_set_image(bg2); imlib_free_image(); bg2 = 0; }
+			if (curtain) { imlib_context_set_image(curtain); imlib_free_image(); curtain = 0; }
+		}
 	}
 	else
 	{
@@ -3911,7 +4283,7 @@ void video_menu_bg(int n, int idle)
 
 		Imlib_Load_Error error;
 		static Imlib_Image logo = 0;
-		if (!logo)
+		if (!logo && imlib_ok)
 		{
 			unlink("/tmp/logo.png");
 			if (FileSave("/tmp/logo.png", _binary_logo_png_start, _binary_logo_png_end - _binary_logo_png_start))
@@ -3947,15 +4319,22 @@ void video_menu_bg(int n, int idle)
 
 		menu_bgn = (menu_bgn == 1) ? 2 : 1;
 
-		if (!bg1) bg1 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 1)));
-		if (!bg1) printf("Warning: bg1 is 0\n");
-		if (!bg2) bg2 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 2)));
-		if (!bg2) printf("Warning: bg2 is 0\n");
+		if (imlib_ok)
+		{
+			if (!bg1) bg1 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 1)));
+			if (!bg1) printf("Warning: bg1 is 0\n");
+			if (!bg2) bg2 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 2)));
+			if (!bg2) printf("Warning: bg2 is 0\n");
 
-		bg = (menu_bgn == 1) ? &bg1 : &bg2;
+			bg = (menu_bgn == 1) ? &bg1 : &bg2;
+		}
+		else
+		{
+			bg = &nobg;
+		}
 		//printf("*bg = %p\n", *bg);
 
-		if (!curtain)
+		if (!curtain && imlib_ok)
 		{
 			curtain = imlib_create_image(fb_width, fb_height);
 			imlib_context_set_image(curtain);
@@ -3976,32 +4355,12 @@ void video_menu_bg(int n, int idle)
 			switch (n)
 			{
 			case 1:
-				if (!menubg) menubg = load_bg();
-				if (menubg)
+				if (draw_wallpaper())
 				{
-					imlib_context_set_image(menubg);
-					int src_w = imlib_image_get_width();
-					int src_h = imlib_image_get_height();
-					//printf("menubg: src_w=%d, src_h=%d\n", src_w, src_h);
-
-					if (*bg)
-					{
-						imlib_context_set_image(*bg);
-						imlib_blend_image_onto_image(menubg, 0,
-							0, 0,                           //int source_x, int source_y,
-							src_w, src_h,                   //int source_width, int source_height,
-							brd_x, brd_y,                   //int destination_x, int destination_y,
-							fb_width - (brd_x * 2), fb_height - (brd_y * 2) //int destination_width, int destination_height
-						);
-						bg_has_picture = 1;
-						break;
-					}
-					else
-					{
-						printf("*bg = 0!\n");
-					}
+					bg_has_picture = 1;
+					break;
 				}
-				draw_checkers();
+				if (bg_state != BG_PENDING) draw_checkers();
 				break;
 			case 2:
 				draw_hbars1();
@@ -4024,7 +4383,7 @@ void video_menu_bg(int n, int idle)
 			}
 		}
 
-		if (cfg.logo && logo && !idle)
+		if (cfg.logo && logo && !idle && imlib_ok)
 		{
 			imlib_context_set_image(logo);
 
@@ -4079,7 +4438,7 @@ void video_menu_bg(int n, int idle)
 			}
 		}
 
-		if (logo && idle == 4)
+		if (logo && idle == 4 && imlib_ok)
 		{
 			imlib_context_set_image(logo);
 
@@ -4121,7 +4480,7 @@ void video_menu_bg(int n, int idle)
 				}
 			}
 		}
-		else
+		else if (imlib_ok)
 		{
 			printf("curtain = 0!\n");
 		}
@@ -4131,13 +4490,14 @@ void video_menu_bg(int n, int idle)
 		//printf("**** BG DEBUG END ****\n");
 	}
 
+	if (imlib_ok) pthread_mutex_unlock(&imlib_mutex);
 	video_fb_enable(0);
 }
 
 void dbg_draw_cursor(int x, int y)
 {
 	static int c = 0;
-	if (menubg)
+	if (bg_has_picture && bg && *bg && !pthread_mutex_trylock(&imlib_mutex))
 	{
 		imlib_context_set_image(*bg);
 		int src_w = imlib_image_get_width();
@@ -4150,6 +4510,7 @@ void dbg_draw_cursor(int x, int y)
 
 		imlib_context_set_color(c == 0 ? 255 : 0, c == 1 ? 255 : 0, c == 2 ? 255 : 0, 255);
 		imlib_image_fill_ellipse(x, y, 10, 10);
+		pthread_mutex_unlock(&imlib_mutex);
 	}
 }
 
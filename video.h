@@ -78,4 +78,8 @@ char* video_get_core_mode_name(int with_vrefresh = 1);
 
 void dbg_draw_cursor(int x, int y);
 
+// imlib2 is shared with background workers, hold this around any use of it
+void video_imlib_lock();
+void video_imlib_unlock();
+
 #endif // VIDEO_H